@@ -6,8 +6,177 @@
 #include "TFile.h"
 #include "AnalyticFieldModel.h"
 #include "Rossegger.h"
+#include "SimpleFFT.h"
+#include "DistortionMap.h"
+#include "CacheFile.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #define ALMOST_ZERO 0.00001
+#define LOOKUP_CACHE_VERSION 5 //bump this whenever the meaning or layout of a cached lookup table changes.  (2: rossegger zeros found exactly, which fixes N2mn at high m.  3: rossegger Ephi turned on.  4: and zero in the source phi plane.  5: the midpoint of Er and Ez where r==r1 or z==z1.)
+
+static_assert(sizeof(LookupVector3)==3*sizeof(LookupScalar),"lookup cache files and the fieldmap kernels assume LookupVector3 is exactly (x,y,z)");
+
+//fixed-size header at the front of every lookup cache file, followed by the (x,y,z) LookupScalars of every element of the table.
+//the precision is part of the cache key, so float and double builds keep separate files.
+struct LookupCacheHeader{
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  uint64_t key; //hash of everything the table depends on.  see lookup_cache_key.
+  int32_t dim;
+  int32_t n[6];
+  uint64_t length; //number of elements in the table
+  uint64_t checksum; //hash of the data block, to catch truncated or corrupted files.
+};
+static const char lookupCacheMagic[8]={'A','F','S','L','U','T','\0','\0'};
+
+template <class S>
+static uint64_t checksum_scalars(const S *data, uint64_t n){
+  //FNV-style mix over whole words, which is fast enough to run over a multi-GB table on every load.
+  uint64_t h=14695981039346656037ULL;
+  uint64_t w=0;
+  for (uint64_t i=0;i<n;i++){
+    memcpy(&w,data+i,sizeof(S));
+    h=(h^w)*1099511628211ULL;
+    h^=h>>29;
+  }
+  return h;
+}
+
+//blocking for the full3d fieldmap gemv:  GEMV_ROWS rows share each load of q, and the sources are swept in tiles of
+//GEMV_COL_TILE so that the piece of q in use stays in L1 while a whole chunk of GEMV_ROW_CHUNK rows passes over it.
+#define GEMV_ROWS 4
+#define GEMV_COL_TILE 2048
+#define GEMV_ROW_CHUNK 64
+
+//particles advanced together by swim_block.  big enough to keep several lookups in flight, small enough that the block's
+//working arrays stay in L1.
+#define SWIM_BLOCK 16
+
+static inline int floor_int(double v){
+  //(int)floor(v), without the libm call, for v well inside the range of an int.
+  int i=(int)v;
+  return (v<i)?i-1:i;
+}
+
+static inline void linear_zintegral(const PackedVector3D *f, const PackedVector3D *F, int n, double u, double dz, double out[3]){
+  //the integral of a column of n cells of field f, taken linear in z between the cell centers and flat beyond the first
+  //and last ones, from the low edge of the column up to u.  u is in units of dz, counted from the first center.  F is the
+  //running integral of the same up to each center, as build_field_zintegrals makes it.
+  if (u<0){
+    double len=(u+0.5)*dz;
+    out[0]=f[0].x*len; out[1]=f[0].y*len; out[2]=f[0].z*len;
+  } else if (u>=n-1){
+    double len=(u-(n-1))*dz;
+    out[0]=F[n-1].x+f[n-1].x*len; out[1]=F[n-1].y+f[n-1].y*len; out[2]=F[n-1].z+f[n-1].z*len;
+  } else {
+    int k=(int)u;
+    double t=u-k, len=t*dz, half=0.5*t;
+    out[0]=F[k].x+len*(f[k].x+half*(f[k+1].x-f[k].x));
+    out[1]=F[k].y+len*(f[k].y+half*(f[k+1].y-f[k].y));
+    out[2]=F[k].z+len*(f[k].z+half*(f[k+1].z-f[k].z));
+  }
+  return;
+}
+
+//vector loads of lookup values as doubles.  Single precision tables are widened on load, so every sum still accumulates in double.
+#if defined(__AVX512F__)
+static inline __m512d load8_pd(const double *p){return _mm512_loadu_pd(p);}
+static inline __m512d load8_pd(const float *p){return _mm512_maskz_cvtps_pd(0xFF,_mm256_loadu_ps(p));} //the unmasked form trips a bogus -Wmaybe-uninitialized in gcc 12's header.
+#elif defined(__AVX2__) && defined(__FMA__)
+static inline __m256d load4_pd(const double *p){return _mm256_loadu_pd(p);}
+static inline __m256d load4_pd(const float *p){return _mm256_cvtps_pd(_mm_loadu_ps(p));}
+#endif
+
+template <int ROWS, class S>
+static void dot_rows(const S *const row[ROWS], const double *x, size_t j0, size_t j1, double sum[ROWS]){
+  //sum[r] = sum_{j0<=j<j1} row[r][j]*x[j] for r<ROWS.
+  //each row keeps its own accumulators, so a row's result doesn't depend on which other rows it was blocked with.
+  for (int r=0;r<ROWS;r++) sum[r]=0;
+  size_t j=j0;
+#if defined(__AVX512F__)
+  __m512d acc[ROWS];
+  for (int r=0;r<ROWS;r++) acc[r]=_mm512_setzero_pd();
+  for (;j+8<=j1;j+=8){
+    __m512d xv=_mm512_loadu_pd(x+j);
+    for (int r=0;r<ROWS;r++)
+      acc[r]=_mm512_fmadd_pd(load8_pd(row[r]+j),xv,acc[r]);
+  }
+  for (int r=0;r<ROWS;r++){
+    //summed by hand:  gcc 12 warns about uninitialized variables inside its own _mm512_reduce_add_pd, which -Werror turns fatal.
+    double lanes[8];
+    _mm512_storeu_pd(lanes,acc[r]);
+    sum[r]=((lanes[0]+lanes[1])+(lanes[2]+lanes[3]))+((lanes[4]+lanes[5])+(lanes[6]+lanes[7]));
+  }
+#elif defined(__AVX2__) && defined(__FMA__)
+  __m256d acc[ROWS];
+  for (int r=0;r<ROWS;r++) acc[r]=_mm256_setzero_pd();
+  for (;j+4<=j1;j+=4){
+    __m256d xv=_mm256_loadu_pd(x+j);
+    for (int r=0;r<ROWS;r++)
+      acc[r]=_mm256_fmadd_pd(load4_pd(row[r]+j),xv,acc[r]);
+  }
+  for (int r=0;r<ROWS;r++){
+    double lanes[4];
+    _mm256_storeu_pd(lanes,acc[r]);
+    sum[r]=(lanes[0]+lanes[1])+(lanes[2]+lanes[3]);
+  }
+#endif
+  for (;j<j1;j++)
+    for (int r=0;r<ROWS;r++)
+      sum[r]+=(double)row[r][j]*x[j];
+  return;
+}
+
+template <int ROWS, class S>
+static void gemv3_tile(const S *const A[3], size_t ncols, size_t row0, const double *x, size_t j0, size_t j1, double *const y[3], size_t y0){
+  //y[c][y0+r] += sum_{j0<=j<j1} A[c][(row0+r)*ncols+j]*x[j] for r<ROWS.
+  for (int c=0;c<3;c++){
+    const S *row[ROWS];
+    double sum[ROWS];
+    for (int r=0;r<ROWS;r++)
+      row[r]=A[c]+(row0+r)*ncols;
+    dot_rows<ROWS,S>(row,x,j0,j1,sum);
+    for (int r=0;r<ROWS;r++)
+      y[c][y0+r]+=sum[r];
+  }
+  return;
+}
+
+template <class S>
+static void gemv3_rows(const S *const A[3], size_t ncols, size_t row0, int nrows, const double *x, double *const y[3], size_t y0=0){
+  //y[c][y0+r] += (A[c]*x)[row0+r] for 0<=r<nrows, for each of the three component planes.
+  //without AVX2/AVX-512 enabled at compile time (eg -march=native) this falls back to the plain loop, which the compiler may still vectorize.
+  for (size_t j0=0;j0<ncols;j0+=GEMV_COL_TILE){
+    size_t j1=std::min(j0+GEMV_COL_TILE,ncols);
+    int r=0;
+    for (;r+GEMV_ROWS<=nrows;r+=GEMV_ROWS)
+      gemv3_tile<GEMV_ROWS,S>(A,ncols,row0+r,x,j0,j1,y,y0+r);
+    for (;r<nrows;r++)
+      gemv3_tile<1,S>(A,ncols,row0+r,x,j0,j1,y,y0+r);
+  }
+  return;
+}
+
+template <class S>
+static inline double dot_segment(const S *a, const double *x, int n){
+  //a single contiguous dot product, for the nz-long runs of the soa phislice and phizslice sums.
+  double sum;
+  dot_rows<1,S>(&a,x,0,n,&sum);
+  return sum;
+}
 
 AnnularFieldSim::AnnularFieldSim(float in_innerRadius, float in_outerRadius, float in_outerZ,
 				 int r, int roi_r0, int roi_r1, int in_rLowSpacing, int in_rHighSize,
@@ -42,6 +211,8 @@ AnnularFieldSim::AnnularFieldSim(float in_innerRadius, float in_outerRadius, flo
   Enominal=400;//v/cm
   Bnominal=1.4;//Tesla
   vdrift=vdr;
+  update_drift_model(); //with the default gas.
+  reset_swim_counts();
   rmin=in_innerRadius; rmax=in_outerRadius;
   zmin=0;zmax=in_outerZ;
   zero_vector.SetXYZ(0,0,0);
@@ -58,6 +229,20 @@ AnnularFieldSim::AnnularFieldSim(float in_innerRadius, float in_outerRadius, flo
   //blah
   green=0;  
 
+  //build lookup tables serially unless asked otherwise:
+  nThreads=1;
+  //trust a cached lookup table whose header and size match, without hashing all of it on every load:
+  lookupCacheVerify=false;
+  //direct sums for the fieldmap.  setFieldmapFFT(true) switches PhiSlice and PhiZSlice to the FFT convolution in phi:
+  fieldmapFFT=false;
+  //sum straight from the lookup as built.  setLookupLayout(SoA) packs it into component planes instead:
+  lookupLayout=AoS;
+  //piecewise-constant fields in z, as the swims have always had them:
+  fieldInterpolation=Bilinear;
+  //no distortion map until someone asks for one:
+  distortionMap=0;
+  inverseDistortionMap=0;
+
   //load parameters of the whole-volume tiling
   nr=r;nphi=phi;nz=z; //number of fundamental bins (f-bins) in each direction
   printf("AnnularFieldSim::AnnularFieldSim set variables nr=%d, nphi=%d, nz=%d\n",nr,nphi,nz);
@@ -68,6 +253,8 @@ AnnularFieldSim::AnnularFieldSim(float in_innerRadius, float in_outerRadius, flo
   step.SetPerp(dim.Perp()/nr);
   step.SetPhi(phispan/nphi);
   step.SetZ(dim.Z()/nz);
+  step_r=step.Perp();
+  step_phi=step.Phi();
   // printf("f-bin size:  r=%f,phi=%f, wanted %f,%f\n",step.Perp(),step.Phi(),dr/r,dphi/phi);
 
   //create an array to store the charge in each f-bin
@@ -91,20 +278,35 @@ AnnularFieldSim::AnnularFieldSim(float in_innerRadius, float in_outerRadius, flo
   
 
   //create an array to hold the SC-induced electric field in the roi with the specified dimensions
-  Efield=new MultiArray<TVector3>(nr_roi,nphi_roi,nz_roi);
+  Efield=new MultiArray<PackedVector3D>(nr_roi,nphi_roi,nz_roi);
   for (int i=0;i<Efield->Length();i++)
     Efield->GetFlat(i)->SetXYZ(0,0,0);
 
   //and to hold the external electric fieldmap over the region of interest
-  Eexternal=new MultiArray<TVector3>(nr_roi,nphi_roi,nz_roi);
+  Eexternal=new MultiArray<PackedVector3D>(nr_roi,nphi_roi,nz_roi);
   for (int i=0;i<Eexternal->Length();i++)
     Eexternal->GetFlat(i)->SetXYZ(0,0,0);
 
   //ditto the external magnetic fieldmap
-  Bfield=new MultiArray<TVector3>(nr_roi,nphi_roi,nz_roi);
+  Bfield=new MultiArray<PackedVector3D>(nr_roi,nphi_roi,nz_roi);
   for (int i=0;i<Bfield->Length();i++)
     Bfield->GetFlat(i)->SetXYZ(0,0,0);
 
+  //and the running z-integrals of E and B, which have one more entry in z than the fields they integrate:
+  Efield_zint=new MultiArray<PackedVector3D>(nr_roi,nphi_roi,nz_roi+1);
+  Bfield_zint=new MultiArray<PackedVector3D>(nr_roi,nphi_roi,nz_roi+1);
+  for (int i=0;i<Efield_zint->Length();i++){
+    Efield_zint->GetFlat(i)->SetXYZ(0,0,0);
+    Bfield_zint->GetFlat(i)->SetXYZ(0,0,0);
+  }
+  //and of the z-interpolated fields, for the Trilinear swims, which have one entry per cell center:
+  Efield_zlin=new MultiArray<PackedVector3D>(nr_roi,nphi_roi,nz_roi);
+  Bfield_zlin=new MultiArray<PackedVector3D>(nr_roi,nphi_roi,nz_roi);
+  for (int i=0;i<Efield_zlin->Length();i++){
+    Efield_zlin->GetFlat(i)->SetXYZ(0,0,0);
+    Bfield_zlin->GetFlat(i)->SetXYZ(0,0,0);
+  }
+
 
 
   //handle the lookup table construction:  
@@ -118,18 +320,21 @@ AnnularFieldSim::AnnularFieldSim(float in_innerRadius, float in_outerRadius, flo
       printf("AnnularFieldSim::AnnularFieldSim building Epartial (full3D) with  nr_roi=%d nphi_roi=%d nz_roi=%d  =~%2.2fM TVector3 objects\n",nr_roi,nphi_roi,nz_roi,
 	 nr_roi*nphi_roi*nz_roi*nr*nphi*nz/(1.0e6));
 
-  Epartial=new MultiArray<TVector3>(nr_roi,nphi_roi,nz_roi,nr,nphi,nz);
+  Epartial=new MultiArray<LookupVector3>(nr_roi,nphi_roi,nz_roi,nr,nphi,nz);
   for (int i=0;i<Epartial->Length();i++)
     Epartial->GetFlat(i)->SetXYZ(0,0,0);
   //and kill the arrays we shouldn't be using:
-  Epartial_highres=new MultiArray<TVector3>(1);
+  Epartial_highres=new MultiArray<LookupVector3>(1);
   Epartial_highres->GetFlat(0)->SetXYZ(0,0,0);
   
-  Epartial_lowres=new MultiArray<TVector3>(1);
+  Epartial_lowres=new MultiArray<LookupVector3>(1);
   Epartial_lowres->GetFlat(0)->SetXYZ(0,0,0);
 
-  Epartial_phislice=new MultiArray<TVector3>(1);
+  Epartial_phislice=new MultiArray<LookupVector3>(1);
   Epartial_phislice->GetFlat(0)->SetXYZ(0,0,0);
+
+  Epartial_phizslice=new MultiArray<LookupVector3>(1);
+  Epartial_phizslice->GetFlat(0)->SetXYZ(0,0,0);
   q_lowres=new MultiArray<double>(1);
   *(q_lowres->GetFlat(0))=0;
   q_local=new MultiArray<double>(1);
@@ -138,28 +343,59 @@ AnnularFieldSim::AnnularFieldSim(float in_innerRadius, float in_outerRadius, flo
   } else if (lookupCase==HybridRes){
     printf("lookupCase==HybridRes\n");   
     //zero out the other two:
-    Epartial=new MultiArray<TVector3>(1);
+    Epartial=new MultiArray<LookupVector3>(1);
     Epartial->GetFlat(0)->SetXYZ(0,0,0);
     
-    Epartial_phislice=new MultiArray<TVector3>(1);
+    Epartial_phislice=new MultiArray<LookupVector3>(1);
     Epartial_phislice->GetFlat(0)->SetXYZ(0,0,0);
+
+    Epartial_phizslice=new MultiArray<LookupVector3>(1);
+    Epartial_phizslice->GetFlat(0)->SetXYZ(0,0,0);
   
   } else if (lookupCase==PhiSlice){
       printf("lookupCase==PhiSlice\n");
 
-    Epartial_phislice=new MultiArray<TVector3>(nr_roi,1,nz_roi,nr,nphi,nz);
+    Epartial_phislice=new MultiArray<LookupVector3>(nr_roi,1,nz_roi,nr,nphi,nz);
     for (int i=0;i<Epartial_phislice->Length();i++)
       Epartial_phislice->GetFlat(i)->SetXYZ(0,0,0);
 
     //zero out the other two:
-    Epartial=new MultiArray<TVector3>(1);
+    Epartial=new MultiArray<LookupVector3>(1);
+    Epartial->GetFlat(0)->SetXYZ(0,0,0);
+    Epartial_highres=new MultiArray<LookupVector3>(1);
+    Epartial_highres->GetFlat(0)->SetXYZ(0,0,0);
+  
+    Epartial_lowres=new MultiArray<LookupVector3>(1);
+    Epartial_lowres->GetFlat(0)->SetXYZ(0,0,0);
+
+    Epartial_phizslice=new MultiArray<LookupVector3>(1);
+    Epartial_phizslice->GetFlat(0)->SetXYZ(0,0,0);
+
+    q_lowres=new MultiArray<double>(1);
+    *(q_lowres->GetFlat(0))=0;
+    q_local=new MultiArray<double>(1);
+    *(q_local->GetFlat(0))=0;
+  
+  } else if (lookupCase==PhiZSlice){
+    printf("AnnularFieldSim::AnnularFieldSim building Epartial_phizslice with nr_roi=%d nr=%d nphi=%d 2nz-1=%d  =~%2.2fM TVector3 objects\n",nr_roi,nr,nphi,2*nz-1,
+	   nr_roi*nr*nphi*(2*nz-1)/(1.0e6));
+
+    Epartial_phizslice=new MultiArray<LookupVector3>(nr_roi,nr,nphi,2*nz-1);
+    for (int i=0;i<Epartial_phizslice->Length();i++)
+      Epartial_phizslice->GetFlat(i)->SetXYZ(0,0,0);
+
+    //zero out the others:
+    Epartial=new MultiArray<LookupVector3>(1);
     Epartial->GetFlat(0)->SetXYZ(0,0,0);
-    Epartial_highres=new MultiArray<TVector3>(1);
+    Epartial_highres=new MultiArray<LookupVector3>(1);
     Epartial_highres->GetFlat(0)->SetXYZ(0,0,0);
   
-    Epartial_lowres=new MultiArray<TVector3>(1);
+    Epartial_lowres=new MultiArray<LookupVector3>(1);
     Epartial_lowres->GetFlat(0)->SetXYZ(0,0,0);
 
+    Epartial_phislice=new MultiArray<LookupVector3>(1);
+    Epartial_phislice->GetFlat(0)->SetXYZ(0,0,0);
+
     q_lowres=new MultiArray<double>(1);
     *(q_lowres->GetFlat(0))=0;
     q_local=new MultiArray<double>(1);
@@ -169,16 +405,19 @@ AnnularFieldSim::AnnularFieldSim(float in_innerRadius, float in_outerRadius, flo
       printf("lookupCase==Analytic (or NoLookup)\n");
 
     //zero them all out:
-    Epartial_phislice=new MultiArray<TVector3>(1);
+    Epartial_phislice=new MultiArray<LookupVector3>(1);
     Epartial_phislice->GetFlat(0)->SetXYZ(0,0,0);
+
+    Epartial_phizslice=new MultiArray<LookupVector3>(1);
+    Epartial_phizslice->GetFlat(0)->SetXYZ(0,0,0);
  
-    Epartial=new MultiArray<TVector3>(1);
+    Epartial=new MultiArray<LookupVector3>(1);
     Epartial->GetFlat(0)->SetXYZ(0,0,0);
     
-    Epartial_highres=new MultiArray<TVector3>(1);
+    Epartial_highres=new MultiArray<LookupVector3>(1);
     Epartial_highres->GetFlat(0)->SetXYZ(0,0,0);
   
-    Epartial_lowres=new MultiArray<TVector3>(1);
+    Epartial_lowres=new MultiArray<LookupVector3>(1);
     Epartial_lowres->GetFlat(0)->SetXYZ(0,0,0);
 
     q_lowres=new MultiArray<double>(1);
@@ -268,8 +507,7 @@ TVector3 AnnularFieldSim::calc_unit_field(TVector3 at, TVector3 from){
   }else{
     double Er=green->Er(at.Perp(),FilterPhiPos(at.Phi()),at.Z(),from.Perp(),FilterPhiPos(from.Phi()),from.Z());
     double Ez=green->Ez(at.Perp(),FilterPhiPos(at.Phi()),at.Z(),from.Perp(),FilterPhiPos(from.Phi()),from.Z());
-    double Ephi=0;//green->Ephi(at.Perp(),at.Phi(),at.Z(),from.Perp(),from.Phi(),from.Z());
-    //manually disable the phi component for now.
+    double Ephi=green->Ephi(at.Perp(),FilterPhiPos(at.Phi()),at.Z(),from.Perp(),FilterPhiPos(from.Phi()),from.Z());
     field.SetXYZ(Er,Ephi,Ez); //now this is correct if our test point is at y=0 (hence phi=0);
     field=field*(k_perm*4*3.14159);//scale field strength, since the greens functions as of Apr 1 2020 do not build-in this factor.
     field.RotateZ(at.Phi());//rotate to the coordinates of our 'at' point.
@@ -277,6 +515,45 @@ TVector3 AnnularFieldSim::calc_unit_field(TVector3 at, TVector3 from){
     return field;
 }
 
+void AnnularFieldSim::calc_unit_field(TVector3 at, int n, const double *fromx, const double *fromy, const double *fromz, double *fx, double *fy, double *fz){
+  //same as the single-source version above, but the loop over sources is innermost and has no branches the compiler can't turn into selects.
+  int r_position;
+  if (GetRindexAndCheckBounds(at.Perp(), &r_position)!=InBounds){
+    printf("something's asking for 'at' with r=%f, which is index=%d\n",at.Perp(),r_position);
+    assert(1==2);
+  }
+  if (green==0){
+    const double ax=at.X(), ay=at.Y(), az=at.Z();
+    const double tiny=ALMOST_ZERO*ALMOST_ZERO;
+    for (int i=0;i<n;i++){
+      double dx=ax-fromx[i], dy=ay-fromy[i], dz=az-fromz[i];
+      double d2=dx*dx+dy*dy+dz*dz;
+      double scale=(d2<tiny*tiny)?0:k_perm/(d2*sqrt(d2)); //zero in our own cell, as above.
+      fx[i]=dx*scale;
+      fy[i]=dy*scale;
+      fz[i]=dz*scale;
+    }
+    return;
+  }
+  //the green's function wants cylindrical coordinates.  convert the sources into the output arrays, since we have them anyway.
+  double *r1=fx, *phi1=fy;
+  for (int i=0;i<n;i++){
+    double x=fromx[i], y=fromy[i];
+    r1[i]=sqrt(x*x+y*y);
+    phi1[i]=FilterPhiPos((x==0 && y==0)?0:atan2(y,x)); //as TVector3::Phi() does.
+  }
+  std::vector<double> er(n), ephi(n);
+  green->Efield(at.Perp(),FilterPhiPos(at.Phi()),at.Z(),n,r1,phi1,fromz,&er[0],&ephi[0],fz);
+  const double scale=k_perm*4*3.14159;//since the greens functions as of Apr 1 2020 do not build-in this factor.
+  const double c=cos(at.Phi()), s=sin(at.Phi());
+  for (int i=0;i<n;i++){
+    fx[i]=(c*er[i]-s*ephi[i])*scale; //rotate to the coordinates of our 'at' point.
+    fy[i]=(s*er[i]+c*ephi[i])*scale;
+    fz[i]*=scale;
+  }
+  return;
+}
+
 double AnnularFieldSim::FilterPhiPos(double phi){
   double p=phi;
   if (p>=phispan){//rcc here
@@ -305,15 +582,15 @@ int AnnularFieldSim::FilterPhiIndex(int phi,int range=-1){
   return p;
 }
   
-AnnularFieldSim::BoundsCase AnnularFieldSim::GetRindexAndCheckBounds(float pos, int *r){
+inline AnnularFieldSim::BoundsCase AnnularFieldSim::GetRindexAndCheckBounds(float pos, int *r){
   //if(debugFlag()) printf("%d: AnnularFieldSim::GetRindexAndCheckBounds(r=%f)\n",__LINE__,pos);
 
-  float r0f=(pos-rmin)/step.Perp(); //the position in r, in units of step, starting from the low edge of the 0th bin.
-  int r0=floor(r0f);
+  float r0f=(pos-rmin)/step_r; //the position in r, in units of step, starting from the low edge of the 0th bin.
+  int r0=floor_int(r0f);
   *r=r0;
 
-    int r0lowered_slightly=floor(r0f-ALMOST_ZERO);
-  int r0raised_slightly=floor(r0f+ALMOST_ZERO); 
+    int r0lowered_slightly=floor_int(r0f-ALMOST_ZERO);
+  int r0raised_slightly=floor_int(r0f+ALMOST_ZERO); 
   if (r0lowered_slightly>=rmax_roi || r0raised_slightly<rmin_roi){
     return OutOfBounds;
   }
@@ -329,16 +606,16 @@ AnnularFieldSim::BoundsCase AnnularFieldSim::GetRindexAndCheckBounds(float pos,
   return InBounds;
 
 }
-AnnularFieldSim::BoundsCase AnnularFieldSim::GetPhiIndexAndCheckBounds(float pos, int *phi){
+inline AnnularFieldSim::BoundsCase AnnularFieldSim::GetPhiIndexAndCheckBounds(float pos, int *phi){
   // if(debugFlag()) printf("%d: AnnularFieldSim::GetPhiIndexAndCheckBounds(phi=%f)\n\n",__LINE__,pos);
-  float p0f=(pos)/step.Phi(); //the position in phi, in units of step, starting from the low edge of the 0th bin.
-  int phitemp=floor(p0f);
+  float p0f=(pos)/step_phi; //the position in phi, in units of step, starting from the low edge of the 0th bin.
+  int phitemp=floor_int(p0f);
   int p0=FilterPhiIndex(phitemp);
   *phi=p0;
 
-   phitemp=floor(p0f-ALMOST_ZERO);
+   phitemp=floor_int(p0f-ALMOST_ZERO);
   int p0lowered_slightly=FilterPhiIndex(phitemp);
-   phitemp=floor(p0f+ALMOST_ZERO);
+   phitemp=floor_int(p0f+ALMOST_ZERO);
   int p0raised_slightly=FilterPhiIndex(phitemp);
   //annoying detail:  if we are at index 0, we might go above pmax by going down.
   // and if we are at nphi-1, we might go below pmin by going up.
@@ -359,14 +636,14 @@ AnnularFieldSim::BoundsCase AnnularFieldSim::GetPhiIndexAndCheckBounds(float pos
   return InBounds;
 
 }
-AnnularFieldSim::BoundsCase AnnularFieldSim::GetZindexAndCheckBounds(float pos, int *z){
+inline AnnularFieldSim::BoundsCase AnnularFieldSim::GetZindexAndCheckBounds(float pos, int *z){
   //if(debugFlag()) printf("%d: AnnularFieldSim::GetZindexAndCheckBounds(z=%f)\n\n",__LINE__,pos);
   float z0f=(pos-zmin)/step.Z(); //the position in z, in units of step, starting from the low edge of the 0th bin.
-  int z0=floor(z0f);
+  int z0=floor_int(z0f);
   *z=z0;
 
-  int z0lowered_slightly=floor(z0f-ALMOST_ZERO);
-  int z0raised_slightly=floor(z0f+ALMOST_ZERO); 
+  int z0lowered_slightly=floor_int(z0f-ALMOST_ZERO);
+  int z0raised_slightly=floor_int(z0f+ALMOST_ZERO); 
 
   if (z0lowered_slightly>=zmax_roi || z0raised_slightly<zmin_roi){
     return OutOfBounds;
@@ -386,7 +663,7 @@ AnnularFieldSim::BoundsCase AnnularFieldSim::GetZindexAndCheckBounds(float pos,
 
  
 
-TVector3 AnnularFieldSim::analyticFieldIntegral(float zdest,TVector3 start, MultiArray<TVector3> *field){
+TVector3 AnnularFieldSim::analyticFieldIntegral(float zdest,TVector3 start, MultiArray<PackedVector3D> *field){
   //integrates E dz, from the starting point to the selected z position.  The path is assumed to be along z for each step, with adjustments to x and y accumulated after each step.
   //if(debugFlag()) printf("%d: AnnularFieldSim::fieldIntegral(x=%f,y=%f, z=%f) to z=%f\n\n",__LINE__,start.X(),start.Y(),start.Z(),zdest);
   //  printf("AnnularFieldSim::analyticFieldIntegral calculating from (%f,%f,%f) (rphiz)=(%f,%f,%f) to z=%f.\n",start.X(),start.Y(),start.Z(),start.Perp(),start.Phi(),start.Z(),zdest);
@@ -400,8 +677,8 @@ TVector3 AnnularFieldSim::analyticFieldIntegral(float zdest,TVector3 start, Mult
   //printf("anaFieldInt:  isE=%d, isB=%d, start=(%f,%f,%f)\n",isE,isB,start.X(),start.Y(),start.Z());
   
   if (!rOkay || !phiOkay){
-    printf("AnnularFieldSim::analyticFieldIntegral asked to integrate along (r=%f,phi=%f), index=(%d,%d), which is out of bounds.  returning starting position.\n",start.Perp(),start.Phi(),r,phi);
-    return start;
+    //out of bounds.  the swims check both ends of each step before they get here, so we stay quiet.
+    return zero_vector;
   }
 
   
@@ -428,14 +705,13 @@ TVector3 AnnularFieldSim::analyticFieldIntegral(float zdest,TVector3 start, Mult
   bool endOkay=(endBound==InBounds || endBound==OnHighEdge); //if we just barely touch out-of-bounds on the high end, we can skip that piece of the integral
   
   if (!startOkay || !endOkay){
-    printf("AnnularFieldSim::analyticFieldIntegral asked to integrate from z=%f to %f, index=%d to %d), which is out of bounds.  returning starting position.\n",startz,endz,zi,zf);
-    return start;
+    return zero_vector; //out of bounds in z, as above.
   }
 
   start.SetZ(startz);
   TVector3 integral;
   if (field==Efield) {
-    integral=aliceModel->Eint(endz,start)+Eexternal->Get(r-rmin_roi,phi-phimin_roi,zi-zmin_roi)*(endz-startz);
+    integral=aliceModel->Eint(endz,start)+TVector3(Eexternal->Get(r-rmin_roi,phi-phimin_roi,zi-zmin_roi)*(endz-startz));
     return dir*integral;
   } else if (field==Bfield) {
     return interpolatedFieldIntegral(zdest,start,Bfield);
@@ -444,7 +720,55 @@ TVector3 AnnularFieldSim::analyticFieldIntegral(float zdest,TVector3 start, Mult
 }
     
 
-TVector3 AnnularFieldSim::fieldIntegral(float zdest,TVector3 start, MultiArray<TVector3> *field){
+void AnnularFieldSim::build_field_zintegrals(){
+  //fill the running z-integrals of Efield and Bfield, so that the integral over any run of whole cells in a column is
+  //the difference of two entries instead of a sum over the cells.
+  //the zlin arrays are the same for the fields interpolated linearly between cell centers:  half a cell of the first
+  //center's field up to that center, and then a trapezoid per cell.
+  MultiArray<PackedVector3D> *field[]={Efield,Bfield};
+  MultiArray<PackedVector3D> *zint[]={Efield_zint,Bfield_zint};
+  MultiArray<PackedVector3D> *zlin[]={Efield_zlin,Bfield_zlin};
+  for (int f=0;f<2;f++){
+    for (int ir=0;ir<nr_roi;ir++){
+      for (int iphi=0;iphi<nphi_roi;iphi++){
+	PackedVector3D running(0,0,0);
+	zint[f]->Set(ir,iphi,0,running);
+	for (int iz=0;iz<nz_roi;iz++){
+	  running+=field[f]->Get(ir,iphi,iz)*step.Z();
+	  zint[f]->Set(ir,iphi,iz+1,running);
+	}
+	PackedVector3D runningLinear=field[f]->Get(ir,iphi,0)*(0.5*step.Z());
+	zlin[f]->Set(ir,iphi,0,runningLinear);
+	for (int iz=1;iz<nz_roi;iz++){
+	  runningLinear+=(field[f]->Get(ir,iphi,iz-1)+field[f]->Get(ir,iphi,iz))*(0.5*step.Z());
+	  zlin[f]->Set(ir,iphi,iz,runningLinear);
+	}
+      }
+    }
+  }
+  //every change to the fields comes through here, so any distortion maps we made from the old ones are now stale.
+  delete distortionMap;
+  distortionMap=0;
+  delete inverseDistortionMap;
+  inverseDistortionMap=0;
+  return;
+}
+
+MultiArray<PackedVector3D> *AnnularFieldSim::zintegral_of(MultiArray<PackedVector3D> *field){
+  //the running z-integral that goes with 'field', or 0 if we don't keep one for it.
+  if (field==Efield) return Efield_zint;
+  if (field==Bfield) return Bfield_zint;
+  return 0;
+}
+
+MultiArray<PackedVector3D> *AnnularFieldSim::zlinear_integral_of(MultiArray<PackedVector3D> *field){
+  //the running integral of the z-interpolated 'field', or 0 if we don't keep one for it.
+  if (field==Efield) return Efield_zlin;
+  if (field==Bfield) return Bfield_zlin;
+  return 0;
+}
+
+TVector3 AnnularFieldSim::fieldIntegral(float zdest,TVector3 start, MultiArray<PackedVector3D> *field){
   //integrates E dz, from the starting point to the selected z position.  The path is assumed to be along z for each step, with adjustments to x and y accumulated after each step.
   //if(debugFlag()) printf("%d: AnnularFieldSim::fieldIntegral(x=%f,y=%f, z=%f) to z=%f\n\n",__LINE__,start.X(),start.Y(),start.Z(),zdest);
 
@@ -453,8 +777,8 @@ TVector3 AnnularFieldSim::fieldIntegral(float zdest,TVector3 start, MultiArray<T
   bool phiOkay=  (GetPhiIndexAndCheckBounds(start.Phi(), &phi) == InBounds);
 
   if (!rOkay || !phiOkay){
-    printf("AnnularFieldSim::fieldIntegral asked to integrate along (r=%f,phi=%f), index=(%d,%d), which is out of bounds.  returning starting position.\n",start.Perp(),start.Phi(),r,phi);
-    return start;
+    //out of bounds.  the swims check both ends of each step before they get here, so we stay quiet.
+    return zero_vector;
   }
   
   int dir=(start.Z()>zdest?-1:1);//+1 if going to larger z, -1 if going to smaller;  if they're the same, the sense doesn't matter.
@@ -479,17 +803,23 @@ TVector3 AnnularFieldSim::fieldIntegral(float zdest,TVector3 start, MultiArray<T
   bool endOkay=(endBound==InBounds || endBound==OnHighEdge); //if we just barely touch out-of-bounds on the high end, we can skip that piece of the integral
   
   if (!startOkay || !endOkay){
-    printf("AnnularFieldSim::fieldIntegral asked to integrate from z=%f to %f, index=%d to %d), which is out of bounds.  returning starting position.\n",startz,endz,zi,zf);
-    return start;
+    return zero_vector; //out of bounds in z, as above.
   }
  
-  TVector3 fieldInt(0,0,0);
+  PackedVector3D fieldInt(0,0,0);
   // printf("AnnularFieldSim::fieldIntegral requesting (%d,%d,%d)-(%d,%d,%d) (inclusive) cells\n",r,phi,zi,r,phi,zf-1);
-  TVector3 tf;
-  for(int i=zi;i<zf;i++){ //count the whole cell of the lower end, and skip the whole cell of the high end.
-    tf=field->Get(r-rmin_roi,phi-phimin_roi,i-zmin_roi);
+  MultiArray<PackedVector3D> *zint=zintegral_of(field);
+  if (zint && zf>zi){
+    //count the whole cell of the lower end, and skip the whole cell of the high end, in two lookups:
+    fieldInt=zint->Get(r-rmin_roi,phi-phimin_roi,zf-zmin_roi);
+    fieldInt-=zint->Get(r-rmin_roi,phi-phimin_roi,zi-zmin_roi);
+  } else {
+    PackedVector3D tf;
+    for(int i=zi;i<zf;i++){ //count the whole cell of the lower end, and skip the whole cell of the high end.
+      tf=field->Get(r-rmin_roi,phi-phimin_roi,i-zmin_roi);
       //printf("fieldAt (%d,%d,%d)=(%f,%f,%f) step=%f\n",r,phi,i,tf.X(),tf.Y(),tf.Z(),step.Z());
       fieldInt+=tf*step.Z();
+    }
   }
   
   //since bins contain their lower bound, but not their upper, I can safely remove the unused portion of the lower cell:
@@ -503,7 +833,7 @@ TVector3 AnnularFieldSim::fieldIntegral(float zdest,TVector3 start, MultiArray<T
     }
 
     
-  return dir*fieldInt;
+  return TVector3(dir*fieldInt);
 }
 
 TVector3 AnnularFieldSim::GetCellCenter(int r, int phi, int z){
@@ -572,123 +902,127 @@ TVector3 AnnularFieldSim::GetWeightedCellCenter(int r, int phi, int z){
 
 
 
-TVector3 AnnularFieldSim::interpolatedFieldIntegral(float zdest,TVector3 start, MultiArray<TVector3> *field){
-  //printf("AnnularFieldSim::interpolatedFieldIntegral(x=%f,y=%f, z=%f)\n",start.X(),start.Y(),start.Z());
-
-  // bool isE=(field==Efield);
-  //bool isB=(field==Bfield);
-  
-  //printf("interpFieldInt:  isE=%d, isB=%d, start=(%f,%f,%f)\n",isE,isB,start.X(),start.Y(),start.Z());
-  
-
-  float r0=(start.Perp()-rmin)/step.Perp()-0.5; //the position in r, in units of step, starting from the center of the 0th bin.
-  int r0i=floor(r0); //the integer portion of the position. -- what center is below our position?
+inline void AnnularFieldSim::interpolation_columns(double r, double phi, int col[4], float w[4]){
+  //the four (r,phi) columns to interpolate between at (r,phi), as flat (r,phi) indices into the roi, and their weights.
+  //column c is at r index r0i+(c>>1) and phi index p0i+(c&1), where (r0i,p0i) is the cell center just below us.  A column
+  //outside the roi gets col=-1, and its neighbour is weighted as if we were dead-center on it.
+  float r0=(r-rmin)/step_r-0.5; //the position in r, in units of step, starting from the center of the 0th bin.
+  int r0i=floor_int(r0); //the integer portion of the position. -- what center is below our position?
   float r0d=r0-r0i;//the decimal portion of the position. -- how far past center are we?
-  int ri[4];//the r position of the four cell centers to consider
-  ri[0]=ri[1]=r0i;
-  ri[2]=ri[3]=r0i+1;
-  float rw[4];//the weight of that cell, linear in distance from the center of it
-  rw[0]=rw[1]=1-r0d; //1 when we're on it, 0 when we're at the other one.
-  rw[2]=rw[3]=r0d; //1 when we're on it, 0 when we're at the other one
-
-  bool skip[]={false,false,false,false};
-  if (ri[0]<rmin_roi){
-    skip[0]=true; //don't bother handling 0 and 1 in the coordinates.
-    skip[1]=true;
-    rw[2]=rw[3]=1; //and weight like we're dead-center on the outer cells.
-  }
-  if (ri[2]>=rmax_roi){
-    skip[2]=true; //don't bother handling 2 and 3 in the coordinates.
-    skip[3]=true;
-    rw[0]=rw[1]=1; //and weight like we're dead-center on the inner cells.
-  }
-  
-  //now repeat that structure for phi:
-  float p0=(start.Phi())/step.Phi()-0.5; //the position in phi, in units of step, starting from the center of the 0th bin.
-  int p0i=floor(p0); //the integer portion of the position. -- what center is below our position?
-  float p0d=p0-p0i;//the decimal portion of the position. -- how far past center are we?
-  int pi[4];//the phi position of the four cell centers to consider
-  pi[0]=pi[2]=FilterPhiIndex(p0i);
-  pi[1]=pi[3]=FilterPhiIndex(p0i+1);
-  float pw[4];//the weight of that cell, linear in distance from the center of it
-  pw[0]=pw[2]=1-p0d; //1 when we're on it, 0 when we're at the other one.
-  pw[1]=pw[3]=p0d; //1 when we're on it, 0 when we're at the other one
-
-  //to handle wrap-around
-  if (pi[0]<phimin_roi || pi[0]>=phimax_roi){
-    skip[0]=true; //don't bother handling 0 and 1 in the coordinates.
-    skip[2]=true;
-    pw[1]=pw[3]=1; //and weight like we're dead-center on the outer cells.
-  }
-  if (pi[1]>=phimax_roi || pi[1]<phimin_roi){
-    skip[1]=true; //don't bother handling 2 and 3 in the coordinates.
-    skip[3]=true;
-    pw[0]=pw[2]=1; //and weight like we're dead-center on the inner cells.
-  }
-  
+  bool rOk[2]={r0i>=rmin_roi, r0i+1<rmax_roi};
+  float rw[2]={rOk[1]?1-r0d:1, rOk[0]?r0d:1}; //1 when we're on it, 0 when we're at the other one.
 
-  // printf("interpolating fieldInt for %s at  r=%f,phi=%f\n",(field==Efield)?"Efield":"Bfield",r0,p0);
+  //now repeat that structure for phi:
+  float p0=phi/step_phi-0.5; //the position in phi, in units of step, starting from the center of the 0th bin.
+  int p0i=floor_int(p0);
+  float p0d=p0-p0i;
+  int pi[2]={FilterPhiIndex(p0i),FilterPhiIndex(p0i+1)};
+  bool pOk[2]={pi[0]>=phimin_roi && pi[0]<phimax_roi, pi[1]>=phimin_roi && pi[1]<phimax_roi}; //to handle wrap-around
+  float pw[2]={pOk[1]?1-p0d:1, pOk[0]?p0d:1};
 
-  int dir=(start.Z()>zdest?-1:1);//+1 if going to larger z, -1 if going to smaller;  if they're the same, the sense doesn't matter.
+  for (int c=0;c<4;c++){
+    col[c]=(rOk[c>>1] && pOk[c&1])?(r0i+(c>>1)-rmin_roi)*nphi_roi+(pi[c&1]-phimin_roi):-1;
+    w[c]=rw[c>>1]*pw[c&1];
+  }
+  return;
+}
 
-  int zi, zf;
-  double startz,endz;
+inline bool AnnularFieldSim::z_span(float zdest, double zfrom, ZSpan *span){
+  //where a straight step from z=zfrom to zdest starts and ends in the grid.
   BoundsCase startBound,endBound;
+  span->dir=(zfrom>zdest)?-1:1;//+1 if going to larger z, -1 if going to smaller;  if they're the same, the sense doesn't matter.
 
   //make sure 'zi' is always the smaller of the two numbers, for handling the partial-steps.
-  if (dir>0){
-    startBound=GetZindexAndCheckBounds(start.Z(),&zi); //highest cell with lower bound less than lower bound of integral
-    endBound=GetZindexAndCheckBounds(zdest,&zf); //highest cell with lower bound less than upper lower bound of integral
-    startz=start.Z();
-    endz=zdest;
+  if (span->dir>0){
+    startBound=GetZindexAndCheckBounds(zfrom,&span->zi); //highest cell with lower bound less than lower bound of integral
+    endBound=GetZindexAndCheckBounds(zdest,&span->zf); //highest cell with lower bound less than upper lower bound of integral
+    span->startz=zfrom;
+    span->endz=zdest;
   } else{
-    endBound=GetZindexAndCheckBounds(start.Z(),&zf); //highest cell with lower bound less than lower bound of integral
-    startBound=GetZindexAndCheckBounds(zdest,&zi); //highest cell with lower bound less than upper lower bound of integral
-    startz=zdest;
-    endz=start.Z();
+    endBound=GetZindexAndCheckBounds(zfrom,&span->zf); //highest cell with lower bound less than lower bound of integral
+    startBound=GetZindexAndCheckBounds(zdest,&span->zi); //highest cell with lower bound less than upper lower bound of integral
+    span->startz=zdest;
+    span->endz=zfrom;
   }
   bool startOkay=(startBound==InBounds || startBound==OnLowEdge); //maybe todo: add handling for being just below the low edge.
   bool endOkay=(endBound==InBounds || endBound==OnHighEdge); //if we just barely touch out-of-bounds on the high end, we can skip that piece of the integral
-  
   if (!startOkay || !endOkay){
-    printf("AnnularFieldSim::InterpolatedFieldIntegral asked to integrate from z=%f to %f, index=%d to %d), which is out of bounds.  returning zero\n",startz,endz,zi,zf);
-    return zero_vector;
+    return false;
   }
 
-  if (startBound==OnLowEdge){
+  span->lowEdge=(startBound==OnLowEdge);
+  if (span->lowEdge){
     //we were just below the low edge, so we will be asked to sample a bin in z we're not actually using
-    zi++; //avoid it.  We weren't integrating anything in it anyway.
+    span->zi++; //avoid it.  We weren't integrating anything in it anyway.
   }
+  span->highPart=(span->endz/step.Z()-span->zf>ALMOST_ZERO);
+  //the ends of the path in units of step.Z(), from the center of the first cell of the roi:
+  span->ua=(span->startz-zmin)/step.Z()-zmin_roi-0.5;
+  span->ub=(span->endz-zmin)/step.Z()-zmin_roi-0.5;
+  return true;
+}
 
-
-
-  
-
-
-  TVector3 fieldInt, partialInt;//where we'll store integrals as we generate them.
-  
-  for (int i=0;i<4;i++){
-    if (skip[i]) {
-      //printf("skipping element r=%d,phi=%d\n",ri[i],pi[i]);
-      continue; //we invalidated this one for some reason.
-    }
-    partialInt.SetXYZ(0,0,0);
-    for(int j=zi;j<zf;j++){ //count the whole cell of the lower end, and skip the whole cell of the high end.
-      
-      partialInt+=field->Get(ri[i]-rmin_roi,pi[i]-phimin_roi,j-zmin_roi)*step.Z();
-    }
-    if (startBound!=OnLowEdge){
-    partialInt-=field->Get(ri[i]-rmin_roi,pi[i]-phimin_roi,zi-zmin_roi)*(startz-zi*step.Z());//remove the part of the low end cell we didn't travel through
-    }
-    if (endz/step.Z()-zf>ALMOST_ZERO){
-    partialInt+=field->Get(ri[i]-rmin_roi,pi[i]-phimin_roi,zf-zmin_roi)*(endz-zf*step.Z());//add the part of the high end cell we did travel through
+inline void AnnularFieldSim::column_zintegral(const PackedVector3D *f, const PackedVector3D *F, const PackedVector3D *L, const ZSpan &span, double out[3]){
+  //the integral along one (r,phi) column from span.startz to span.endz.  f is the column of the field, from the first roi
+  //cell up.  for the bilinear case L is 0, and F is the running integral of the column (or 0 to sum the cells instead).
+  //for the trilinear case L is the running integral of the z-interpolated field, and F isn't used.
+  double dz=step.Z();
+  if (L){
+    //Trilinear:  the exact integral of the z-interpolated field from startz to endz.
+    double a[3],b[3];
+    linear_zintegral(f,L,nz_roi,span.ua,dz,a);
+    linear_zintegral(f,L,nz_roi,span.ub,dz,b);
+    for (int k=0;k<3;k++) out[k]=b[k]-a[k];
+    return;
+  }
+  int lo=span.zi-zmin_roi, hi=span.zf-zmin_roi;
+  out[0]=out[1]=out[2]=0;
+  if (F && span.zf>span.zi){
+    //the whole cells from zi to zf-1, from the running integral:
+    out[0]+=F[hi].x; out[1]+=F[hi].y; out[2]+=F[hi].z;
+    out[0]-=F[lo].x; out[1]-=F[lo].y; out[2]-=F[lo].z;
+  } else {
+    for(int j=lo;j<hi;j++){ //count the whole cell of the lower end, and skip the whole cell of the high end.
+      out[0]+=f[j].x*dz; out[1]+=f[j].y*dz; out[2]+=f[j].z*dz;
     }
-    //printf("element r=%d,phi=%d, w=%f partialInt=(%f,%f,%f)\n",ri[i],pi[i],rw[i]*pw[i],partialInt.X(),partialInt.Y(),partialInt.Z());
+  }
+  if (!span.lowEdge){
+    double len=span.startz-span.zi*dz; //remove the part of the low end cell we didn't travel through
+    out[0]-=f[lo].x*len; out[1]-=f[lo].y*len; out[2]-=f[lo].z*len;
+  }
+  if (span.highPart){
+    double len=span.endz-span.zf*dz; //add the part of the high end cell we did travel through
+    out[0]+=f[hi].x*len; out[1]+=f[hi].y*len; out[2]+=f[hi].z*len;
+  }
+  return;
+}
+
+TVector3 AnnularFieldSim::interpolatedFieldIntegral(float zdest,TVector3 start, MultiArray<PackedVector3D> *field){
+  //integrates 'field' along z from start to zdest, interpolating between the four (r,phi) columns around the path.
+  //swim_block does the same for a block of particles, through the same helpers.
+  int col[4];
+  float w[4];
+  interpolation_columns(start.Perp(),start.Phi(),col,w);
+  ZSpan span;
+  if (!z_span(zdest,start.Z(),&span)){
+    //out of bounds.  the swims check both ends of each step before they get here, so we stay quiet.
+    return zero_vector;
+  }
 
-    fieldInt+=rw[i]*pw[i]*partialInt;
+  MultiArray<PackedVector3D> *zint=zintegral_of(field);
+  MultiArray<PackedVector3D> *zlin=(fieldInterpolation==Trilinear)?zlinear_integral_of(field):0;
+  TVector3 fieldInt;
+  for (int c=0;c<4;c++){
+    if (col[c]<0) continue; //this column is outside the roi.
+    double partialInt[3];
+    column_zintegral(field->field+(size_t)col[c]*field->n[2],
+		     zint?zint->field+(size_t)col[c]*zint->n[2]:0,
+		     zlin?zlin->field+(size_t)col[c]*zlin->n[2]:0,
+		     span,partialInt);
+    fieldInt.SetXYZ(fieldInt.X()+w[c]*partialInt[0],fieldInt.Y()+w[c]*partialInt[1],fieldInt.Z()+w[c]*partialInt[2]);
   }
     
-  return dir*fieldInt;
+  return span.dir*fieldInt;
 }
 
 void AnnularFieldSim::load_analytic_spacecharge(float scalefactor=1){
@@ -771,11 +1105,12 @@ void AnnularFieldSim::loadBfield(const char *filename, const char *treename){
   //phi would go here if we had it.
   phi=fphi=0; //no phi components yet.
   loadField(&Bfield,fTree,&r,0,&z,&fr,&fphi,&fz);
+  build_field_zintegrals();
   return;
   
 }
 
-void AnnularFieldSim::loadField(MultiArray<TVector3> **field, TTree *source, float *rptr, float *phiptr, float *zptr, float *frptr,  float *fphiptr,  float *fzptr){
+void AnnularFieldSim::loadField(MultiArray<PackedVector3D> **field, TTree *source, float *rptr, float *phiptr, float *zptr, float *frptr,  float *fphiptr,  float *fzptr){
   //we're loading a tree of unknown size and spacing -- and possibly uneven spacing -- into our local data.
   //formally, we might want to interpolate or otherwise weight, but for now, carve this into our usual bins, and average, similar to the way we load spacecharge.
 
@@ -833,7 +1168,7 @@ void AnnularFieldSim::loadField(MultiArray<TVector3> **field, TTree *source, flo
 	}
 	//have to rotate this to the proper direction.
 	fieldvec.RotateZ(FilterPhiPos(cellcenter.Phi()));//rcc caution.  Does this rotation shift the sense of 'up'?
-	(*field)->Set(j,i,k,fieldvec);
+	(*field)->Set(j,i,k,PackedVector3D(fieldvec));
       }
     }
   }
@@ -855,7 +1190,7 @@ void AnnularFieldSim::loadField(MultiArray<TVector3> **field, TTree *source, flo
 	    }
 	    //have to rotate this to the proper direction.
 	    fieldvec.RotateZ(FilterPhiPos(cellcenter.Phi()));//rcc caution.  Does this rotation shift the sense of 'up'?
-	    (*field)->Set(j,i,k,fieldvec);
+	    (*field)->Set(j,i,k,PackedVector3D(fieldvec));
 	  }
 	}
       }
@@ -1021,38 +1356,386 @@ void AnnularFieldSim::populate_fieldmap(){
   //sum the E field at every point in the region of interest
   // remember that Efield uses relative indices
   printf("in pop_fieldmap, n=(%d,%d,%d)\n",nr,nphi,nz);
- 
-  TVector3 localF;//holder for the summed field at the current position.
-  for (int ir=rmin_roi;ir<rmax_roi;ir++){
-    for (int iphi=phimin_roi;iphi<phimax_roi;iphi++){
-      for (int iz=zmin_roi;iz<zmax_roi;iz++){
-	localF=sum_field_at(ir,iphi,iz); //asks in global coordinates
-	Efield->Set(ir-rmin_roi,iphi-phimin_roi,iz-zmin_roi,localF);
-	//if (localF.Mag()>1e-9)
-	if(debugFlag()) printf("%d: AnnularFieldSim::populate_fieldmap fieldmap@ (%d,%d,%d) mag=%f\n",__LINE__,ir,iphi,iz,localF.Mag());
+  q_fieldmap.assign(q->field,q->field+q->Length()); //remember what charge this fieldmap is for.
+
+  if (fieldmapFFT && (lookupCase==PhiSlice || lookupCase==PhiZSlice)){
+    populate_fieldmap_fft();
+  } else if (lookupCase==Full3D && !Epartial_soa[0].empty()){
+    populate_fieldmap_gemv();
+  } else {
+    TVector3 localF;//holder for the summed field at the current position.
+    for (int ir=rmin_roi;ir<rmax_roi;ir++){
+      for (int iphi=phimin_roi;iphi<phimax_roi;iphi++){
+	for (int iz=zmin_roi;iz<zmax_roi;iz++){
+	  localF=sum_field_at(ir,iphi,iz); //asks in global coordinates
+	  Efield->Set(ir-rmin_roi,iphi-phimin_roi,iz-zmin_roi,PackedVector3D(localF));
+	  //if (localF.Mag()>1e-9)
+	  if(debugFlag()) printf("%d: AnnularFieldSim::populate_fieldmap fieldmap@ (%d,%d,%d) mag=%f\n",__LINE__,ir,iphi,iz,localF.Mag());
+	}
       }
     }
   }
+  build_field_zintegrals();
   return;
 }
   
+void AnnularFieldSim::build_kernel_spectrum(const SimpleFFT &fft){
+  //for each (field point, source) pair of rings in the phislice or phizslice lookup, store the first nphi/2+1 terms of the
+  //phi-spectrum of each field component.  The kernel is real, so the rest of the spectrum is the conjugate of these.
+  int nh=nphi/2+1;
+  int nslabs=0;
+  if (lookupCase==PhiSlice){
+    nslabs=nr_roi*nz_roi*nr*nz; //(r,z) field point by (r,z) source ring
+  } else if (lookupCase==PhiZSlice){
+    nslabs=nr_roi*nr*(2*nz-1); //r field point by (r,dz) source ring
+  } else {
+    printf("AnnularFieldSim::build_kernel_spectrum called for a lookupCase that isn't shift-invariant in phi.\n");
+    assert(1==2);
+  }
+  printf("AnnularFieldSim::build_kernel_spectrum building %d phi-spectra of length %d\n",nslabs*3,nh);
+  Epartial_spectrum.resize((size_t)nslabs*3*nh);
+
+  parallel_for(nslabs,[&](int slab){
+      std::vector<std::complex<double> > buf(nphi);
+      PackedVector3D k;
+      for (int c=0;c<3;c++){
+	for (int iphi=0;iphi<nphi;iphi++){
+	  if (lookupCase==PhiSlice){
+	    //slab=((r*nz_roi+z)*nr+ir)*nz+iz, and the table is (r,0,z,ir,phi,iz)
+	    k=lookup_element(Epartial_phislice,((size_t)(slab/nz)*nphi+iphi)*nz+slab%nz);
+	  } else {
+	    //slab=(r*nr+ir)*(2nz-1)+idz, and the table is (r,ir,phi,idz)
+	    k=lookup_element(Epartial_phizslice,((size_t)(slab/(2*nz-1))*nphi+iphi)*(2*nz-1)+slab%(2*nz-1));
+	  }
+	  buf[iphi]=(c==0)?k.x:((c==1)?k.y:k.z);
+	}
+	fft.Forward(&buf[0]);
+	std::copy(buf.begin(),buf.begin()+nh,Epartial_spectrum.begin()+((size_t)slab*3+c)*nh);
+      }
+    });
+  return;
+}
+
+void AnnularFieldSim::populate_fieldmap_fft(){
+  //the phislice and phizslice sums are circular cross-correlations in phi:
+  //  E(r,phi,z) = Rot(phi) * sum_{ir,iz} sum_{iphi} K(r,z,ir,iphi-phi,iz)*q(ir,iphi,iz)
+  //so for each (r,z) we multiply the spectrum of q by the conjugate spectrum of K, sum over (ir,iz), and transform back once.
+  //this costs nr*nz*nphi per field ring instead of nr*nz*nphi^2.
+  //The self-to-self term that the direct sum skips is stored as zero in the lookup, so including it changes nothing.
+  printf("AnnularFieldSim::populate_fieldmap_fft for (%dx%dx%d) roi\n",nr_roi,nphi_roi,nz_roi);
+  SimpleFFT fft(nphi);
+  int nh=nphi/2+1;
+  if (Epartial_spectrum.empty()) build_kernel_spectrum(fft);
+
+  //spectrum of the charge in each (r,z) ring:
+  std::vector<std::complex<double> > qSpectrum((size_t)nr*nz*nh);
+  parallel_for(nr*nz,[&](int ring){
+      std::vector<std::complex<double> > buf(nphi);
+      int ir=ring/nz;
+      int iz=ring%nz;
+      for (int iphi=0;iphi<nphi;iphi++)
+	buf[iphi]=q->Get(ir,iphi,iz);
+      fft.Forward(&buf[0]);
+      std::copy(buf.begin(),buf.begin()+nh,qSpectrum.begin()+(size_t)ring*nh);
+    });
+
+  parallel_for(nr_roi*nz_roi,[&](int ring){
+      int r=ring/nz_roi+rmin_roi;
+      int z=ring%nz_roi+zmin_roi;
+      std::vector<std::complex<double> > acc(3*nh,std::complex<double>(0,0));
+      for (int ir=0;ir<nr;ir++){
+	for (int iz=0;iz<nz;iz++){
+	  size_t slab;
+	  if (lookupCase==PhiSlice){
+	    slab=(((size_t)(r-rmin_roi)*nz_roi+(z-zmin_roi))*nr+ir)*nz+iz;
+	  } else {
+	    slab=((size_t)(r-rmin_roi)*nr+ir)*(2*nz-1)+(iz-z+nz-1);
+	  }
+	  const std::complex<double> *k=&Epartial_spectrum[slab*3*nh];
+	  const std::complex<double> *qs=&qSpectrum[((size_t)ir*nz+iz)*nh];
+	  for (int c=0;c<3;c++){
+	    for (int f=0;f<nh;f++){
+	      acc[c*nh+f]+=std::conj(k[c*nh+f])*qs[f];
+	    }
+	  }
+	}
+      }
+
+      //rebuild each full spectrum from its hermitian half and transform back to phi:
+      std::vector<double> unrotated(3*nphi);
+      std::vector<std::complex<double> > buf(nphi);
+      for (int c=0;c<3;c++){
+	for (int f=0;f<nh;f++)
+	  buf[f]=acc[c*nh+f];
+	for (int f=nh;f<nphi;f++)
+	  buf[f]=std::conj(acc[c*nh+nphi-f]);
+	fft.Inverse(&buf[0]);
+	for (int iphi=0;iphi<nphi;iphi++)
+	  unrotated[c*nphi+iphi]=buf[iphi].real();
+      }
+
+      for (int phi=phimin_roi;phi<phimax_roi;phi++){
+	PackedVector3D localF(unrotated[phi],unrotated[nphi+phi],unrotated[2*nphi+phi]);
+	localF.RotateZ(phi*step.Phi());
+	localF+=Eexternal->Get(r-rmin_roi,phi-phimin_roi,z-zmin_roi);
+	Efield->Set(r-rmin_roi,phi-phimin_roi,z-zmin_roi,localF);
+      }
+    });
+  return;
+}
+
+void AnnularFieldSim::populate_fieldmap_gemv(){
+  //the full3d sum is a matrix-vector product per field component:  E_c[roi cell] = sum_j A_c[roi cell][j]*q[j]
+  //each job is a chunk of rows, swept tile by tile over the sources so the piece of q in use stays in cache.
+  printf("AnnularFieldSim::populate_fieldmap_gemv for (%dx%dx%d) roi\n",nr_roi,nphi_roi,nz_roi);
+  int nrows=nr_roi*nphi_roi*nz_roi;
+  size_t ncols=(size_t)nr*nphi*nz;
+  const LookupScalar *A[3]={&Epartial_soa[0][0],&Epartial_soa[1][0],&Epartial_soa[2][0]};
+  std::vector<double> y[3];
+  for (int c=0;c<3;c++) y[c].assign(nrows,0);
+  double *yp[3]={&y[0][0],&y[1][0],&y[2][0]};
+  int nchunks=(nrows+GEMV_ROW_CHUNK-1)/GEMV_ROW_CHUNK;
+  parallel_for(nchunks,[&](int chunk){
+      int row0=chunk*GEMV_ROW_CHUNK;
+      gemv3_rows(A,ncols,row0,std::min(GEMV_ROW_CHUNK,nrows-row0),q->field,yp,row0);
+    });
+
+  //Efield and Eexternal are laid out in the same (r,phi,z) roi order as the rows.
+  for (int i=0;i<nrows;i++){
+    PackedVector3D localF(y[0][i],y[1][i],y[2][i]);
+    localF+=*(Eexternal->GetFlat(i));
+    *(Efield->GetFlat(i))=localF;
+  }
+  return;
+}
+
+bool AnnularFieldSim::fieldmap_is_incremental(){
+  //true if Efield can be updated by adding the field of a change in charge, one source cell at a time.
+  //Hybrid sums its sources into l-bins, and Analytic and NoLookup don't use q at all, so those always redo the full fieldmap.
+  return lookupCase==Full3D || lookupCase==PhiSlice || lookupCase==PhiZSlice;
+}
+
+PackedVector3D AnnularFieldSim::sum_field_from_cells(int r, int phi, int z, const std::vector<int> &cells, const std::vector<double> &dq){
+  //field at the global position r,phi,z from charge dq[i] in each flat q index cells[i], using whichever lookup is in place.
+  //as in the full sums, the phislice and phizslice contributions are summed in the phi=0 frame and rotated once at the end.
+  PackedVector3D sum(0,0,0);
+  size_t ncols=(size_t)nr*nphi*nz;
+  size_t row=((size_t)(r-rmin_roi)*nphi_roi+(phi-phimin_roi))*nz_roi+(z-zmin_roi);
+  int self=(r*nphi+phi)*nz+z;
+  for (size_t i=0;i<cells.size();i++){
+    if (cells[i]==self) continue;//dont' compute self-to-self field.
+    int ir=cells[i]/(nphi*nz);
+    int iphi=(cells[i]/nz)%nphi;
+    int iz=cells[i]%nz;
+    if (lookupCase==Full3D){
+      sum+=lookup_element(Epartial,row*ncols+cells[i])*dq[i];
+    } else if (lookupCase==PhiSlice){
+      //flat index of (r,0,z,ir,phirel,iz) in the phislice table
+      size_t el=((((size_t)(r-rmin_roi)*nz_roi+(z-zmin_roi))*nr+ir)*nphi+FilterPhiIndex(iphi-phi))*nz+iz;
+      sum+=lookup_element(Epartial_phislice,el)*dq[i];
+    } else if (lookupCase==PhiZSlice){
+      //flat index of (r,ir,phirel,dz) in the phizslice table
+      size_t el=(((size_t)(r-rmin_roi)*nr+ir)*nphi+FilterPhiIndex(iphi-phi))*(2*nz-1)+iz-z+nz-1;
+      sum+=lookup_element(Epartial_phizslice,el)*dq[i];
+    } else {
+      assert(1==2);
+    }
+  }
+  if (lookupCase==PhiSlice || lookupCase==PhiZSlice) sum.RotateZ(phi*step.Phi());
+  return sum;
+}
+
+void AnnularFieldSim::update_fieldmap(){
+  //bring Efield up to date with q after q has changed in a few cells.
+  //the field is linear in the charge, so we only need to add the field of (q-q_fieldmap) in the cells that differ,
+  //which costs (changed cells)x(roi cells) instead of a full fieldmap.
+  if (!fieldmap_is_incremental() || q_fieldmap.size()!=(size_t)q->Length()){
+    populate_fieldmap();
+    return;
+  }
+  std::vector<int> cells;
+  std::vector<double> dq;
+  for (int i=0;i<q->Length();i++){
+    if (q->field[i]!=q_fieldmap[i]){
+      cells.push_back(i);
+      dq.push_back(q->field[i]-q_fieldmap[i]);
+    }
+  }
+  printf("AnnularFieldSim::update_fieldmap: %d of %d cells changed\n",(int)cells.size(),q->Length());
+  if (cells.empty()) return;
+  if (cells.size()*4>(size_t)q->Length()){
+    //past this point the full fieldmap (with its fft or gemv shortcuts) is cheaper.
+    populate_fieldmap();
+    return;
+  }
+
+  parallel_for(nr_roi*nphi_roi*nz_roi,[&](int job){
+      int r=job/(nphi_roi*nz_roi)+rmin_roi;
+      int phi=(job/nz_roi)%nphi_roi+phimin_roi;
+      int z=job%nz_roi+zmin_roi;
+      *(Efield->GetFlat(job))+=sum_field_from_cells(r,phi,z,cells,dq);
+    });
+  q_fieldmap.assign(q->field,q->field+q->Length());
+  build_field_zintegrals();
+  return;
+}
+
+void AnnularFieldSim::shift_spacecharge_z(int k){
+  //move all of the space charge by k z-bins (toward higher z if k>0), dropping what leaves the volume and leaving
+  //empty bins where nothing comes in.  New charge can then be added to q and picked up by update_fieldmap().
+  //With the free-space greens function the lookup only depends on z differences, so the field from the shifted charge at z
+  //is the old field at z-k, minus the field of the charge that was dropped.  Only roi rows whose z-k is outside the roi need a full sum.
+  printf("AnnularFieldSim::shift_spacecharge_z by %d bins\n",k);
+  bool shiftField=(green==0 && fieldmap_is_incremental() && k<nz && k>-nz);
+  if (shiftField){
+    update_fieldmap(); //make sure Efield matches the charge we are about to shift.
+    shiftField=fieldmap_is_incremental() && q_fieldmap.size()==(size_t)q->Length();
+  }
+
+  //the charge that will fall off the end:
+  std::vector<int> dropped;
+  std::vector<double> dropq;
+  for (int ir=0;ir<nr;ir++){
+    for (int iphi=0;iphi<nphi;iphi++){
+      for (int iz=0;iz<nz;iz++){
+	if (iz+k>=0 && iz+k<nz) continue;
+	if (q->Get(ir,iphi,iz)==0) continue;
+	dropped.push_back((ir*nphi+iphi)*nz+iz);
+	dropq.push_back(q->Get(ir,iphi,iz));
+      }
+    }
+  }
+
+  //spacecharge part of the shifted field, for the rows that have a row to be shifted from:
+  int nrows=nr_roi*nphi_roi*nz_roi;
+  std::vector<PackedVector3D> shifted(shiftField?nrows:0);
+  std::vector<char> fromRoi(nrows,0);
+  if (shiftField){
+    parallel_for(nrows,[&](int job){
+	int r=job/(nphi_roi*nz_roi)+rmin_roi;
+	int phi=(job/nz_roi)%nphi_roi+phimin_roi;
+	int z=job%nz_roi+zmin_roi;
+	if (z-k<zmin_roi || z-k>=zmax_roi) return;
+	fromRoi[job]=1;
+	int from=job-k; //same r and phi, z-k.
+	shifted[job].SetXYZ(0,0,0);
+	shifted[job]+=*(Efield->GetFlat(from));
+	shifted[job]-=*(Eexternal->GetFlat(from));
+	shifted[job]-=sum_field_from_cells(r,phi,z-k,dropped,dropq);
+      });
+  }
+
+  //shift the charge itself:
+  for (int ir=0;ir<nr;ir++){
+    for (int iphi=0;iphi<nphi;iphi++){
+      double *col=q->GetPtr(ir,iphi,0);
+      if (k>=nz || k<=-nz){
+	std::fill(col,col+nz,0.0);
+      } else if (k>0){
+	std::copy_backward(col,col+nz-k,col+nz);
+	std::fill(col,col+k,0.0);
+      } else if (k<0){
+	std::copy(col-k,col+nz,col);
+	std::fill(col+nz+k,col+nz,0.0);
+      }
+    }
+  }
+  if (lookupCase==HybridRes){
+    //rebuild q_lowres from the shifted charge.
+    for (int i=0;i<q_lowres->Length();i++)
+      *(q_lowres->GetFlat(i))=0;
+    for (int ifr=0;ifr<nr;ifr++){
+      int r_low=ifr/r_spacing;
+      for (int ifphi=0;ifphi<nphi;ifphi++){
+	int phi_low=ifphi/phi_spacing;
+	for (int ifz=0;ifz<nz;ifz++){
+	  int z_low=ifz/z_spacing;
+	  q_lowres->Add(r_low,phi_low,z_low,q->Get(ifr,ifphi,ifz));
+	}
+      }
+    }
+  }
+  if (!shiftField) return; //Efield is left as it was, for the caller to update or repopulate.
+
+  parallel_for(nrows,[&](int job){
+      int r=job/(nphi_roi*nz_roi)+rmin_roi;
+      int phi=(job/nz_roi)%nphi_roi+phimin_roi;
+      int z=job%nz_roi+zmin_roi;
+      PackedVector3D localF;
+      if (fromRoi[job]){
+	localF=shifted[job]+Eexternal->Get(r-rmin_roi,phi-phimin_roi,z-zmin_roi);
+      } else {
+	localF=PackedVector3D(sum_field_at(r,phi,z));
+      }
+      *(Efield->GetFlat(job))=localF;
+    });
+  q_fieldmap.assign(q->field,q->field+q->Length());
+  build_field_zintegrals();
+  return;
+}
+
 void  AnnularFieldSim::populate_lookup(){
   //with 'f' being the position the field is being measured at, and 'o' being the position of the charge generating the field.
   //remember the 'f' part of Epartial uses relative indices.
   //  TVector3 (*f)[fx][fy][fz][ox][oy][oz]=field_;
   //printf("populating lookup for (%dx%dx%d)x(%dx%dx%d) grid\n",fx,fy,fz,ox,oy,oz);
-  
+  //if a cache directory is set, each table is read from there if a matching one exists, and written there after being built if not.
+  
+  Epartial_spectrum.clear(); //the FFT fieldmap needs to re-derive its spectra from whatever we load or build now.
+  if (green!=0) green->ResetTermStats(); //so we can report how much of the series this build needed.
+  for (int c=0;c<3;c++) std::vector<LookupScalar>().swap(Epartial_soa[c]); //release, not just empty, the planes of any previous table.
+
+  //with the SoA layout a previous call packed the table and released it, and a table served from a cache file is read-only.
+  //either way, get a full-size array of our own back before refilling it.
+  auto restore=[](MultiArray<LookupVector3> *&table, int a, int b, int c, int d, int e, int f){
+    int len=a*b*c*d*(e>0?e:1)*(f>0?f:1);
+    if (table->Length()==len && table->mapping==0) return;
+    table->Release();
+    delete table;
+    table=new MultiArray<LookupVector3>(a,b,c,d,e,f);
+  };
+
   if (lookupCase==Full3D){
     printf("lookupCase==Full3D\n");
-
-    populate_full3d_lookup();
+    restore(Epartial,nr_roi,nphi_roi,nz_roi,nr,nphi,nz);
+    if (!load_lookup_cache("Epartial",&Epartial)){
+      populate_full3d_lookup();
+      save_lookup_cache("Epartial",Epartial);
+    }
+    if (lookupLayout==SoA) pack_lookup(&Epartial);
   } else if (lookupCase==HybridRes){
     printf("lookupCase==HybridRes\n");
-    populate_highres_lookup();
-    populate_lowres_lookup();
+    //these keep their shape, so they only need replacing if they are still read-only views of a cache file.
+    for (MultiArray<LookupVector3> **t : {&Epartial_highres,&Epartial_lowres})
+      if ((*t)->mapping!=0) restore(*t,(*t)->n[0],(*t)->n[1],(*t)->n[2],(*t)->n[3],(*t)->n[4],(*t)->n[5]);
+    if (!load_lookup_cache("Epartial_highres",&Epartial_highres)){
+      populate_highres_lookup();
+      save_lookup_cache("Epartial_highres",Epartial_highres);
+    }
+    if (!load_lookup_cache("Epartial_lowres",&Epartial_lowres)){
+      populate_lowres_lookup();
+      save_lookup_cache("Epartial_lowres",Epartial_lowres);
+    }
   } else if (lookupCase==PhiSlice){
     printf("Populating lookup:  lookupCase==PhiSlice\n");
-    populate_phislice_lookup();
+    restore(Epartial_phislice,nr_roi,1,nz_roi,nr,nphi,nz);
+    if (!load_lookup_cache("Epartial_phislice",&Epartial_phislice)){
+      populate_phislice_lookup();
+      save_lookup_cache("Epartial_phislice",Epartial_phislice);
+    }
+    if (lookupLayout==SoA) pack_lookup(&Epartial_phislice);
+  } else if (lookupCase==PhiZSlice){
+    printf("Populating lookup:  lookupCase==PhiZSlice\n");
+    if (green!=0){
+      printf("AnnularFieldSim::populate_lookup: PhiZSlice relies on z-translation symmetry, which only holds for free-space greens functions.  Use PhiSlice with rossegger.\n");
+      assert(1==2);
+    }
+    restore(Epartial_phizslice,nr_roi,nr,nphi,2*nz-1,0,0);
+    if (!load_lookup_cache("Epartial_phizslice",&Epartial_phizslice)){
+      populate_phizslice_lookup();
+      save_lookup_cache("Epartial_phizslice",Epartial_phizslice);
+    }
+    if (lookupLayout==SoA) pack_lookup(&Epartial_phizslice);
   } else if (lookupCase==Analytic){
     printf("Populating lookup:  lookupCase==Analytic ===> skipping!\n");
   } else if (lookupCase==NoLookup){
@@ -1060,6 +1743,158 @@ void  AnnularFieldSim::populate_lookup(){
   } else {
     assert(1==2);
   }
+  if (green!=0) green->PrintTermStats();
+  return;
+}
+
+unsigned long long AnnularFieldSim::lookup_cache_key(const char *tablename){
+  //hash of every parameter that changes the contents of a lookup table:  the table itself, the geometry, the binning,
+  //the roi, the lookup case, the storage precision, and which green's function is in use (with its series tolerance).
+  //note that the charge and the external fields do not enter the lookup tables, so they are not part of the key.
+  uint64_t h=cache_file_hash(tablename,strlen(tablename));
+  int version=LOOKUP_CACHE_VERSION;
+  h=cache_file_hash(&version,sizeof(version),h);
+  float geom[]={rmin,rmax,zmin,zmax,phispan};
+  h=cache_file_hash(geom,sizeof(geom),h);
+  int bins[]={nr,nphi,nz,
+	      rmin_roi,rmax_roi,phimin_roi,phimax_roi,zmin_roi,zmax_roi,
+	      (int)lookupCase,(int)sizeof(LookupScalar)};
+  h=cache_file_hash(bins,sizeof(bins),h);
+  if (lookupCase==HybridRes){
+    int hybrid[]={nr_high,nphi_high,nz_high,
+		  r_spacing,phi_spacing,z_spacing,
+		  rmin_roi_low,rmax_roi_low,phimin_roi_low,phimax_roi_low,zmin_roi_low,zmax_roi_low};
+    h=cache_file_hash(hybrid,sizeof(hybrid),h);
+  }
+  int greens[]={(green==0)?0:1, (green==0)?0:NumberOfOrders}; //free space, or the rossegger series to a given order.
+  h=cache_file_hash(greens,sizeof(greens),h);
+  if (green!=0){
+    double tolerance=green->GetTolerance(); //and how early the series may stop.
+    h=cache_file_hash(&tolerance,sizeof(tolerance),h);
+    unsigned long long table=green->TableChecksum(); //or which table stands in for it.
+    if (table!=0) h=cache_file_hash(&table,sizeof(table),h);
+  }
+  return h;
+}
+
+std::string AnnularFieldSim::lookup_cache_filename(const char *tablename){
+  char keystring[32];
+  snprintf(keystring,sizeof(keystring),"%016llx",lookup_cache_key(tablename));
+  return lookupCacheDir+"/"+tablename+"."+keystring+".lut";
+}
+
+bool AnnularFieldSim::load_lookup_cache(const char *tablename, MultiArray<LookupVector3> **table){
+  //returns true if '*table' was replaced by a read-only view of a valid cache file, false if it still needs to be built.
+  //the view reads straight from the mapping, so pages come off the disk as the sums first touch them and nothing is copied.
+  //only the header and the size are checked, unless lookupCacheVerify asks for the checksum over the whole table as well.
+  if (lookupCacheDir.empty()) return false;
+  std::string filename=lookup_cache_filename(tablename);
+  
+  int fd=open(filename.c_str(),O_RDONLY);
+  if (fd<0){
+    printf("AnnularFieldSim::load_lookup_cache: no cached %s at %s.  Will build it.\n",tablename,filename.c_str());
+    return false;
+  }
+  struct stat st;
+  uint64_t expectedSize=sizeof(LookupCacheHeader)+3*sizeof(LookupScalar)*(uint64_t)(*table)->Length();
+  if (fstat(fd,&st)!=0 || (uint64_t)st.st_size!=expectedSize){
+    printf("AnnularFieldSim::load_lookup_cache: %s has the wrong size (truncated or stale).  Will rebuild it.\n",filename.c_str());
+    close(fd);
+    return false;
+  }
+  void *map=mmap(0,expectedSize,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd); //the mapping stays valid after the descriptor is closed.
+  if (map==MAP_FAILED){
+    printf("AnnularFieldSim::load_lookup_cache: could not map %s.  Will rebuild it.\n",filename.c_str());
+    return false;
+  }
+  
+  const LookupCacheHeader *header=static_cast<const LookupCacheHeader*>(map);
+  //the header is a multiple of 8 bytes and the mapping starts on a page, so the data block is aligned for LookupScalar.
+  LookupScalar *data=reinterpret_cast<LookupScalar*>(static_cast<char*>(map)+sizeof(LookupCacheHeader));
+  bool valid=(memcmp(header->magic,lookupCacheMagic,sizeof(lookupCacheMagic))==0
+	      && header->version==LOOKUP_CACHE_VERSION
+	      && header->headerSize==sizeof(LookupCacheHeader)
+	      && header->key==lookup_cache_key(tablename)
+	      && header->dim==(*table)->dim
+	      && header->length==(uint64_t)(*table)->Length());
+  for (int i=0;valid && i<(*table)->dim;i++)
+    valid=(header->n[i]==(*table)->n[i]);
+  if (!valid){
+    printf("AnnularFieldSim::load_lookup_cache: %s does not match this configuration (stale).  Will rebuild it.\n",filename.c_str());
+    munmap(map,expectedSize);
+    return false;
+  }
+  if (lookupCacheVerify && header->checksum!=checksum_scalars(data,3*header->length)){
+    printf("AnnularFieldSim::load_lookup_cache: %s fails its checksum (corrupt).  Will rebuild it.\n",filename.c_str());
+    munmap(map,expectedSize);
+    return false;
+  }
+
+  //the data block has the same layout as the table, so the table can be the file itself.
+  MultiArray<LookupVector3> *view=new MultiArray<LookupVector3>((*table)->n,reinterpret_cast<LookupVector3*>(data),map,expectedSize);
+  (*table)->Release();
+  delete *table;
+  *table=view;
+  printf("AnnularFieldSim::load_lookup_cache: mapped %s (%d elements) from %s\n",tablename,view->Length(),filename.c_str());
+  return true;
+}
+
+void AnnularFieldSim::save_lookup_cache(const char *tablename, MultiArray<LookupVector3> *table){
+  if (lookupCacheDir.empty()) return;
+  mkdir(lookupCacheDir.c_str(),0755); //harmless if it already exists.
+  std::string filename=lookup_cache_filename(tablename);
+
+  //LookupVector3 is just (x,y,z), so the table already is the data block of the file.
+  const LookupScalar *data=reinterpret_cast<const LookupScalar*>(table->field);
+  uint64_t ndata=3*(uint64_t)table->Length();
+  LookupCacheHeader header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,lookupCacheMagic,sizeof(lookupCacheMagic));
+  header.version=LOOKUP_CACHE_VERSION;
+  header.headerSize=sizeof(LookupCacheHeader);
+  header.key=lookup_cache_key(tablename);
+  header.dim=table->dim;
+  for (int i=0;i<6;i++)
+    header.n[i]=table->n[i];
+  header.length=table->Length();
+  header.checksum=checksum_scalars(data,ndata);
+
+  bool ok=write_cache_file(filename,[&](FILE *out){
+      return fwrite(&header,sizeof(header),1,out)==1
+	&& fwrite(data,sizeof(LookupScalar),ndata,out)==ndata;
+    });
+  if (!ok){
+    printf("AnnularFieldSim::save_lookup_cache: failed writing %s.  Not caching %s.\n",filename.c_str(),tablename);
+    return;
+  }
+  printf("AnnularFieldSim::save_lookup_cache: saved %s to %s\n",tablename,filename.c_str());
+  return;
+}
+
+void AnnularFieldSim::parallel_for(int njobs, std::function<void(int)> job){
+  //runs job(0)...job(njobs-1) on a pool of nThreads workers.  Each worker pulls the next unclaimed job index until none remain,
+  //so jobs must write to disjoint parts of memory.  Since every job does exactly the same arithmetic it would have done serially,
+  //the results do not depend on the number of threads or the order in which jobs are picked up.
+  int nworkers=nThreads;
+  if (nworkers<=0) nworkers=std::thread::hardware_concurrency();
+  if (nworkers>njobs) nworkers=njobs;
+  if (nworkers<=1){
+    for (int i=0;i<njobs;i++)
+      job(i);
+    return;
+  }
+
+  std::atomic<int> nextJob(0);
+  std::vector<std::thread> pool;
+  for (int i=0;i<nworkers;i++){
+    pool.push_back(std::thread([&nextJob,&job,njobs](){
+	  for (int j=nextJob++;j<njobs;j=nextJob++)
+	    job(j);
+	}));
+  }
+  for (int i=0;i<nworkers;i++)
+    pool[i].join();
   return;
 }
 
@@ -1068,241 +1903,285 @@ void  AnnularFieldSim::populate_full3d_lookup(){
   //remember the 'f' part of Epartial uses relative indices.
   //  TVector3 (*f)[fx][fy][fz][ox][oy][oz]=field_;
   //printf("populating lookup for (%dx%dx%d)x(%dx%dx%d) grid\n",fx,fy,fz,ox,oy,oz);
-  TVector3 at(1,0,0);
-  TVector3 from(1,0,0);
-  TVector3 zero(0,0,0);
-
-  for (int ifr=rmin_roi;ifr<rmax_roi;ifr++){
-    for (int ifphi=phimin_roi;ifphi<phimax_roi;ifphi++){
-      for (int ifz=zmin_roi;ifz<zmax_roi;ifz++){
-	at=GetCellCenter(ifr, ifphi, ifz);
-	for (int ior=0;ior<nr;ior++){
-	  for (int iophi=0;iophi<nphi;iophi++){
-	    for (int ioz=0;ioz<nz;ioz++){
-	      from=GetCellCenter(ior, iophi, ioz);
-
-	      //*f[ifx][ify][ifz][iox][ioy][ioz]=cacl_unit_field(at,from);
-	      //printf("calc_unit_field...\n");
-	      if (ifr==ior && ifphi==iophi && ifz==ioz){
-		Epartial->Set(ifr-rmin_roi,ifphi-phimin_roi,ifz-zmin_roi,ior,iophi,ioz,zero);
-	      } else{
-	      Epartial->Set(ifr-rmin_roi,ifphi-phimin_roi,ifz-zmin_roi,ior,iophi,ioz,calc_unit_field(at,from));
-	      }
+
+  //each job is one 'f' cell in the roi, and fills that cell's full slab of sources.
+  parallel_for(nr_roi*nphi_roi*nz_roi,[this](int job){
+      TVector3 at(1,0,0);
+      TVector3 from(1,0,0);
+      TVector3 zero(0,0,0);
+      int ifr=job/(nphi_roi*nz_roi)+rmin_roi;
+      int ifphi=(job/nz_roi)%nphi_roi+phimin_roi;
+      int ifz=job%nz_roi+zmin_roi;
+      at=GetCellCenter(ifr, ifphi, ifz);
+      for (int ior=0;ior<nr;ior++){
+	for (int iophi=0;iophi<nphi;iophi++){
+	  for (int ioz=0;ioz<nz;ioz++){
+	    from=GetCellCenter(ior, iophi, ioz);
+
+	    //*f[ifx][ify][ifz][iox][ioy][ioz]=cacl_unit_field(at,from);
+	    //printf("calc_unit_field...\n");
+	    if (ifr==ior && ifphi==iophi && ifz==ioz){
+	      Epartial->Set(ifr-rmin_roi,ifphi-phimin_roi,ifz-zmin_roi,ior,iophi,ioz,LookupVector3(zero));
+	    } else{
+	      Epartial->Set(ifr-rmin_roi,ifphi-phimin_roi,ifz-zmin_roi,ior,iophi,ioz,LookupVector3(calc_unit_field(at,from)));
 	    }
 	  }
 	}
       }
-    }
-  }
+    });
   return;
 
 }
 
+void  AnnularFieldSim::pack_lookup(MultiArray<LookupVector3> **table){
+  //copy a lookup table into three planes, one per component, so the field sums can stream through one component with vector loads.
+  //The (x,y,z) version is released afterwards, since holding both would double the largest table we have.
+  size_t n=(*table)->Length();
+  printf("AnnularFieldSim::pack_lookup packing %zu elements into component planes\n",n);
+  for (int c=0;c<3;c++) Epartial_soa[c].resize(n);
+  size_t chunk=1<<16;
+  parallel_for((n+chunk-1)/chunk,[&](int job){
+      for (size_t i=job*chunk;i<n && i<(job+1)*chunk;i++){
+	LookupVector3 *e=(*table)->field+i;
+	Epartial_soa[0][i]=e->x;
+	Epartial_soa[1][i]=e->y;
+	Epartial_soa[2][i]=e->z;
+      }
+    });
+  (*table)->Release();
+  delete *table;
+  *table=new MultiArray<LookupVector3>(1);
+  (*table)->GetFlat(0)->SetXYZ(0,0,0);
+  return;
+}
 
+PackedVector3D AnnularFieldSim::lookup_element(MultiArray<LookupVector3> *table, size_t flat){
+  //element 'flat' of the lookup table in use, whether or not it has been packed into planes.
+  if (!Epartial_soa[0].empty())
+    return PackedVector3D(Epartial_soa[0][flat],Epartial_soa[1][flat],Epartial_soa[2][flat]);
+  const LookupVector3 *e=table->GetFlat(flat);
+  return PackedVector3D(e->x,e->y,e->z);
+}
 
 void AnnularFieldSim::populate_highres_lookup(){
 
-  TVector3 at(1,0,0);
-  TVector3 from(1,0,0);
-  TVector3 zero(0,0,0);
-
   //populate_highres_lookup();
   int r_highres_dist=(nr_high-1)/2;
   int phi_highres_dist=(nphi_high-1)/2;
   int z_highres_dist=(nz_high-1)/2;
 
+  //todo: if this runs too slowly, I can do geometry instead of looping over all the cells that are possibly in range
 
-  //number of fbins contained in the 26 weirdly-shaped edge regions (and one center region which we won't use)
-  static int nfbinsin[3][3][3];
-  for (int i=0;i<3;i++){
-    for (int j=0;j<3;j++){
-      for (int k=0;k<3;k++){
-	nfbinsin[i][j][k]=0; //we could count total volume, but without knowing the charge prior, it's not clear that'd be /better/
-      }
-    }
-  }
 
-  //todo: if this runs too slowly, I can do geometry instead of looping over all the cells that are possibly in range
+  //the work for a single f-bin in the roi.  'nfbinsin' is the running count of fbins contained in the 26 weirdly-shaped edge regions
+  //(and one center region which we won't use), which is updated as we go.  If 'fill' is false we only advance those counts.
+  auto fill_highres_cell=[&](int job, int (*nfbinsin)[3][3], bool fill){
+    TVector3 at(1,0,0);
+    TVector3 from(1,0,0);
+    TVector3 zero(0,0,0);
+    TVector3 currentf, newf; //the averaged field vector without, and then with the new contribution from the f-bin being considered.
 
+    int ifr=job/(nphi_roi*nz_roi)+rmin_roi;
+    int ifphi=(job/nz_roi)%nphi_roi+phimin_roi;
+    int ifz=job%nz_roi+zmin_roi;
 
-  //loop over all the f-bins in the roi:
-  TVector3 currentf, newf; //the averaged field vector without, and then with the new contribution from the f-bin being considered.
-  for (int ifr=rmin_roi;ifr<rmax_roi;ifr++){
     int r_parentlow=floor((ifr-r_highres_dist)/(r_spacing*1.0));//l-bin partly enclosed in our high-res region
     int r_parenthigh=floor((ifr+r_highres_dist)/(r_spacing*1.0))+1;//definitely not enclosed in our high-res region
     int r_startpoint=r_parentlow*r_spacing;//the first f-bin of the lowest-r f-bin that our h-region touches.  COuld be less than zero.
     int r_endpoint=r_parenthigh*r_spacing;//the first f-bin of the lowest-r l-bin after that that our h-region does not touch.  could be larger than max.
 
-    for (int ifphi=phimin_roi;ifphi<phimax_roi;ifphi++){
+    int phi_parentlow=floor(FilterPhiIndex(ifphi-phi_highres_dist)/(phi_spacing*1.0));//note this may have wrapped around
+    bool phi_parentlow_wrapped=(ifphi-phi_highres_dist<0);
+    int phi_startpoint=phi_parentlow*phi_spacing;//the first f-bin of the lowest-z f-bin that our h-region touches.
+    if (phi_parentlow_wrapped) phi_startpoint-=nphi; //if we wrapped, re-wrap us so we're negative again
       
-      int phi_parentlow=floor(FilterPhiIndex(ifphi-phi_highres_dist)/(phi_spacing*1.0));//note this may have wrapped around
-      bool phi_parentlow_wrapped=(ifphi-phi_highres_dist<0);
-      int phi_startpoint=phi_parentlow*phi_spacing;//the first f-bin of the lowest-z f-bin that our h-region touches.
-      if (phi_parentlow_wrapped) phi_startpoint-=nphi; //if we wrapped, re-wrap us so we're negative again
-      
-      int phi_parenthigh=floor(FilterPhiIndex(ifphi+phi_highres_dist)/(phi_spacing*1.0))+1; //note that this may have wrapped around
-      bool phi_parenthigh_wrapped=(ifphi+phi_highres_dist>=nphi);
-      int phi_endpoint=phi_parenthigh*phi_spacing;
-      if (phi_parenthigh_wrapped) phi_endpoint+=nphi; //if we wrapped, re-wrap us so we're larger than nphi again.  We use these relative coords to determine the position relative to the center of our h-region.
-
-      for (int ifz=zmin_roi;ifz<zmax_roi;ifz++){
-	//if(debugFlag()) printf("%d: AnnularFieldSim::populate_highres_lookup icell=(%d,%d,%d)\n",__LINE__,ifr,ifphi,ifz);
-
-	int z_parentlow=floor((ifz-z_highres_dist)/(z_spacing*1.0));
-	int z_parenthigh=floor((ifz+z_highres_dist)/(z_spacing*1.0))+1;
-	int z_startpoint=z_parentlow*z_spacing;//the first f-bin of the lowest-z f-bin that our h-region touches.
-	int z_endpoint=z_parenthigh*z_spacing;//the first f-bin of the lowest-z l-bin after that that our h-region does not touch.
-
-	//our 'at' position, in global coords:
-	at=GetCellCenter(ifr, ifphi, ifz);
-	//define the farthest-away parent l-bin cells we're dealing with here:
-	//note we're still in absolute coordinates
+    int phi_parenthigh=floor(FilterPhiIndex(ifphi+phi_highres_dist)/(phi_spacing*1.0))+1; //note that this may have wrapped around
+    bool phi_parenthigh_wrapped=(ifphi+phi_highres_dist>=nphi);
+    int phi_endpoint=phi_parenthigh*phi_spacing;
+    if (phi_parenthigh_wrapped) phi_endpoint+=nphi; //if we wrapped, re-wrap us so we're larger than nphi again.  We use these relative coords to determine the position relative to the center of our h-region.
+
+    //if(debugFlag()) printf("%d: AnnularFieldSim::populate_highres_lookup icell=(%d,%d,%d)\n",__LINE__,ifr,ifphi,ifz);
+
+    int z_parentlow=floor((ifz-z_highres_dist)/(z_spacing*1.0));
+    int z_parenthigh=floor((ifz+z_highres_dist)/(z_spacing*1.0))+1;
+    int z_startpoint=z_parentlow*z_spacing;//the first f-bin of the lowest-z f-bin that our h-region touches.
+    int z_endpoint=z_parenthigh*z_spacing;//the first f-bin of the lowest-z l-bin after that that our h-region does not touch.
+
+    //our 'at' position, in global coords:
+    at=GetCellCenter(ifr, ifphi, ifz);
+    //define the farthest-away parent l-bin cells we're dealing with here:
+    //note we're still in absolute coordinates
 	
 	
 
-	//for every f-bin in the l-bins we're dealing with, figure out which relative highres bin it's in, and average the field vector into that bin's vector
-	//note most of these relative bins have exactly one f-bin in them.  It's only the edges that can get more.
-	//note this is a running average:  Anew=(Aold*Nold+V)/(Nold+1) and so on.
-	//note also that we automatically skip f-bins that would've been out of the valid overall volume.
-	for (int ir=r_startpoint;ir<r_endpoint;ir++){
-	  //skip parts that are out of range:
-	  //could speed this up by moving this into the definition of start and endpoint.
-	  if (ir<0) ir=0;
-	  if (ir>=nr) break;
+    //for every f-bin in the l-bins we're dealing with, figure out which relative highres bin it's in, and average the field vector into that bin's vector
+    //note most of these relative bins have exactly one f-bin in them.  It's only the edges that can get more.
+    //note this is a running average:  Anew=(Aold*Nold+V)/(Nold+1) and so on.
+    //note also that we automatically skip f-bins that would've been out of the valid overall volume.
+    for (int ir=r_startpoint;ir<r_endpoint;ir++){
+      //skip parts that are out of range:
+      //could speed this up by moving this into the definition of start and endpoint.
+      if (ir<0) ir=0;
+      if (ir>=nr) break;
 	  
-	  int rbin=(ir-ifr)+r_highres_dist;//zeroth bin when we're at max distance below, etc.
-	  int rcell=1;
-	  if (rbin<=0) {
-	    rbin=0;
-	    rcell=0;
+      int rbin=(ir-ifr)+r_highres_dist;//zeroth bin when we're at max distance below, etc.
+      int rcell=1;
+      if (rbin<=0) {
+	rbin=0;
+	rcell=0;
+      }
+      if (rbin>=nr_high){
+	rbin=nr_high-1;
+	rcell=2;
+      }
+
+      for (int iphi=phi_startpoint;iphi<phi_endpoint;iphi++){
+	//no phi out-of-range checks since it's circular, but we provide ourselves a filtered version:
+	int phiFilt=FilterPhiIndex(iphi);
+	int phibin=(iphi-ifphi)+phi_highres_dist;
+	int phicell=1;
+	if (phibin<=0) {
+	  phibin=0;
+	  phicell=0;
+	}
+	if (phibin>=nphi_high){
+	  phibin=nphi_high-1;
+	  phicell=2;
+	}
+	for (int iz=z_startpoint;iz<z_endpoint;iz++){
+	  if (iz<0) iz=0;
+	  if (iz>=nz) break;
+	  int zbin=(iz-ifz)+z_highres_dist;
+	  int zcell=1;
+	  if (zbin<=0) {
+	    zbin=0;
+	    zcell=0;
 	  }
-	  if (rbin>=nr_high){
-	    rbin=nr_high-1;
-	    rcell=2;
+	  if (zbin>=nz_high){
+	    zbin=nz_high-1;
+	    zcell=2;
 	  }
-
-	  for (int iphi=phi_startpoint;iphi<phi_endpoint;iphi++){
-	    //no phi out-of-range checks since it's circular, but we provide ourselves a filtered version:
-	    int phiFilt=FilterPhiIndex(iphi);
-	    int phibin=(iphi-ifphi)+phi_highres_dist;
-	    int phicell=1;
-	    if (phibin<=0) {
-	      phibin=0;
-	      phicell=0;
-	    }
-	    if (phibin>=nphi_high){
-	      phibin=nphi_high-1;
-	      phicell=2;
-	    }
-	    for (int iz=z_startpoint;iz<z_endpoint;iz++){
-	      if (iz<0) iz=0;
-	      if (iz>=nz) break;
-	      int zbin=(iz-ifz)+z_highres_dist;
-	      int zcell=1;
-	      if (zbin<=0) {
-		zbin=0;
-		zcell=0;
-	      }
-	      if (zbin>=nz_high){
-		zbin=nz_high-1;
-		zcell=2;
-	      }
-	      //'from' is in absolute coordinates
-	      from=GetCellCenter(ir, phiFilt, iz);
 	      
-	      nfbinsin[rcell][phicell][zcell]++;
-	      int nf= nfbinsin[rcell][phicell][zcell];
-	      //coordinates relative to the region of interest:
-	      int ir_rel=ifr-rmin_roi;
-	      int iphi_rel=ifphi-phimin_roi;
-	      int iz_rel=ifz-zmin_roi;
-	      if (zcell!=1 || rcell!=1 || phicell!=1){
-		//we're not in the center, so deal with our weird shapes by averaging:
-		//but Epartial is in coordinates relative to the roi
-		if (iphi_rel<0) printf("%d: Getting with phi=%d\n",__LINE__,iphi_rel);
-		currentf=Epartial_highres->Get(ir_rel,iphi_rel,iz_rel,rbin,phibin,zbin);
-		//to keep this as the average, we multiply what's there back to its initial summed-but-not-divided value
-		//then add our new value, and the divide the new sum by the total number of cells
-		newf=(currentf*(nf-1)+calc_unit_field(at,from))*(1/(nf*1.0)); 
-		Epartial_highres->Set(ir_rel,iphi_rel,iz_rel,rbin,phibin,zbin,newf);
-	      }else{
-		//we're in the center cell, which means any f-bin that's not on the outer edge of our region:
-		//calc_unit_field will return zero when at=from, so the center will be automatically zero here.
-		if (ifr==rbin && ifphi==phibin && ifz==zbin){
-		  Epartial_highres->Set(ir_rel,iphi_rel,iz_rel,rbin,phibin,zbin,zero);
-		}else{ //for extra carefulness, only calc the field if it's not self-to-self.
-		  newf=calc_unit_field(at,from);
-		  Epartial_highres->Set(ir_rel,iphi_rel,iz_rel,rbin,phibin,zbin,newf);
-		}
-	      }
-
+	  nfbinsin[rcell][phicell][zcell]++;
+	  if (!fill) continue;
+	  int nf= nfbinsin[rcell][phicell][zcell];
+
+	  //'from' is in absolute coordinates
+	  from=GetCellCenter(ir, phiFilt, iz);
+	  //coordinates relative to the region of interest:
+	  int ir_rel=ifr-rmin_roi;
+	  int iphi_rel=ifphi-phimin_roi;
+	  int iz_rel=ifz-zmin_roi;
+	  if (zcell!=1 || rcell!=1 || phicell!=1){
+	    //we're not in the center, so deal with our weird shapes by averaging:
+	    //but Epartial is in coordinates relative to the roi
+	    if (iphi_rel<0) printf("%d: Getting with phi=%d\n",__LINE__,iphi_rel);
+	    currentf=TVector3(Epartial_highres->Get(ir_rel,iphi_rel,iz_rel,rbin,phibin,zbin));
+	    //to keep this as the average, we multiply what's there back to its initial summed-but-not-divided value
+	    //then add our new value, and the divide the new sum by the total number of cells
+	    newf=(currentf*(nf-1)+calc_unit_field(at,from))*(1/(nf*1.0)); 
+	    Epartial_highres->Set(ir_rel,iphi_rel,iz_rel,rbin,phibin,zbin,LookupVector3(newf));
+	  }else{
+	    //we're in the center cell, which means any f-bin that's not on the outer edge of our region:
+	    //calc_unit_field will return zero when at=from, so the center will be automatically zero here.
+	    if (ifr==rbin && ifphi==phibin && ifz==zbin){
+	      Epartial_highres->Set(ir_rel,iphi_rel,iz_rel,rbin,phibin,zbin,LookupVector3(zero));
+	    }else{ //for extra carefulness, only calc the field if it's not self-to-self.
+	      newf=calc_unit_field(at,from);
+	      Epartial_highres->Set(ir_rel,iphi_rel,iz_rel,rbin,phibin,zbin,LookupVector3(newf));
 	    }
 	  }
+
 	}
       }
     }
+    return;
+  };
+
+  //the edge-region counts are carried from one f-bin to the next in the serial loop order, so the averaging weights depend on
+  //every f-bin visited before this one.  To stay identical to the serial build, do a cheap counting-only pass first and
+  //record where each f-bin's counts start, then do the expensive part in parallel from those starting points.
+  int njobs=nr_roi*nphi_roi*nz_roi;
+  std::vector<int> startCounts(njobs*27);
+  int nfbinsin[3][3][3];
+  for (int i=0;i<3;i++){
+    for (int j=0;j<3;j++){
+      for (int k=0;k<3;k++){
+	nfbinsin[i][j][k]=0; //we could count total volume, but without knowing the charge prior, it's not clear that'd be /better/
+      }
+    }
   }
+  for (int job=0;job<njobs;job++){
+    std::copy(&nfbinsin[0][0][0],&nfbinsin[0][0][0]+27,&startCounts[job*27]);
+    fill_highres_cell(job,nfbinsin,false);
+  }
+
+  parallel_for(njobs,[&](int job){
+      int localCounts[3][3][3];
+      std::copy(&startCounts[job*27],&startCounts[job*27]+27,&localCounts[0][0][0]);
+      fill_highres_cell(job,localCounts,true);
+    });
   return;
 }
 
 void AnnularFieldSim::populate_lowres_lookup(){
 
-  TVector3 at(1,0,0);
-  TVector3 from(1,0,0);
-  TVector3 zero(0,0,0);
-  int fr_low,fr_high,fphi_low,fphi_high,fz_low,fz_high;//edges of the outer l-bin
-  int r_low,r_high,phi_low,phi_high,z_low,z_high;//edges of the inner l-bin
-
   //todo:  add in handling if roi_low is wrap-around in phi
-  for (int ifr=rmin_roi_low;ifr<rmax_roi_low;ifr++){
-    fr_low=ifr*r_spacing;
-    fr_high=fr_low+r_spacing-1;
-    if (fr_high>=nr) fr_high=nr-1;	
-    for (int ifphi=phimin_roi_low;ifphi<phimax_roi_low;ifphi++){
+  //each job is one outer l-bin in the roi, and fills that l-bin's full slab of sources.
+  parallel_for(nr_roi_low*nphi_roi_low*nz_roi_low,[this](int job){
+      TVector3 at(1,0,0);
+      TVector3 from(1,0,0);
+      TVector3 zero(0,0,0);
+      int fr_low,fr_high,fphi_low,fphi_high,fz_low,fz_high;//edges of the outer l-bin
+      int r_low,r_high,phi_low,phi_high,z_low,z_high;//edges of the inner l-bin
+
+      int ifr=job/(nphi_roi_low*nz_roi_low)+rmin_roi_low;
+      int ifphi=(job/nz_roi_low)%nphi_roi_low+phimin_roi_low;
+      int ifz=job%nz_roi_low+zmin_roi_low;
+      fr_low=ifr*r_spacing;
+      fr_high=fr_low+r_spacing-1;
+      if (fr_high>=nr) fr_high=nr-1;	
       fphi_low=ifphi*phi_spacing;
       fphi_high=fphi_low+phi_spacing-1;
       if (fphi_high>=nphi) fphi_high=nphi-1; //if our phi l-bins aren't evenly spaced, we need to catch that here.
-      for (int ifz=zmin_roi_low;ifz<zmax_roi_low;ifz++){
-	fz_low=ifz*z_spacing;
-	fz_high=fz_low+z_spacing-1;
-	if (fz_high>=nz) fz_high=nz-1;
-	at=GetGroupCellCenter(fr_low,fr_high,fphi_low,fphi_high,fz_low,fz_high);
-	//printf("ifr=%d, rlow=%d,rhigh=%d,r_spacing=%d\n",ifr,r_low,r_high,r_spacing);
-	//if(debugFlag())	  printf("%d: AnnularFieldSim::populate_lowres_lookup icell=(%d,%d,%d)\n",__LINE__,ifr,ifphi,ifz);
+      fz_low=ifz*z_spacing;
+      fz_high=fz_low+z_spacing-1;
+      if (fz_high>=nz) fz_high=nz-1;
+      at=GetGroupCellCenter(fr_low,fr_high,fphi_low,fphi_high,fz_low,fz_high);
+      //printf("ifr=%d, rlow=%d,rhigh=%d,r_spacing=%d\n",ifr,r_low,r_high,r_spacing);
+      //if(debugFlag())	  printf("%d: AnnularFieldSim::populate_lowres_lookup icell=(%d,%d,%d)\n",__LINE__,ifr,ifphi,ifz);
 		
-	for (int ior=0;ior<nr_low;ior++){
-	  r_low=ior*r_spacing;
-	  r_high=r_low+r_spacing-1;
-	  int ir_rel=ifr-rmin_roi_low;
-
-	  if (r_high>=nr) r_high=nr-1;
-	  for (int iophi=0;iophi<nphi_low;iophi++){
-	    phi_low=iophi*phi_spacing;
-	    phi_high=phi_low+phi_spacing-1;
-	    if (phi_high>=nphi) phi_high=nphi-1;
-	    int iphi_rel=ifphi-phimin_roi_low;
-	    for (int ioz=0;ioz<nz_low;ioz++){
-	      z_low=ioz*z_spacing;
-	      z_high=z_low+z_spacing-1;
-	      if (z_high>=nz) z_high=nz-1;
-	      int iz_rel=ifz-zmin_roi_low;
-	      from=GetGroupCellCenter(r_low,r_high,phi_low,phi_high,z_low,z_high);
-
-		if (ifr==ior && ifphi==iophi && ifz==ioz){
-		  Epartial_lowres->Set(ir_rel,iphi_rel,iz_rel,ior,iophi,ioz,zero);
-		}else{ //for extra carefulness, only calc the field if it's not self-to-self.
-		  Epartial_lowres->Set(ir_rel,iphi_rel,iz_rel,ior,iophi,ioz,calc_unit_field(at,from));
-		}
-	      
-	      //*f[ifx][ify][ifz][iox][ioy][ioz]=cacl_unit_field(at,from);
-	      //printf("calc_unit_field...\n");
-	      //this calc's okay.
+      for (int ior=0;ior<nr_low;ior++){
+	r_low=ior*r_spacing;
+	r_high=r_low+r_spacing-1;
+	int ir_rel=ifr-rmin_roi_low;
+
+	if (r_high>=nr) r_high=nr-1;
+	for (int iophi=0;iophi<nphi_low;iophi++){
+	  phi_low=iophi*phi_spacing;
+	  phi_high=phi_low+phi_spacing-1;
+	  if (phi_high>=nphi) phi_high=nphi-1;
+	  int iphi_rel=ifphi-phimin_roi_low;
+	  for (int ioz=0;ioz<nz_low;ioz++){
+	    z_low=ioz*z_spacing;
+	    z_high=z_low+z_spacing-1;
+	    if (z_high>=nz) z_high=nz-1;
+	    int iz_rel=ifz-zmin_roi_low;
+	    from=GetGroupCellCenter(r_low,r_high,phi_low,phi_high,z_low,z_high);
+
+	    if (ifr==ior && ifphi==iophi && ifz==ioz){
+	      Epartial_lowres->Set(ir_rel,iphi_rel,iz_rel,ior,iophi,ioz,LookupVector3(zero));
+	    }else{ //for extra carefulness, only calc the field if it's not self-to-self.
+	      Epartial_lowres->Set(ir_rel,iphi_rel,iz_rel,ior,iophi,ioz,LookupVector3(calc_unit_field(at,from)));
 	    }
+	      
+	    //*f[ifx][ify][ifz][iox][ioy][ioz]=cacl_unit_field(at,from);
+	    //printf("calc_unit_field...\n");
+	    //this calc's okay.
 	  }
 	}
       }
-    }
-  }
+    });
   return;
 
 }
@@ -1312,46 +2191,79 @@ void  AnnularFieldSim::populate_phislice_lookup(){
   //remember the 'f' part of Epartial uses relative indices.
   //  TVector3 (*f)[fx][fy][fz][ox][oy][oz]=field_;
   printf("populating phislice  lookup for (%dx%dx%d)x(%dx%dx%d) grid\n",nr_roi,1,nz_roi,nr,nphi,nz);
-  TVector3 at(1,0,0);
-  TVector3 from(1,0,0);
-  TVector3 zero(0,0,0);
 
-  int counter=0;
-  int checkin=127;
+  //every 'f' cell sees the same sources, so lay those out once, in the (ior,iophi,ioz) order of the table.
+  int nsrc=nr*nphi*nz;
+  std::vector<double> srcx(nsrc), srcy(nsrc), srcz(nsrc);
+  for (int ior=0;ior<nr;ior++){
+    for (int iophi=0;iophi<nphi;iophi++){
+      for (int ioz=0;ioz<nz;ioz++){
+	TVector3 from=GetCellCenter(ior, iophi, ioz);
+	int i=(ior*nphi+iophi)*nz+ioz;
+	srcx[i]=from.X();
+	srcy[i]=from.Y();
+	srcz[i]=from.Z();
+      }
+    }
+  }
+
+  //each job is one (r,z) 'f' cell in the phi=0 slice, and fills that cell's full slab of sources with one batch call.
+  parallel_for(nr_roi*nz_roi,[&](int job){
+      TVector3 zero(0,0,0);
+      std::vector<double> fx(nsrc), fy(nsrc), fz(nsrc);
 
-  for (int ifr=rmin_roi;ifr<rmax_roi;ifr++){
-    for (int ifz=zmin_roi;ifz<zmax_roi;ifz++){
-      at=GetCellCenter(ifr, 0, ifz);
+      int ifr=job/nz_roi+rmin_roi;
+      int ifz=job%nz_roi+zmin_roi;
+      TVector3 at=GetCellCenter(ifr, 0, ifz);
+      calc_unit_field(at,nsrc,&srcx[0],&srcy[0],&srcz[0],&fx[0],&fy[0],&fz[0]);
       for (int ior=0;ior<nr;ior++){
 	for (int iophi=0;iophi<nphi;iophi++){
 	  for (int ioz=0;ioz<nz;ioz++){
-	    from=GetCellCenter(ior, iophi, ioz);
-		
-			    //printf("calc_unit_field...\n");
-
-	    
-	    //*f[ifx][ify][ifz][iox][ioy][ioz]=cacl_unit_field(at,from);
-	    //printf("calc_unit_field...\n");
 	    if (ifr==ior && 0==iophi && ifz==ioz){
-	      Epartial_phislice->Set(ifr-rmin_roi,0,ifz-zmin_roi,ior,iophi,ioz,zero);
+	      Epartial_phislice->Set(ifr-rmin_roi,0,ifz-zmin_roi,ior,iophi,ioz,LookupVector3(zero));
 	    } else{
-	      TVector3 unitf=calc_unit_field(at,from);
-	      if (1){
-		counter++;
-		if (!(counter%checkin)){
-		  counter=0;
-		  printf("calc_unit_field (ir=%d,iphi=%d,iz=%d) to (or=%d,ophi=0,oz=%d) gives (%E,%E,%E)\n",
-			 ior,iophi,ioz,ifr,ifz,unitf.X(),unitf.Y(),unitf.Z());
-		}
-	      }
-
-	      Epartial_phislice->Set(ifr-rmin_roi,0,ifz-zmin_roi,ior,iophi,ioz,unitf);
-	      }
+	      int i=(ior*nphi+iophi)*nz+ioz;
+	      Epartial_phislice->Set(ifr-rmin_roi,0,ifz-zmin_roi,ior,iophi,ioz,LookupVector3(fx[i],fy[i],fz[i]));
 	    }
 	  }
 	}
       }
-    }
+    });
+  //no per-element printout from the workers:  it serialized them on stdout and interleaved arbitrarily.
+  printf("populated phislice lookup, %d f-cells x %d sources\n",nr_roi*nz_roi,nsrc);
+  return;
+
+}
+
+void  AnnularFieldSim::populate_phizslice_lookup(){
+  //with 'f' being the position the field is being measured at, and 'o' being the position of the charge generating the field.
+  //in free space the field depends only on the separation between the two, so we measure at phi=0, z=0 for each radius,
+  //and index the sources by their phi and z offsets from there.  dz runs from -(nz-1) to (nz-1), stored shifted up by nz-1.
+  //remember the 'f' part of Epartial uses relative indices.
+  printf("populating phizslice lookup for (%dx%dx%d)x(%dx%dx%d) grid\n",nr_roi,1,1,nr,nphi,2*nz-1);
+
+  //each job is one (r_at, r_from) pair, and fills that pair's phi-z plane of offsets.
+  parallel_for(nr_roi*nr,[this](int job){
+      TVector3 at(1,0,0);
+      TVector3 from(1,0,0);
+      TVector3 zero(0,0,0);
+
+      int ifr=job/nr+rmin_roi;
+      int ior=job%nr;
+      at=GetCellCenter(ifr, 0, 0);
+      for (int iophi=0;iophi<nphi;iophi++){
+	for (int idz=0;idz<2*nz-1;idz++){
+	  int dz=idz-(nz-1);
+	  if (ifr==ior && 0==iophi && 0==dz){
+	    Epartial_phizslice->Set(ifr-rmin_roi,ior,iophi,idz,0,0,LookupVector3(zero));
+	  } else {
+	    from=GetCellCenter(ior, iophi, 0);
+	    from.SetZ(from.Z()+dz*step.Z()); //may be outside the volume, which free space doesn't care about.
+	    Epartial_phizslice->Set(ifr-rmin_roi,ior,iophi,idz,0,0,LookupVector3(calc_unit_field(at,from)));
+	  }
+	}
+      }
+    });
   return;
 
 }
@@ -1365,6 +2277,8 @@ void AnnularFieldSim::setFlatFields(float B, float E){
   for (int i=0;i<Bfield->Length();i++)
     Bfield->GetFlat(i)->SetXYZ(0,0,B);
   Enominal=E;
+  update_drift_model();
+  build_field_zintegrals();
   return;
 }
 
@@ -1391,12 +2305,14 @@ TVector3 AnnularFieldSim::sum_field_at(int r,int phi, int z){
     sum+=sum_nonlocal_field_at(r,phi,z);
   } else if(lookupCase==PhiSlice){
     sum+=sum_phislice_field_at(r,phi,z);
+  } else if(lookupCase==PhiZSlice){
+    sum+=sum_phizslice_field_at(r,phi,z);
   } else if(lookupCase==Analytic){
     sum+=aliceModel->E(GetCellCenter(r, phi, z));
   } else if(lookupCase==NoLookup){
     //do nothing.  We are forcibly assuming E from spacecharge is zero everywhere.
   }
-  sum+=Eexternal->Get(r-rmin_roi,phi-phimin_roi,z-zmin_roi);
+  sum+=TVector3(Eexternal->Get(r-rmin_roi,phi-phimin_roi,z-zmin_roi));
   if(debugFlag()) printf("summed field at (%d,%d,%d)=(%f,%f,%f)\n",r,phi,z,sum.X(),sum.Y(),sum.Z());
 
   return sum;
@@ -1406,7 +2322,17 @@ TVector3 AnnularFieldSim::sum_full3d_field_at(int r,int phi, int z){
  //sum the E field over all nr by ny by nz cells of sources, at the specific position r,phi,z.
   //note the specific position in Epartial is in relative coordinates.
   //printf("AnnularFieldSim::sum_field_at(r=%d,phi=%d, z=%d)\n",r,phi,z);
-  TVector3 sum(0,0,0);
+  if (!Epartial_soa[0].empty()){
+    //packed table:  one row of the fieldmap gemv, which gives bit-identical results to populate_fieldmap_gemv.
+    //the self-to-self element is stored as zero, so there's nothing to skip.
+    const LookupScalar *A[3]={&Epartial_soa[0][0],&Epartial_soa[1][0],&Epartial_soa[2][0]};
+    double s[3]={0,0,0};
+    double *sp[3]={&s[0],&s[1],&s[2]};
+    int row=((r-rmin_roi)*nphi_roi+(phi-phimin_roi))*nz_roi+(z-zmin_roi);
+    gemv3_rows(A,(size_t)nr*nphi*nz,row,1,q->field,sp);
+    return TVector3(s[0],s[1],s[2]);
+  }
+  PackedVector3D sum(0,0,0);
   for (int ir=0;ir<nr;ir++){
     for (int iphi=0;iphi<nphi;iphi++){
       for (int iz=0;iz<nz;iz++){
@@ -1417,7 +2343,7 @@ TVector3 AnnularFieldSim::sum_full3d_field_at(int r,int phi, int z){
     }
   }
   //printf("summed field at (%d,%d,%d)=(%f,%f,%f)\n",x,y,z,sum.X(),sum.Y(),sum.Z());
-  return sum;
+  return TVector3(sum);
 }
 
 TVector3 AnnularFieldSim::sum_local_field_at(int r,int phi, int z){
@@ -1491,7 +2417,7 @@ TVector3 AnnularFieldSim::sum_local_field_at(int r,int phi, int z){
   //start building our full sum by scaling the local lookup table by q.
   //note that the lookup table needs to have already accounted for cell centers.
 
-  TVector3 sum(0,0,0);
+  PackedVector3D sum(0,0,0);
 
   //note that Epartial_highres returns zero if we're outside of the global region.  q_local will also be zero there.
   //these are loops over the position in the epartial highres grid, so relative to the point in question:
@@ -1509,7 +2435,7 @@ TVector3 AnnularFieldSim::sum_local_field_at(int r,int phi, int z){
     }
   }
 
-  return sum;
+  return TVector3(sum);
 }
 
 TVector3 AnnularFieldSim::sum_nonlocal_field_at(int r,int phi, int z){
@@ -1614,7 +2540,7 @@ TVector3 AnnularFieldSim::sum_nonlocal_field_at(int r,int phi, int z){
     zw[0]=1; //and weight like we're dead-center on the lower cells.
   }
 
-  TVector3 sum(0,0,0);
+  PackedVector3D sum(0,0,0);
   //at this point, we should be skipping all destination l-bins that are out-of-bounds.
   //note that if any out-of-bounds ones survive somehow, the call to Epartial_lowres will fail loudly.
   int lBinEdge[2];//lower and upper (included) edges of the low-res bin, measured in f-bins, reused per-dimension
@@ -1670,15 +2596,32 @@ TVector3 AnnularFieldSim::sum_nonlocal_field_at(int r,int phi, int z){
     }
   }
   
-  return sum;
+  return TVector3(sum);
 }
 
 TVector3 AnnularFieldSim::sum_phislice_field_at(int r,int phi, int z){
  //sum the E field over all nr by ny by nz cells of sources, at the specific position r,phi,z.
   //note the specific position in Epartial is in relative coordinates.
   //printf("AnnularFieldSim::sum_field_at(r=%d,phi=%d, z=%d)\n",r,phi,z);
-  TVector3 sum(0,0,0);
-  TVector3 unrotatedField(0,0,0);
+  if (!Epartial_soa[0].empty()){
+    //packed table:  for each source (r,phi) column the table and q are both contiguous in z, so the sum is a string of nz-long dot products.
+    //the rotation is the same for every term, so it's applied once to the sum.  The self-to-self element is stored as zero.
+    double s[3]={0,0,0};
+    size_t base=((size_t)(r-rmin_roi)*nz_roi+(z-zmin_roi))*nr;
+    for (int ir=0;ir<nr;ir++){
+      for (int iphi=0;iphi<nphi;iphi++){
+	size_t el=((base+ir)*nphi+FilterPhiIndex(iphi-phi))*nz;
+	const double *qcol=q->field+((size_t)ir*nphi+iphi)*nz;
+	for (int c=0;c<3;c++)
+	  s[c]+=dot_segment(&Epartial_soa[c][el],qcol,nz);
+      }
+    }
+    TVector3 sum(s[0],s[1],s[2]);
+    sum.RotateZ(phi*step.Phi());
+    return sum;
+  }
+  PackedVector3D sum(0,0,0);
+  PackedVector3D unrotatedField(0,0,0);
   int phirel;
   for (int ir=0;ir<nr;ir++){
     for (int iphi=0;iphi<nphi;iphi++){
@@ -1693,94 +2636,418 @@ TVector3 AnnularFieldSim::sum_phislice_field_at(int r,int phi, int z){
     }
   }
   //printf("summed field at (%d,%d,%d)=(%f,%f,%f)\n",x,y,z,sum.X(),sum.Y(),sum.Z());
-  return sum;
+  return TVector3(sum);
+}
+
+TVector3 AnnularFieldSim::sum_phizslice_field_at(int r,int phi, int z){
+ //sum the E field over all nr by ny by nz cells of sources, at the specific position r,phi,z.
+  //note the specific position in Epartial is in relative coordinates, and the sources are relative to the field point in phi and z.
+  //rotation is linear, so we can sum everything in the phi=0 frame and rotate once at the end.
+  if (!Epartial_soa[0].empty()){
+    //packed table:  for a given source (r,phi) column, iz runs contiguously over dz=iz-z+nz-1 in the table, so each column is an nz-long dot product.
+    double s[3]={0,0,0};
+    for (int ir=0;ir<nr;ir++){
+      for (int iphi=0;iphi<nphi;iphi++){
+	size_t el=(((size_t)(r-rmin_roi)*nr+ir)*nphi+FilterPhiIndex(iphi-phi))*(2*nz-1)+nz-1-z;
+	const double *qcol=q->field+((size_t)ir*nphi+iphi)*nz;
+	for (int c=0;c<3;c++)
+	  s[c]+=dot_segment(&Epartial_soa[c][el],qcol,nz);
+      }
+    }
+    TVector3 sum(s[0],s[1],s[2]);
+    sum.RotateZ(phi*step.Phi());
+    return sum;
+  }
+  PackedVector3D sum(0,0,0);
+  int phirel;
+  for (int ir=0;ir<nr;ir++){
+    for (int iphi=0;iphi<nphi;iphi++){
+      phirel=FilterPhiIndex(iphi-phi);
+      for (int iz=0;iz<nz;iz++){
+	if (r==ir && phi==iphi && z==iz) continue;//dont' compute self-to-self field.
+	sum+=Epartial_phizslice->Get(r-rmin_roi,ir,phirel,iz-z+nz-1)*q->Get(ir,iphi,iz);
+      }
+    }
+  }
+  sum.RotateZ(phi*step.Phi());
+  return TVector3(sum);
 }
 
 TVector3 AnnularFieldSim::swimToInAnalyticSteps(float zdest,TVector3 start,int steps=1, int *goodToStep=0){
+  SwimResult result=swimInSteps(zdest,start,steps,true);
+  if (!(goodToStep==0)) *goodToStep=result.goodSteps;
+  return result.pos;
+}
+
+AnnularFieldSim::SwimResult AnnularFieldSim::swimInSteps(float zdest,const TVector3 &start,int steps, bool useAnalytic){
+  SwimResult result=swim_in_steps(zdest,start,steps,useAnalytic);
+  count_swim(result.status);
+  return result;
+}
+
+inline AnnularFieldSim::SwimStatus AnnularFieldSim::step_start(double r, double phi, double *z, float zend){
+  //the check at the top of every step of the swims:  the charge has to be in the roi, and the step has to end in it.
+  //a charge just below the low edge in z is nudged up onto it first.
+  int rt,pt,zt; //just placeholders for the bounds-checking.
+  BoundsCase zBound=GetZindexAndCheckBounds(*z,&zt);
+  if (zBound==OnLowEdge){
+    //nudge it in z:
+    *z+=ALMOST_ZERO;
+  }
+  if (GetRindexAndCheckBounds(r,&rt)!=InBounds
+      || GetPhiIndexAndCheckBounds(phi,&pt)!=InBounds
+      || (zBound==OutOfBounds)
+      || GetZindexAndCheckBounds(zend,&zt)==OutOfBounds){
+    return SwimLeftRoi;
+  }
+  return SwimOk;
+}
 
+AnnularFieldSim::SwimResult AnnularFieldSim::swim_in_steps(float zdest,const TVector3 &start,int steps, bool useAnalytic){
+  //nothing in here prints or asserts, so it can run on many threads at once:  a particle that can't go on stops where it
+  //is, and the status says why.  swim_block does the same for a block of particles at once, with the same helpers.
   double zdist=zdest-start.Z();
   double zstep=zdist/steps;
-  
-  TVector3 ret=start;
+
+  SwimResult result;
+  result.pos=start;
+  result.status=SwimOk;
+  result.goodSteps=0;
+  TVector3 &ret=result.pos;
   TVector3 accumulated_distortion(0,0,0);
   TVector3 accumulated_drift(0,0,0);
   TVector3 drift_step(0,0,zstep);
+  TVector3 distortion;
 
-  int rt,pt,zt; //just placeholders for the bounds-checking.
-  BoundsCase zBound;
   for (int i=0;i<steps;i++){
-    zBound=GetZindexAndCheckBounds(ret.Z(),&zt);
-    if (zBound==OnLowEdge){
-      //printf("AnnularFieldSIm::swimToInAnalyticSteps requests z-nudge from z=%f to %f\n", ret.Z(), ret.Z()+ALMOST_ZERO);//nudge it in z:
-      ret.SetZ(ret.Z()+ALMOST_ZERO);
-    }
-    if (GetRindexAndCheckBounds(ret.Perp(),&rt)!=InBounds
-	|| GetPhiIndexAndCheckBounds(ret.Phi(),&pt)!=InBounds
-	|| (zBound==OutOfBounds)){
-      printf("AnnularFieldSim::swimToInAnalyticSteps at step %d,"
-	     "asked to swim particle from (%f,%f,%f) (rphiz)=(%f,%f,%f)which is outside the ROI.\n",
-	     i,ret.X(),ret.Y(),ret.Z(),ret.Perp(),ret.Phi(),ret.Z());
-      printf(" -- %f <= r < %f \t%f <= phi < %f \t%f <= z < %f \n",
-	     rmin_roi*step.Perp()+rmin,rmax_roi*step.Perp()+rmin,
-	     phimin_roi*step.Phi(),phimax_roi*step.Phi(),
-	     zmin_roi*step.Z(),zmax_roi*step.Z());
-    printf("Returning last valid position.\n");
-      if (!(goodToStep==0)) *goodToStep=i-1;
-      return ret;
-    }
-    //printf("AnnularFieldSim::swimToInAnalyticSteps at step %d, asked to swim particle from (%f,%f,%f) (rphiz)=(%f,%f,%f).\n",i,ret.X(),ret.Y(),ret.Z(),ret.Perp(),ret.Phi(),ret.Z());
-    //rcc note: once I put the z distoriton back in, I need to check that ret.Z+zstep is still in bounds:
-    accumulated_distortion+=GetStepDistortion(ret.Z()+zstep,ret,true,true);
+    double z=ret.Z();
+    //the analytic steps each go zstep on from wherever the last one ended.  the others end on an even division of the swim.
+    float zend=useAnalytic?z+zstep:start.Z()+zstep*(i+1);
+    result.status=step_start(ret.Perp(),ret.Phi(),&z,zend);
+    ret.SetZ(z);
+    if (result.status!=SwimOk) return result;
+    if (useAnalytic) zend=ret.Z()+zstep; //from after any nudge.
+    //rcc note: once I put the z distoriton back in, the end of the step will move, and step_start will need to know where to:
+    result.status=step_distortion(zend,ret,true,useAnalytic,&distortion);
+    if (result.status!=SwimOk) return result;
+    accumulated_distortion+=distortion;
     accumulated_drift+=drift_step;
 
     //this seems redundant, but if the distortions are small they may lose precision and stop actually changing the position when step size is small.  This allows them to accumulate separately so they can grow properly:
     ret=start+accumulated_distortion+accumulated_drift;
-
+    result.goodSteps=i+1;
   }
   
-  return ret;
+  return result;
+}
+
+void AnnularFieldSim::swim_block(int n, const double *x0, const double *y0, const double *z0, const float *zdest, const int *steps,
+				 double *x, double *y, double *z, int *goodSteps, SwimStatus *status){
+  //swim_in_steps(zdest[l],(x0,y0,z0)[l],steps[l],false) for each of the n<=SWIM_BLOCK particles l, all of them a step at a
+  //time.  the particles are held as separate x, y and z arrays, so each stage below is a short loop over the block, with
+  //no TVector3s and no MultiArray::Get, and E and B share their columns and weights, since they live on the same grid.
+  //each stage calls the same helpers that swim_in_steps does, in the same order, so the results are identical to it.
+  const double stepZ=step.Z();
+  const int nzE=Efield->n[2], nzI=Efield_zint->n[2]; //Bfield and its integrals are the same shapes.
+  const PackedVector3D *Ef=Efield->field, *Bf=Bfield->field, *EI=Efield_zint->field, *BI=Bfield_zint->field;
+  const PackedVector3D *EL=0, *BL=0;
+  if (fieldInterpolation==Trilinear){
+    EL=Efield_zlin->field;
+    BL=Bfield_zlin->field;
+  }
+
+  //per particle:
+  double zstep[SWIM_BLOCK], rr[SWIM_BLOCK], phi[SWIM_BLOCK];
+  double accX[SWIM_BLOCK], accY[SWIM_BLOCK], accDriftZ[SWIM_BLOCK];
+  bool active[SWIM_BLOCK];
+  int maxSteps=0;
+  for (int l=0;l<n;l++){
+    zstep[l]=(zdest[l]-z0[l])/steps[l];
+    x[l]=x0[l]; y[l]=y0[l]; z[l]=z0[l];
+    accX[l]=accY[l]=accDriftZ[l]=0;
+    goodSteps[l]=0;
+    status[l]=SwimOk;
+    active[l]=(steps[l]>0);
+    maxSteps=std::max(maxSteps,steps[l]);
+  }
+
+  //per particle, per step:  the four columns around it and their weights (see interpolation_columns), the span in z, and
+  //the integrals.
+  int col[SWIM_BLOCK][4];
+  float w[SWIM_BLOCK][4];
+  ZSpan span[SWIM_BLOCK];
+  double zd[SWIM_BLOCK], Eint[SWIM_BLOCK][3], Bint[SWIM_BLOCK][3];
+  bool moves[SWIM_BLOCK];
+
+  for (int i=0;i<maxSteps;i++){
+    //can the step start from here?  (the top of swim_in_steps)
+    for (int l=0;l<n;l++){
+      if (!active[l]) continue;
+      if (i>=steps[l]){active[l]=false; continue;}
+      rr[l]=sqrt(x[l]*x[l]+y[l]*y[l]);
+      phi[l]=(x[l]==0 && y[l]==0)?0:atan2(y[l],x[l]);
+      zd[l]=(float)(z0[l]+zstep[l]*(i+1));
+      status[l]=step_start(rr[l],phi[l],&z[l],zd[l]);
+      if (status[l]!=SwimOk) active[l]=false;
+    }
+
+    //where in the grid the step runs.  (the top of interpolatedFieldIntegral)
+    for (int l=0;l<n;l++){
+      moves[l]=false;
+      if (!active[l]) continue;
+      if (TMath::Abs(zd[l]-z[l])<ALMOST_ZERO*stepZ) continue; //no travel length, no distortion.
+      moves[l]=true;
+      interpolation_columns(rr[l],phi[l],col[l],w[l]);
+      if (!z_span(zd[l],z[l],&span[l])){
+	for (int c=0;c<4;c++) col[l][c]=-1; //out of bounds:  the integrals are zero, and the step has no drift field.
+      }
+    }
+
+    //the integrals of E and B along each column, weighted and summed.  (the rest of interpolatedFieldIntegral)
+    for (int l=0;l<n;l++){
+      if (!moves[l]) continue;
+      for (int k=0;k<3;k++) Eint[l][k]=Bint[l][k]=0;
+      for (int c=0;c<4;c++){
+	if (col[l][c]<0) continue;
+	size_t cz=(size_t)col[l][c]*nzE, ci=(size_t)col[l][c]*nzI;
+	double pE[3], pB[3];
+	column_zintegral(Ef+cz,EI+ci,EL?EL+cz:0,span[l],pE);
+	column_zintegral(Bf+cz,BI+ci,BL?BL+cz:0,span[l],pB);
+	double wc=w[l][c];
+	for (int k=0;k<3;k++){
+	  Eint[l][k]+=wc*pE[k];
+	  Bint[l][k]+=wc*pB[k];
+	}
+      }
+      for (int k=0;k<3;k++){
+	Eint[l][k]*=span[l].dir;
+	Bint[l][k]*=span[l].dir;
+      }
+    }
+
+    //the Langevin step, and the new positions.  (step_distortion and the bottom of swim_in_steps)
+    for (int l=0;l<n;l++){
+      if (!active[l]) continue;
+      if (moves[l]){
+	double delta[3];
+	status[l]=langevin_step(zd[l]-z[l],Eint[l],Bint[l],delta);
+	if (status[l]!=SwimOk){
+	  active[l]=false;
+	  continue;
+	}
+	accX[l]+=delta[0];
+	accY[l]+=delta[1];
+      }
+      accDriftZ[l]+=zstep[l];
+      x[l]=x0[l]+accX[l];
+      y[l]=y0[l]+accY[l];
+      z[l]=z0[l]+accDriftZ[l];
+      goodSteps[l]=i+1;
+    }
+  }
+  return;
+}
+
+void AnnularFieldSim::swimBatch(int n, const TVector3 *start, const float *zdest, const int *steps, TVector3 *end, int *goodToStep, SwimStatus *status){
+  //drift n independent particles, each exactly as swimInSteps(zdest[i],start[i],steps[i]) would.  see the version below.
+  std::vector<double> x0(n),y0(n),z0(n),x(n),y(n),z(n);
+  for (int i=0;i<n;i++){
+    x0[i]=start[i].X();
+    y0[i]=start[i].Y();
+    z0[i]=start[i].Z();
+  }
+  swimBatch(n,x0.data(),y0.data(),z0.data(),zdest,steps,x.data(),y.data(),z.data(),goodToStep,status);
+  for (int i=0;i<n;i++){
+    end[i].SetXYZ(x[i],y[i],z[i]);
+  }
+  return;
+}
+
+void AnnularFieldSim::swimBatch(int n, const double *x0, const double *y0, const double *z0, const float *zdest, const int *steps,
+				double *x, double *y, double *z, int *goodToStep, SwimStatus *status){
+  //drift n independent particles, each exactly as swimInSteps(zdest[i],(x0,y0,z0)[i],steps[i]) would, but SWIM_BLOCK at a
+  //time through swim_block.
+  //once the fieldmaps are built the swim only reads them, so the particles can go out to nThreads workers.  Each particle
+  //writes only its own output slots, so the results are identical to the serial loop regardless of the thread count.
+  //goodToStep[i] and status[i] are the goodSteps and status of each swim.  Either may be 0 if the caller doesn't care.
+  const int chunk=4*SWIM_BLOCK; //particles per job, so the pool isn't fighting over the job counter on short swims.
+  int nchunks=(n+chunk-1)/chunk;
+  std::vector<unsigned long> counts(nchunks*nSwimStatus,0); //each job tallies its own, and we add them up afterwards.
+  parallel_for(nchunks,[&](int job){
+      for (int first=job*chunk;first<std::min(job*chunk+chunk,n);first+=SWIM_BLOCK){
+	int m=std::min(SWIM_BLOCK,n-first);
+	int good[SWIM_BLOCK];
+	SwimStatus stat[SWIM_BLOCK];
+	swim_block(m,x0+first,y0+first,z0+first,zdest+first,steps+first,x+first,y+first,z+first,good,stat);
+	for (int l=0;l<m;l++){
+	  if (goodToStep) goodToStep[first+l]=good[l];
+	  if (status) status[first+l]=stat[l];
+	  counts[job*nSwimStatus+stat[l]]++;
+	}
+      }
+    });
+  for (int job=0;job<nchunks;job++){
+    for (int s=0;s<nSwimStatus;s++){
+      swimCount[s].fetch_add(counts[job*nSwimStatus+s],std::memory_order_relaxed);
+    }
+  }
+  return;
+}
+
+void AnnularFieldSim::reset_swim_counts(){
+  for (int s=0;s<nSwimStatus;s++){
+    swimCount[s].store(0,std::memory_order_relaxed);
+  }
+  return;
+}
+
+void AnnularFieldSim::count_swim(SwimStatus status){
+  //relaxed is enough:  the counts are only tallies, and nothing else is ordered by them.
+  swimCount[status].fetch_add(1,std::memory_order_relaxed);
+  return;
+}
+
+void AnnularFieldSim::print_swim_counts(){
+  printf("AnnularFieldSim swims: %lu reached zdest, %lu left the roi, %lu had no drift field, %lu took a bad step\n",
+	 swimCount[SwimOk].load(),swimCount[SwimLeftRoi].load(),swimCount[SwimNoDriftField].load(),swimCount[SwimBadStep].load());
+  return;
+}
+
+void AnnularFieldSim::build_distortion_map(int stepsPerSlice){
+  //the nodes are the (r,phi) centers of the roi cells, on each of the nz_roi+1 cell edges in z, and the readout plane is the
+  //high-z edge of the roi, where the swims in the macros end.  every node is drifted to the next slice in one batch, then the
+  //map is summed from the readout back:  the distortion from a node is its step to the next slice, plus the distortion from
+  //wherever that step landed, interpolated in the next slice.  so a node's value follows its own charge all the way down.
+  printf("AnnularFieldSim::build_distortion_map: %dx%dx%d nodes, %d steps per slice\n",nr_roi,nphi_roi,nz_roi+1,stepsPerSlice);
+  DistortionMap *map=new DistortionMap(nr_roi,rmin+(rmin_roi+0.5)*step.Perp(),step.Perp(),
+				       nphi_roi,(phimin_roi+0.5)*step.Phi(),step.Phi(),nphi_roi==nphi,
+				       nz_roi+1,zmin+zmin_roi*step.Z(),step.Z());
+
+  int nparts=nr_roi*nphi_roi*nz_roi;
+  std::vector<TVector3> start(nparts),end(nparts);
+  std::vector<float> zdest(nparts);
+  std::vector<int> steps(nparts,stepsPerSlice),good(nparts);
+  for (int iz=0;iz<nz_roi;iz++){
+    for (int iphi=0;iphi<nphi_roi;iphi++){
+      for (int ir=0;ir<nr_roi;ir++){
+	int i=(iz*nphi_roi+iphi)*nr_roi+ir;
+	start[i]=GetRoiCellCenter(ir,iphi,iz);
+	start[i].SetZ(zmin+(zmin_roi+iz)*step.Z());
+	zdest[i]=zmin+(zmin_roi+iz+1)*step.Z();
+      }
+    }
+  }
+  swimBatch(nparts,&start[0],&zdest[0],&steps[0],&end[0],&good[0]);
+
+  int nLost=0;
+  for (int iz=nz_roi-1;iz>=0;iz--){ //the readout slice, iz=nz_roi, stays zero.
+    for (int iphi=0;iphi<nphi_roi;iphi++){
+      for (int ir=0;ir<nr_roi;ir++){
+	int i=(iz*nphi_roi+iphi)*nr_roi+ir;
+	if (good[i]<stepsPerSlice) nLost++;
+	const TVector3 &p=start[i], &q=end[i];
+	float next[3];
+	map->Query(q.Perp(),q.Phi(),zdest[i],next);
+	//where the charge reaches the readout, as (x,y), and then relative to p's own column in p's (r,phi) frame:
+	double qphi=q.Phi(), pphi=p.Phi();
+	double fx=q.X()+next[0]*cos(qphi)-next[1]*sin(qphi);
+	double fy=q.Y()+next[0]*sin(qphi)+next[1]*cos(qphi);
+	double dx=fx-p.X(), dy=fy-p.Y();
+	float dist[3]={(float)(dx*cos(pphi)+dy*sin(pphi)),
+		       (float)(-dx*sin(pphi)+dy*cos(pphi)),
+		       (float)(q.Z()-zdest[i]+next[2])};
+	map->Set(ir,iphi,iz,dist);
+      }
+    }
+  }
+  if (nLost>0)
+    printf("AnnularFieldSim::build_distortion_map: %d of %d nodes left the roi before the next slice.  Their distortions stop where they left.\n",nLost,nparts);
+
+  delete distortionMap;
+  distortionMap=map;
+  delete inverseDistortionMap; //it was the inverse of the old map.
+  inverseDistortionMap=0;
+  return;
+}
+
+void AnnularFieldSim::build_inverse_distortion_map(){
+  //inverting the forward map, rather than swimming each readout point backwards, keeps the two maps consistent with each other.
+  if (distortionMap==0) build_distortion_map();
+  delete inverseDistortionMap;
+  inverseDistortionMap=distortionMap->Inverse();
+  return;
 }
 
 TVector3 AnnularFieldSim::swimToInSteps(float zdest,TVector3 start,int steps=1, bool interpolate=false, int *goodToStep=0){
-  //short-circuit if we're out of range:
-  
+  //the steps always interpolate the field, whatever 'interpolate' says.
+  SwimResult result=swimInSteps(zdest,start,steps,false);
+  if (!(goodToStep==0)) *goodToStep=result.goodSteps;
+  return result.pos;
+}
+
+TVector3 AnnularFieldSim::swimToAdaptive(float zdest,TVector3 start,float tolerance,int *nSteps,int *nEvals){
+  return swimAdaptive(zdest,start,tolerance,nSteps,nEvals).pos;
+}
+
+AnnularFieldSim::SwimResult AnnularFieldSim::swimAdaptive(float zdest,const TVector3 &start,float tolerance,int *nSteps,int *nEvals){
+  //the same Langevin steps as swimInSteps, but with the step length chosen by an embedded Heun-Euler pair:  the Euler
+  //step is k1, the distortion GetStepDistortion gives along the straight path from where we are, and the Heun step averages
+  //it with k2, the distortion along the straight path from where k1 lands.  (k2-k1)/2 estimates the transverse error of
+  //the Euler step, and we hold it to 'tolerance' (cm) per length of drift over the whole swim, so the errors of all the
+  //steps add up to about 'tolerance'.  We keep the (second order) Heun result.
+  //nSteps gets the number of steps taken, and nEvals the number of GetStepDistortion calls, including rejected steps.
   double zdist=zdest-start.Z();
-  double zstep=zdist/steps;
-  
-  TVector3 ret=start;
+  double dir=(zdist<0)?-1:1;
+  double remaining=fabs(zdist);
+  double h=std::min(remaining,(double)step.Z()); //try one cell first, and let the error estimate take it from there.
+  double hmin=0.001*step.Z(); //well clear of the ALMOST_ZERO cutoff in GetStepDistortion.
+
+  SwimResult result;
+  result.pos=start;
+  result.status=SwimOk;
+  result.goodSteps=0;
+  TVector3 &ret=result.pos;
   TVector3 accumulated_distortion(0,0,0);
   TVector3 accumulated_drift(0,0,0);
-  TVector3 drift_step(0,0,zstep);
-  TVector3 last_distortion(0,0,0);
-
-  int rt,pt,zt; //just placeholders for the bounds-checking.
-  BoundsCase zBound;
-  for (int i=0;i<steps;i++){
-    zBound=GetZindexAndCheckBounds(ret.Z(),&zt);
-    if (zBound==OnLowEdge){
-      //nudge it in z:
-      ret.SetZ(ret.Z()+ALMOST_ZERO);
+  int evals=0;
+  int rt,pt; //just placeholders for the bounds-checking.
+  while (remaining>0){
+    if (remaining-h<hmin) h=remaining; //don't leave a sliver for the last step.
+    double znext=start.Z()+accumulated_drift.Z()+dir*h;
+    double z=ret.Z();
+    result.status=step_start(ret.Perp(),ret.Phi(),&z,znext);
+    ret.SetZ(z);
+    if (result.status!=SwimOk) break;
+    TVector3 k1,k2;
+    result.status=step_distortion(znext,ret,true,false,&k1);
+    evals++;
+    if (result.status!=SwimOk) break;
+    TVector3 mid=ret+k1;
+    k2=k1; //if k1 takes us somewhere we can't step from, there is nothing to compare to, so we take the Euler step as it is.
+    if (GetRindexAndCheckBounds(mid.Perp(),&rt)==InBounds && GetPhiIndexAndCheckBounds(mid.Phi(),&pt)==InBounds){
+      TVector3 heun;
+      if (step_distortion(znext,mid,true,false,&heun)==SwimOk) k2=heun;
+      evals++;
     }
-    if (GetRindexAndCheckBounds(ret.Perp(),&rt)!=InBounds
-	|| GetPhiIndexAndCheckBounds(ret.Phi(),&pt)!=InBounds
-	|| (zBound==OutOfBounds)){
-      printf("AnnularFieldSim::swimToInSteps starting at (%f,%f,%f)=(r%f,p%f,z%f) with drift_step=%f, at step %d, asked to swim particle from (%f,%f,%f) (rphiz)=(%f,%f,%f)which is outside the ROI.\n",start.X(),start.Y(),start.Z(),start.Perp(),start.Phi(),start.Z(),zstep,i,ret.X(),ret.Y(),ret.Z(),ret.Perp(),ret.Phi(),ret.Z());
-    printf(" -- %f <= r < %f \t%f <= phi < %f \t%f <= z < %f \n",rmin_roi*step.Perp()+rmin,rmax_roi*step.Perp()+rmin, phimin_roi*step.Phi(),phimax_roi*step.Phi(),zmin_roi*step.Z(),zmax_roi*step.Z());
-    printf("Returning last good position.\n");
-      if (!(goodToStep==0)) *goodToStep=i-1;
-      //assert (1==2);
-      return start+accumulated_drift+drift_step*(i-1);
+    double err=0.5*(k2-k1).Perp();
+    double allowed=tolerance*h/fabs(zdist);
+    if (err<=allowed || h<=hmin){
+      accumulated_distortion+=0.5*(k1+k2);
+      accumulated_drift.SetZ(accumulated_drift.Z()+dir*h);
+      remaining-=h;
+      result.goodSteps++;
+      //as in swimInSteps, the distortion is kept apart from the drift so small steps don't get lost in the large number.
+      ret=start+accumulated_distortion+accumulated_drift;
     }
-    last_distortion=accumulated_distortion;
-    GetStepDistortion(start.Z()+zstep*(i+1),ret,true,false);
-    accumulated_distortion+=GetStepDistortion(start.Z()+zstep*(i+1),ret,true,false);
-    accumulated_drift+=drift_step;
-
-    //this seems redundant, but if the distortions are small they may lose precision and stop actually changing the position when step size is small.  This allows them to accumulate separately so they can grow properly:
-    ret=start+accumulated_distortion+accumulated_drift;
+    //the Euler error goes as h^2.  grow or shrink the next step to aim a bit under the allowance, within a factor of 5.
+    double factor=(err>0)?0.9*sqrt(allowed/err):5;
+    h=std::max(hmin,h*std::min(5.0,std::max(0.2,factor)));
   }
-  
-  return ret;
+
+  count_swim(result.status);
+  if (nSteps) *nSteps=result.goodSteps;
+  if (nEvals) *nEvals=evals;
+  return result;
 }
 
 TVector3 AnnularFieldSim::OldSwimToInSteps(float zdest,TVector3 start,int steps=1, bool interpolate=false, int *goodToStep=0){
@@ -1802,9 +3069,7 @@ TVector3 AnnularFieldSim::OldSwimToInSteps(float zdest,TVector3 start,int steps=
     if (GetRindexAndCheckBounds(ret.Perp(),&rt)!=InBounds
 	|| GetPhiIndexAndCheckBounds(ret.Phi(),&pt)!=InBounds
 	|| (zBound==OutOfBounds)){
-      printf("AnnularFieldSim::swimToInSteps at step %d, asked to swim particle from (%f,%f,%f) (rphiz)=(%f,%f,%f)which is outside the ROI.\n",i,ret.X(),ret.Y(),ret.Z(),ret.Perp(),ret.Phi(),ret.Z());
-    printf(" -- %f <= r < %f \t%f <= phi < %f \t%f <= z < %f \n",rmin_roi*step.Perp()+rmin,rmax_roi*step.Perp()+rmin, phimin_roi*step.Phi(),phimax_roi*step.Phi(),zmin_roi*step.Z(),zmax_roi*step.Z());
-    printf("Returning original position.\n");
+      //outside the ROI.  return where we got to.
       if (!(goodToStep==0)) *goodToStep=i-1;
       return ret;
     }
@@ -1815,30 +3080,38 @@ TVector3 AnnularFieldSim::OldSwimToInSteps(float zdest,TVector3 start,int steps=
 }
 
 TVector3 AnnularFieldSim::swimTo(float zdest,TVector3 start, bool interpolate, bool useAnalytic){
+  return swimOneStep(zdest,start,interpolate,useAnalytic).pos;
+}
+
+AnnularFieldSim::SwimResult AnnularFieldSim::swimOneStep(float zdest,const TVector3 &start, bool interpolate, bool useAnalytic){
 
  //using second order langevin expansion from http://skipper.physics.sunysb.edu/~prakhar/tpc/Papers/ALICE-INT-2010-016.pdf
-  //TVector3 (*field)[nr][ny][nz]=field_;
+  //if the step can't be taken, the charge stays at start, and the status says why.
+  SwimResult result;
+  result.pos=start;
+  result.goodSteps=0;
   int rt,pt,zt; //just placeholders
   BoundsCase zBound=GetZindexAndCheckBounds(start.Z(),&zt);
   if (GetRindexAndCheckBounds(start.Perp(),&rt)!=InBounds
       || GetPhiIndexAndCheckBounds(start.Phi(),&pt)!=InBounds
-      || (zBound!=InBounds && zBound!=OnHighEdge)){
-    printf("AnnularFieldSim::swimTo asked to swim particle from (%f,%f,%f) which is outside the ROI:\n",start.X(),start.Y(),start.Z());
-    printf(" -- %f <= r < %f \t%f <= phi < %f \t%f <= z < %f \n",rmin_roi*step.Perp(),rmax_roi*step.Perp(), phimin_roi*step.Phi(),phimax_roi*step.Phi(),zmin_roi*step.Z(),zmax_roi*step.Z());
-    printf("Returning original position.\n");
-    return start;
+      || (zBound!=InBounds && zBound!=OnHighEdge)
+      || GetZindexAndCheckBounds(zdest,&zt)==OutOfBounds){
+    result.status=SwimLeftRoi;
+    count_swim(result.status);
+    return result;
   }
   
   //set the direction of the external fields.
   //todo: get this from a field map
-  TVector3 B=Bfield->Get(0,0,0);//static field in tesla T=Vs/m^2
+  TVector3 B(Bfield->Get(0,0,0));//static field in tesla T=Vs/m^2
   
   double zdist=zdest-start.Z();
 
   //short-circuit if there's no travel length:
+  result.status=SwimOk;
   if (TMath::Abs(zdist)<ALMOST_ZERO*step.Z()){
-    printf("Asked to swim particle from (%f,%f,%f) to z=%f, which is a distance of %fcm.  Returning original position.\n",start.X(),start.Y(),start.Z(), zdest,zdist);
-    return start;
+    count_swim(result.status);
+    return result;
   }
 
   TVector3 fieldInt;
@@ -1852,108 +3125,68 @@ TVector3 AnnularFieldSim::swimTo(float zdest,TVector3 start, bool interpolate, b
   }
 
   if (abs(fieldInt.Z())<ALMOST_ZERO){
-    printf("swimTo is attempting to swim with no drift field:\n");
-    printf("swimTo: (%2.4f,%2.4f,%2.4f) to z=%2.4f\n",start.X(),start.Y(), start.Z(),zdest);
-    printf("swimTo: fieldInt=(%E,%E,%E)\n",fieldInt.X(),fieldInt.Y(),fieldInt.Z());
-    assert(1==2);
+    result.status=SwimNoDriftField;
+    count_swim(result.status);
+    return result;
   }
   
   //float fieldz=field_[in3(x,y,0,fx,fy,fz)].Z()+E.Z();// *field[x][y][zi].Z();
   double fieldz=fieldInt.Z()/zdist;// average field over the path.
   //double fieldz=Enominal; // ideal field over path.
   
-  double mu=vdrift/fieldz;//vdrift in [cm/s], field in [V/cm] hence mu in [cm^2/(V*s)];
-  double omegatau=1*mu*B.Z();//mu*Q_e*B, mu in [cm^2/(V*s)], B in [T] hence (thanks, google) omegatau in [0.0001] = [cm^2/m^2]
-  //originally the above was q*mu*B, but 'q' is really about flipping the direction of time.  if we do this, we negate both vdrift and q, so in the end we have no charge dependence -- we 'see' the charge by noting that we're asking to drift against the overall field.
-  omegatau=omegatau*1e-4;//*1m/100cm * 1m/100cm to get proper unitless.
-  //or:  omegatau=-10*(10*B.Z())*(vdrift*1e6)/fieldz; //which is the same as my calculation up to a sign.
-  //printf("omegatau=%f\n",omegatau);
-  double c0=1/(1+omegatau*omegatau);
-  double langevin_T1=1.0;
-  double langevin_T2=1.0;
-  double T1om=langevin_T1*omegatau;
-  double T2om2=langevin_T2*omegatau*langevin_T2*omegatau;
-  double c1=T1om/(1+T1om*T1om);
-  double c2=T2om2/(1+T2om2);
-
-  TVector3 EintOverEz=1/fieldz*fieldInt; //integral of E/E_z= integral of E / integral of E_z * delta_z
-  TVector3 BintOverBz=zdist/B.Z()*B;
-
-  //really this should be the integral of the ratio, not the ratio of the integrals.
-  //and should be integrals over the B field, btu for now that's fixed and constant across the region, so not necessary
-  //there's no reason to do this as r phi.  This is an equivalent result, since I handle everything in vectors.
-  double deltaX=c0*EintOverEz.X()+c1*EintOverEz.Y()-c1*BintOverBz.Y()+c2*BintOverBz.X();
-  double deltaY=c0*EintOverEz.Y()-c1*EintOverEz.X()+c1*BintOverBz.X()+c2*BintOverBz.Y();
-  //strictly, for deltaZ we want to integrate v'(E)*(E-E0)dz and v''(E)*(E-E0)^2 dz, but over a short step the field is constant, and hence this can be a product of the integral and not an integral of the product:
-
-
-  
-
-  double vprime=5000/100;//cm/s per V/cm, hard-coded value for 50:50.  Eventually this needs to be part of the constructor, as do most of the repeated math terms here.
-  double vdoubleprime=0; //neglecting the v'' term for now.  Fair? It's pretty linear at our operating point, and it would require adding an additional term to the field integral.
-
-  //note: as long as my step is very small, I am essentially just reading the field at a point and multiplying by the step size.
-  //hence integral of P dz, where P is a function of the fields, int|P(E(x,y,z))dz=P(int|E(x,y,z)dz/deltaZ)*deltaZ
-  //hence: , eg, int|E^2dz=(int|Edz)^2/deltaz
-  double deltaZ=vprime/vdrift*(fieldInt.Z()-zdist*Enominal)
-    +vdoubleprime/vdrift*(fieldInt.Z()-Enominal*zdist)*(fieldInt.Z()-Enominal*zdist)/(2*zdist)
-    -0.5/zdist*(EintOverEz.X()*EintOverEz.X()+EintOverEz.Y()*EintOverEz.Y())
-    +c1/zdist*(EintOverEz.X()*BintOverBz.Y()-EintOverEz.Y()*BintOverBz.X())
-    +c2/zdist*(EintOverEz.X()*BintOverBz.X()+EintOverEz.Y()*BintOverBz.Y())
-    +c2/zdist*(BintOverBz.X()*BintOverBz.X()+BintOverBz.Y()*BintOverBz.Y()); //missing v'' term.
-
-  if (0){
-   printf("swimTo:  (c0,c1,c2)=(%E,%E,%E)\n",c0,c1,c2);
-    printf("swimTo:  EintOverEz==(%E,%E,%E)\n",EintOverEz.X(),EintOverEz.Y(),EintOverEz.Z());
-    printf("swimTo:  BintOverBz==(%E,%E,%E)\n",BintOverBz.X(),BintOverBz.Y(),BintOverBz.Z());    
-    printf("swimTo: (%2.4f,%2.4f,%2.4f) to z=%2.4f\n",start.X(),start.Y(), start.Z(),zdest);
-    printf("swimTo: fieldInt=(%E,%E,%E)\n",fieldInt.X(),fieldInt.Y(),fieldInt.Z());
-    printf("swimTo: delta=(%E,%E,%E)\n",deltaX,deltaY,deltaZ);
-  }
-  //   printf("swimTo: delta=(%E,%E,%E)\n",deltaX,deltaY,deltaZ);
-
-  if (abs(deltaX)<1E-20){
-    printf("swimTo produced a very small deltaX: %E\n",deltaX);
-    assert(1==2);
-
-   }
-  
-  //deltaZ=0;//temporary removal.
-
-
-  
-  TVector3 dest(start.X()+deltaX,start.Y()+deltaY,zdest+deltaZ);
-  
-  return dest;
-  
+  //unlike GetStepDistortion, omegatau here comes from the local field rather than the nominal one.
+  double c0,c1,c2;
+  drift.Coefficients(drift.OmegaTau(fieldz,B.Z()),&c0,&c1,&c2);
+  //the B field is fixed and constant across the region for now, so its integral is just B times the length.
+  double Eint[3]={fieldInt.X(),fieldInt.Y(),fieldInt.Z()};
+  double Bint[3]={zdist*B.X(),zdist*B.Y(),zdist*B.Z()};
+  double delta[3];
+  drift.Step(c0,c1,c2,zdist,Eint,Bint,delta);
+
+  //only a vanishing step counts as bad here.  (the steps of the other swims go through step_is_sane, which is stricter.)
+  if (abs(delta[0])<1E-20){
+    result.status=SwimBadStep;
+    count_swim(result.status);
+    return result;
+  }
+
+  result.pos.SetXYZ(start.X()+delta[0],start.Y()+delta[1],zdest+delta[2]);
+  result.goodSteps=1;
+  count_swim(result.status);
+  return result;
 }
 
+bool AnnularFieldSim::step_is_sane(double deltaX){
+  //a step that moves the charge by nothing at all (when there is spacecharge to move it), by more than 10m, or by NaN, has gone wrong somewhere upstream.
+  if (fabs(deltaX)<1E-20 && !(chargeCase==NoSpacecharge)) return false;
+  return (fabs(deltaX)<1E3);
+}
 
-TVector3 AnnularFieldSim::GetStepDistortion(float zdest,TVector3 start, bool interpolate, bool useAnalytic){
+TVector3 AnnularFieldSim::GetStepDistortion(float zdest,TVector3 start, bool interpolate, bool useAnalytic, SwimStatus *status){
   //getting the distortion instead of the post-step position allows us to accumulate small deviations from the original position that might be lost in the large number
-
-  
- //using second order langevin expansion from http://skipper.physics.sunysb.edu/~prakhar/tpc/Papers/ALICE-INT-2010-016.pdf
-  //TVector3 (*field)[nr][ny][nz]=field_;
+  TVector3 delta=zero_vector;
+  SwimStatus result=SwimLeftRoi;
   int rt,pt,zt; //just placeholders
   BoundsCase zBound=GetZindexAndCheckBounds(start.Z(),&zt);
-  if (GetRindexAndCheckBounds(start.Perp(),&rt)!=InBounds
-      || GetPhiIndexAndCheckBounds(start.Phi(),&pt)!=InBounds
-      || (zBound!=InBounds && zBound!=OnHighEdge)){
-    printf("AnnularFieldSim::swimTo asked to swim particle from (%f,%f,%f) which is outside the ROI:\n",start.X(),start.Y(),start.Z());
-    printf(" -- %f <= r < %f \t%f <= phi < %f \t%f <= z < %f \n",rmin_roi*step.Perp(),rmax_roi*step.Perp(), phimin_roi*step.Phi(),phimax_roi*step.Phi(),zmin_roi*step.Z(),zmax_roi*step.Z());
-    printf("Returning original position.\n");
-    return start;
-  }
-  
-  //set the direction of the external fields.
-  
+  if (GetRindexAndCheckBounds(start.Perp(),&rt)==InBounds
+      && GetPhiIndexAndCheckBounds(start.Phi(),&pt)==InBounds
+      && (zBound==InBounds || zBound==OnHighEdge)
+      && GetZindexAndCheckBounds(zdest,&zt)!=OutOfBounds){
+    result=step_distortion(zdest,start,interpolate,useAnalytic,&delta);
+  }
+  if (status) *status=result;
+  return delta;
+}
+
+AnnularFieldSim::SwimStatus AnnularFieldSim::step_distortion(float zdest,const TVector3 &start, bool interpolate, bool useAnalytic, TVector3 *distortion){
+  //GetStepDistortion without the bounds check, for the swims, which have already made it.  distortion is left at zero
+  //unless the step is good.  no printing in here:  it runs once or twice per step of every particle.
   double zdist=zdest-start.Z();
+  distortion->SetXYZ(0,0,0);
 
   //short-circuit if there's no travel length:
   if (TMath::Abs(zdist)<ALMOST_ZERO*step.Z()){
-    printf("Asked  particle from (%f,%f,%f) to z=%f, which is a distance of %fcm.  Returning zero.\n",start.X(),start.Y(),start.Z(), zdest,zdist);
-    return zero_vector;
+    return SwimOk;
   }
 
   TVector3 fieldInt;//integral of E field along path
@@ -1971,97 +3204,31 @@ TVector3 AnnularFieldSim::GetStepDistortion(float zdest,TVector3 start, bool int
     fieldIntB=fieldIntegral(zdest,start,Bfield);
   }
 
-  if (abs(fieldInt.Z()/zdist)<ALMOST_ZERO){
-    printf("GetStepDistortion is attempting to swim with no drift field:\n");
-    printf("GetStepDistortion: (%2.4f,%2.4f,%2.4f) to z=%2.4f\n",start.X(),start.Y(), start.Z(),zdest);
-    printf("GetStepDistortion: fieldInt=(%E,%E,%E)\n",fieldInt.X(),fieldInt.Y(),fieldInt.Z());
-    assert(1==2);
+  double Eint[3]={fieldInt.X(),fieldInt.Y(),fieldInt.Z()};
+  double Bint[3]={fieldIntB.X(),fieldIntB.Y(),fieldIntB.Z()};
+  double delta[3];
+  SwimStatus status=langevin_step(zdist,Eint,Bint,delta);
+  if (status!=SwimOk){
+    return status;
   }
   
-  //float fieldz=field_[in3(x,y,0,fx,fy,fz)].Z()+E.Z();// *field[x][y][zi].Z();
-  double EfieldZ=fieldInt.Z()/zdist;// average field over the path.
-  double BfieldZ=fieldIntB.Z()/zdist;
-  //double fieldz=Enominal; // ideal field over path.
-  
-  double mu=vdrift/Enominal;//vdrift in [cm/s], field in [V/cm] hence mu in [cm^2/(V*s)];
-  double omegatau=1*mu*Bnominal;//mu*Q_e*B, mu in [cm^2/(V*s)], B in [T] hence (thanks, google) omegatau in [0.0001] = [cm^2/m^2]
-  //originally the above was q*mu*B, but 'q' is really about flipping the direction of time.  if we do this, we negate both vdrift and q, so in the end we have no charge dependence -- we 'see' the charge by noting that we're asking to drift against the overall field.
-  omegatau=omegatau*1e-4;//*1m/100cm * 1m/100cm to get proper unitless.
-  //or:  omegatau=-10*(10*B.Z())*(vdrift*1e6)/fieldz; //which is the same as my calculation up to a sign.
-  //printf("omegatau=%f\n",omegatau);
-  double c0=1/(1+omegatau*omegatau);
-  double langevin_T1=1.0;
-  double langevin_T2=1.0;
-  double T1om=langevin_T1*omegatau;
-  double T2om2=langevin_T2*omegatau*langevin_T2*omegatau;
-  double c1=T1om/(1+T1om*T1om);
-  double c2=T2om2/(1+T2om2);
-
-  TVector3 EintOverEz=1/EfieldZ*fieldInt; //integral of E/E_z= integral of E / integral of E_z * delta_z
-  TVector3 BintOverBz=1/BfieldZ*fieldIntB; //should this (and the above?) be BfieldZ or Bnominal?
-
-  //really this should be the integral of the ratio, not the ratio of the integrals.
-  //and should be integrals over the B field, btu for now that's fixed and constant across the region, so not necessary
-  //there's no reason to do this as r phi.  This is an equivalent result, since I handle everything in vectors.
-  double deltaX=c0*EintOverEz.X()+c1*EintOverEz.Y()-c1*BintOverBz.Y()+c2*BintOverBz.X();
-  double deltaY=c0*EintOverEz.Y()-c1*EintOverEz.X()+c1*BintOverBz.X()+c2*BintOverBz.Y();
-  //strictly, for deltaZ we want to integrate v'(E)*(E-E0)dz and v''(E)*(E-E0)^2 dz, but over a short step the field is constant, and hence this can be a product of the integral and not an integral of the product:
-
-
-  
+  delta[2]=0;//temporary removal.
 
-  double vprime=5000/100;//cm/s per V/cm, hard-coded value for 50:50.  Eventually this needs to be part of the constructor, as do most of the repeated math terms here.
-  double vdoubleprime=0; //neglecting the v'' term for now.  Fair? It's pretty linear at our operating point, and it would require adding an additional term to the field integral.
-
-  //note: as long as my step is very small, I am essentially just reading the field at a point and multiplying by the step size.
-  //hence integral of P dz, where P is a function of the fields, int|P(E(x,y,z))dz=P(int|E(x,y,z)dz/deltaZ)*deltaZ
-  //hence: , eg, int|E^2dz=(int|Edz)^2/deltaz
-  double deltaZ=vprime/vdrift*(fieldInt.Z()-zdist*Enominal)
-    +vdoubleprime/vdrift*(fieldInt.Z()-Enominal*zdist)*(fieldInt.Z()-Enominal*zdist)/(2*zdist)
-    -0.5/zdist*(EintOverEz.X()*EintOverEz.X()+EintOverEz.Y()*EintOverEz.Y())
-    +c1/zdist*(EintOverEz.X()*BintOverBz.Y()-EintOverEz.Y()*BintOverBz.X())
-    +c2/zdist*(EintOverEz.X()*BintOverBz.X()+EintOverEz.Y()*BintOverBz.Y())
-    +c2/zdist*(BintOverBz.X()*BintOverBz.X()+BintOverBz.Y()*BintOverBz.Y()); //missing v'' term.
-
-  if (0){
-   printf("GetStepDistortion:  (c0,c1,c2)=(%E,%E,%E)\n",c0,c1,c2);
-    printf("GetStepDistortion:  EintOverEz==(%E,%E,%E)\n",EintOverEz.X(),EintOverEz.Y(),EintOverEz.Z());
-    printf("GetStepDistortion:  BintOverBz==(%E,%E,%E)\n",BintOverBz.X(),BintOverBz.Y(),BintOverBz.Z());    
-    printf("GetStepDistortion: (%2.4f,%2.4f,%2.4f) to z=%2.4f\n",start.X(),start.Y(), start.Z(),zdest);
-    printf("GetStepDistortion: fieldInt=(%E,%E,%E)\n",fieldInt.X(),fieldInt.Y(),fieldInt.Z());
-    printf("GetStepDistortion: delta=(%E,%E,%E)\n",deltaX,deltaY,deltaZ);
-  }
-
-  if (abs(deltaX)<1E-20 && !(chargeCase==NoSpacecharge)){
-   printf("GetStepDistortion:  (c0,c1,c2)=(%E,%E,%E)\n",c0,c1,c2);
-    printf("GetStepDistortion:  EintOverEz==(%E,%E,%E)\n",EintOverEz.X(),EintOverEz.Y(),EintOverEz.Z());
-    printf("GetStepDistortion:  BintOverBz==(%E,%E,%E)\n",BintOverBz.X(),BintOverBz.Y(),BintOverBz.Z());    
-    printf("GetStepDistortion: (%2.4f,%2.4f,%2.4f) to z=%2.4f\n",start.X(),start.Y(), start.Z(),zdest);
-    printf("GetStepDistortion: fieldInt=(%E,%E,%E)\n",fieldInt.X(),fieldInt.Y(),fieldInt.Z());
-    printf("GetStepDistortion: delta=(%E,%E,%E)\n",deltaX,deltaY,deltaZ);
-   printf("GetStepDistortion produced a very small deltaX: %E\n",deltaX);
-    assert(1==2);
-
-   }
-
-  if (!(abs(deltaX)<1E3)){
-   printf("GetStepDistortion:  (c0,c1,c2)=(%E,%E,%E)\n",c0,c1,c2);
-    printf("GetStepDistortion:  EintOverEz==(%E,%E,%E)\n",EintOverEz.X(),EintOverEz.Y(),EintOverEz.Z());
-    printf("GetStepDistortion:  BintOverBz==(%E,%E,%E)\n",BintOverBz.X(),BintOverBz.Y(),BintOverBz.Z());    
-    printf("GetStepDistortion: (%2.4f,%2.4f,%2.4f) to z=%2.4f\n",start.X(),start.Y(), start.Z(),zdest);
-    printf("GetStepDistortion: fieldInt=(%E,%E,%E)\n",fieldInt.X(),fieldInt.Y(),fieldInt.Z());
-    printf("GetStepDistortion: delta=(%E,%E,%E)\n",deltaX,deltaY,deltaZ);
-    printf("GetStepDistortion produced a very large deltaX: %E\n",deltaX);
-    assert(1==2);
+  distortion->SetXYZ(delta[0],delta[1],delta[2]);
+  return SwimOk;
+}
 
-   }
-  
-  deltaZ=0;//temporary removal.
+inline AnnularFieldSim::SwimStatus AnnularFieldSim::langevin_step(double zdist, const double Eint[3], const double Bint[3], double delta[3]){
+  //the move over a step of length zdist, given the integrals of E and B along it.  for step_distortion and swim_block.
+  if (abs(Eint[2]/zdist)<ALMOST_ZERO){
+    return SwimNoDriftField;
+  }
 
+  //the gas and the coefficients at the nominal fields are all in the drift model.  should the ratios use BfieldZ or Bnominal?
+  drift.Step(zdist,Eint,Bint,delta);
 
-  
-  TVector3 shift(deltaX,deltaY,deltaZ);
-  
-  return shift;
-  
+  if (!step_is_sane(delta[0])){
+    return SwimBadStep;
+  }
+  return SwimOk;
 }
@@ -1,25 +1,67 @@
 #include "assert.h"
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+#include <complex>
+#include <sys/mman.h>
 #include "TVector3.h"
+#include "PackedVector3.h"
 #include "AnalyticFieldModel.h"
 #include "Rossegger.h"
+#include "DriftModel.h"
 
 
 template <class T> class MultiArray;
+
+class SimpleFFT;
+class DistortionMap;
 class TH3F;
 class TTree;
 
+//storage precision of the Epartial lookup tables.  The greens functions are only good to a few digits anyway, so
+//building with -DFIELDSIM_FLOAT_LOOKUP (configure --enable-float-lookup) halves the tables and the memory traffic of every fieldmap.
+//sums over the tables are always accumulated in double.
+#ifdef FIELDSIM_FLOAT_LOOKUP
+typedef float LookupScalar;
+#else
+typedef double LookupScalar;
+#endif
+typedef PackedVector3<LookupScalar> LookupVector3;
+
 class AnnularFieldSim{
  public:
   enum BoundsCase {InBounds,OnHighEdge, OnLowEdge,OutOfBounds}; //note that 'OnLowEdge' is qualitatively different from 'OnHighEdge'.  Low means there is a non-zero distance between the point and the edge of the bin.  High applies even if that distance is exactly zero.
-  enum LookupCase {Full3D,HybridRes, PhiSlice, Analytic, NoLookup};
+  enum LookupCase {Full3D,HybridRes, PhiSlice, PhiZSlice, Analytic, NoLookup};
   //Full3D = uses (nr x nphi x nz)^2 lookup table
   //Hybrid = uses (nr x nphi x nz) x (nr_local x nphi_local x nz_local) + (nr_low x nphi_low x nz_low)^2 set of tables
   //PhiSlice = uses (nr x 1 x nz) x (nr x nphi x nz) lookup table exploiting phi symmetry.
+  //PhiZSlice = uses (nr x 1 x 1) x (nr x nphi x 2nz-1) lookup table exploiting phi symmetry and z-translation symmetry.
+  //    Only valid for free-space greens functions, since the conducting endcaps of the rossegger solution break the z symmetry.
   //Analytic = doesn't use lookup tables -- no memory footprint, uses analytic E field at center of each bin.
   //    Note that this is not the same as analytic propagation, which checks the analytic field integrals in each step.
   //NoLookup = Don't build any structures -- effectively ignores any calculated spacecharge field
+  enum LookupLayout {AoS, SoA};
+  //AoS = sums read the (x,y,z) elements of the Epartial tables as they were built.  the default.
+  //SoA = after building or loading, the Full3D, PhiSlice or PhiZSlice table is repacked into separate x, y and z planes (Epartial_soa)
+  //    so the sums stream through contiguous runs of one component.  HybridRes always uses AoS.
+  enum FieldInterpolation {Bilinear, Trilinear};
+  //Bilinear = interpolatedFieldIntegral (and so the swims) weights the four (r,phi) columns around the path bilinearly, and
+  //    takes the field as constant across each cell in z.
+  //Trilinear = the same in (r,phi), but linear in z between the cell centers too, and that interpolant is integrated exactly
+  //    along z.  Second order in the z spacing as well, so a coarser grid (and a much smaller lookup) can give the same distortions.
   enum ChargeCase {FromFile, AnalyticSpacecharge, NoSpacecharge};//load from file, load from AnalyticFieldModel, or set to zero.
   //note that if we set to Zero, we skip the lookup step.
+  enum SwimStatus {SwimOk, SwimLeftRoi, SwimNoDriftField, SwimBadStep, nSwimStatus};
+  //SwimOk = reached zdest.
+  //SwimLeftRoi = stepped out of the roi (in any coordinate) before reaching zdest, or the next step would end outside it in z.
+  //SwimNoDriftField = the E field integrated to (almost) zero along a step.
+  //SwimBadStep = a step came out with a non-finite or implausibly large (>10m) or small (<1e-20cm, with spacecharge) transverse move.
+  struct SwimResult{
+    TVector3 pos; //where the charge got to:  zdest if all went well, otherwise where the swim stopped.
+    SwimStatus status;
+    int goodSteps; //steps completed before the swim stopped.  all of them if status==SwimOk.
+  };
 
 
   //debug items
@@ -38,18 +80,26 @@ class AnnularFieldSim{
   //double vprime2; //second derivative of drift velocity at specific E
   float Enominal;//magnitude of the nominal field on which drift speed is based, in V/cm.
   float Bnominal;//magnitude of the nominal magnetic field on which drift speed is based, in Tesla.
+  DriftModel drift; //the gas, and the Langevin coefficients at the nominal fields.  the setters below keep it in step with vdrift, Enominal and Bnominal.
   float phispan;//angular span of the area in the phi direction, since TVector3 is too smart.
   float rmin, rmax;//inner and outer radii of the annulus
   float zmin, zmax;//lower and upper edges of the coordinate system in z (not fully implemented yet)
   //float phimin, phimax;//not implemented at all yet.
   TVector3 dim;//dimensions of simulated region, in cm
   Rossegger *green;//stand-alone class to compute greens functions.
+  int nThreads; //number of worker threads used to build lookup tables.  1=serial, <=0 means use all hardware threads.
+  std::string lookupCacheDir; //if set, lookup tables are saved to and reloaded from binary files in this directory.
+  bool lookupCacheVerify; //if true, a cached lookup table's checksum is checked over the whole table when it is loaded, not just its header and size.
+  bool fieldmapFFT; //if true, PhiSlice and PhiZSlice fieldmaps are computed as FFT convolutions in phi rather than direct sums.  off by default.
+  LookupLayout lookupLayout; //how the lookup table is laid out for the field sums.  see LookupLayout.
+  FieldInterpolation fieldInterpolation; //how the swims read the fields between cell centers.  see FieldInterpolation.
 
 
   //variables related to the whole-volume tiling:
   //
   int nr,nphi,nz; //number of fundamental bins (f-bins) in each direction = dimensions of 3D array covering entire volume
   TVector3 step; //size of an f-bin in each direction
+  double step_r, step_phi; //step.Perp() and step.Phi(), which the swims need in every step, worked out once.
   LookupCase lookupCase; //which lookup system to instantiate and use.
   ChargeCase chargeCase; //which charge model to use
   
@@ -76,16 +126,27 @@ class AnnularFieldSim{
   
   //3- and 6-dimensional arrays to handle bin and bin-to-bin data
   //
-  MultiArray<TVector3> *Efield; //total electric field in each f-bin in the roi for given configuration of charge AND external field.
-  MultiArray<TVector3> *Epartial_highres; //electric field in each f-bin in the roi from charge in a given f-bin or summed bin in the high res region.
-  MultiArray<TVector3> *Epartial_lowres; //electric field in each l-bin in the roi from charge in a given l-bin anywhere in the volume.
-  MultiArray<TVector3> *Epartial; //electric field for the old brute-force model.
-  MultiArray<TVector3> *Epartial_phislice; //electric field in a 2D phi-slice from the full 3D region.
-  MultiArray<TVector3> *Eexternal; //externally applied electric field in each f-bin in the roi
-  MultiArray<TVector3> *Bfield; //magnetic field in each f-bin in the roi
+  MultiArray<PackedVector3D> *Efield; //total electric field in each f-bin in the roi for given configuration of charge AND external field.
+  MultiArray<LookupVector3> *Epartial_highres; //electric field in each f-bin in the roi from charge in a given f-bin or summed bin in the high res region.
+  MultiArray<LookupVector3> *Epartial_lowres; //electric field in each l-bin in the roi from charge in a given l-bin anywhere in the volume.
+  MultiArray<LookupVector3> *Epartial; //electric field for the old brute-force model.
+  MultiArray<LookupVector3> *Epartial_phislice; //electric field in a 2D phi-slice from the full 3D region.
+  MultiArray<LookupVector3> *Epartial_phizslice; //electric field at a 1D radial line from the full 3D region, indexed by (r, r_source, phi_source-phi, z_source-z+nz-1).
+  MultiArray<PackedVector3D> *Eexternal; //externally applied electric field in each f-bin in the roi
+  MultiArray<PackedVector3D> *Bfield; //magnetic field in each f-bin in the roi
+  MultiArray<PackedVector3D> *Efield_zint; //running integral of Efield dz along each (r,phi) column of the roi:  element k is the integral over the first k cells.
+  MultiArray<PackedVector3D> *Bfield_zint; //ditto for Bfield.  Both are rebuilt by build_field_zintegrals() whenever we change Efield or Bfield.
+  MultiArray<PackedVector3D> *Efield_zlin; //running integral of Efield, interpolated linearly in z, along each column of the roi:  element k is the integral up to the center of cell k.  for Trilinear.
+  MultiArray<PackedVector3D> *Bfield_zlin; //ditto for Bfield, and also rebuilt by build_field_zintegrals().
   MultiArray<double> *q; //space charge in each f-bin in the whole volume
   MultiArray<double> *q_local; //temporary holder of space charge in each f-bin and summed bin of the high-res region.
   MultiArray<double> *q_lowres; //space charge in each l-bin. = sums over sets of f-bins.
+  std::vector<LookupScalar> Epartial_soa[3]; //with the SoA layout, the x,y,z planes of whichever of Epartial, Epartial_phislice or Epartial_phizslice is in use, in the same element order.  Replaces that table once packed.
+  std::vector<double> q_fieldmap; //copy of q as of the last fieldmap computation, so update_fieldmap only has to add the field of what changed.
+  std::vector<std::complex<double> > Epartial_spectrum; //phi-spectra of the phislice or phizslice lookup, for the FFT fieldmap.  built on first use.
+  DistortionMap *distortionMap; //cumulative distortion from each node of the roi to the readout plane.  made by build_distortion_map(), dropped when the fields change.
+  DistortionMap *inverseDistortionMap; //correction from where a charge appears back to where it started.  made by build_inverse_distortion_map(), dropped with distortionMap.
+  std::atomic<unsigned long> swimCount[nSwimStatus]; //how many swims have ended each way since the last reset_swim_counts().  the swims count themselves, from any thread; see print_swim_counts().
 
   
   
@@ -120,21 +181,50 @@ class AnnularFieldSim{
   
   void load_spacecharge(TH3F *hist, float zoffset, float scalefactor);
   void load_analytic_spacecharge(float scalefactor);
-  void setNominalB(float x){Bnominal=x;return;};
-  void seNominalE(float x){Enominal=x;return;};
+  void setThreadCount(int n){nThreads=n;return;};
+  void setLookupCacheDir(const char *dir){lookupCacheDir=dir;return;};
+  void setLookupCacheVerify(bool b){lookupCacheVerify=b;return;};
+  void setFieldmapFFT(bool b){fieldmapFFT=b;return;};
+  void setLookupLayout(LookupLayout l){lookupLayout=l;return;}; //takes effect at the next populate_lookup().
+  void setFieldInterpolation(FieldInterpolation f){fieldInterpolation=f;return;};
+  void setNominalB(float x){Bnominal=x;update_drift_model();return;};
+  void seNominalE(float x){Enominal=x;update_drift_model();return;};
+  void setGasParameters(float T1, float T2, float vprime, float vdoubleprime){
+    //Langevin tensor terms, and dv/dE (cm/s per V/cm) and d2v/dE2 at Enominal.  the defaults are T1=T2=1, v'=50, v''=0 (50:50).
+    drift.T1=T1; drift.T2=T2; drift.vprime=vprime; drift.vdoubleprime=vdoubleprime;
+    update_drift_model();
+    return;};
+  void update_drift_model(){drift.vdrift=vdrift; drift.Enominal=Enominal; drift.Bnominal=Bnominal; drift.Update(); return;}; //call after setting vdrift, Enominal or Bnominal by hand.
   void setFlatFields(float B, float E);
   void loadEfield(const char *filename, const char *treename);
   void loadBfield(const char *filename, const char *treename);
-  void loadField(MultiArray<TVector3> **field, TTree *source, float *rptr, float *phiptr, float *zptr, float *frptr,  float *fphiptr,  float *fzptr);
+  void loadField(MultiArray<PackedVector3D> **field, TTree *source, float *rptr, float *phiptr, float *zptr, float *frptr,  float *fphiptr,  float *fzptr);
   
-  void load_rossegger(){  green=new Rossegger(rmin,rmax,zmax); return;};
+  void load_rossegger(){
+    delete green; //a previous one, if any.
+    green=new Rossegger(rmin,rmax,zmax,lookupCacheDir); //the zero tables get cached alongside the lookups.
+    //the lookups only ever ask about cell centers, so tabulate the series on those, and on their phi separations:
+    green->PrecomputeGrid(nr,rmin+0.5*step.Perp(),step.Perp(),nz,0.5*step.Z(),step.Z(),nphi,step.Phi());
+    return;};
+  void load_rossegger(const char *tablefile){
+    //a green's function table made by generate_greens_table.C for this geometry, in place of the series.
+    delete green;
+    green=new Rossegger(std::string(tablefile));
+    if (fabs(green->GetInnerRadius()-rmin)>1e-3 || fabs(green->GetOuterRadius()-rmax)>1e-3 || fabs(green->GetHalfLength()-zmax)>1e-3){
+      printf("AnnularFieldSim::load_rossegger: %s is for r=%f to %f, z up to %f, but this sim has r=%f to %f, z up to %f.\n",
+	     tablefile,green->GetInnerRadius(),green->GetOuterRadius(),green->GetHalfLength(),rmin,rmax,zmax);
+      assert(1==2);
+    }
+    return;};
 
   TVector3 calc_unit_field(TVector3 at, TVector3 from);
+  //the same for n sources at once, with positions and fields as separate x, y and z arrays.  the lookup builders use this, one 'at' point per call.
+  void calc_unit_field(TVector3 at, int n, const double *fromx, const double *fromy, const double *fromz, double *fx, double *fy, double *fz);
   TVector3 analyticFieldIntegral(float zdest,TVector3 start){return analyticFieldIntegral( zdest, start, Efield);};
 
-  TVector3 analyticFieldIntegral(float zdest,TVector3 start, MultiArray<TVector3> *field);
+  TVector3 analyticFieldIntegral(float zdest,TVector3 start, MultiArray<PackedVector3D> *field);
   TVector3 interpolatedFieldIntegral(float zdest,TVector3 start){return interpolatedFieldIntegral( zdest, start, Efield);};
-  TVector3 interpolatedFieldIntegral(float zdest,TVector3 start, MultiArray<TVector3> *field);
+  TVector3 interpolatedFieldIntegral(float zdest,TVector3 start, MultiArray<PackedVector3D> *field);
   double FilterPhiPos(double phi); //puts phi in 0<phi<2pi
   int FilterPhiIndex(int phi,int range); //puts phi in bin range 0<phi<range.  defaults to using nphi for range.
 
@@ -142,26 +232,76 @@ class AnnularFieldSim{
   TVector3 GetRoiCellCenter(int r, int phi, int z);
   TVector3 GetGroupCellCenter(int r0, int r1, int phi0, int phi1, int z0, int z1);
   TVector3 GetWeightedCellCenter(int r, int phi, int z);
-  TVector3 fieldIntegral(float zdest,TVector3 start, MultiArray<TVector3> *field);
+  TVector3 fieldIntegral(float zdest,TVector3 start, MultiArray<PackedVector3D> *field);
   void populate_fieldmap();
+  void populate_fieldmap_fft();
+  void populate_fieldmap_gemv();
+  void update_fieldmap();
+  void build_field_zintegrals(); //call this after changing Efield or Bfield by hand, so the field integrals see the change.
+  void shift_spacecharge_z(int k);
   //now handled by setting 'analytic' lookup:  void populate_analytic_fieldmap();
   void  populate_lookup();
   void  populate_full3d_lookup();
+  void  pack_lookup(MultiArray<LookupVector3> **table);
   void  populate_highres_lookup();
   void  populate_lowres_lookup();
   void  populate_phislice_lookup();
+  void  populate_phizslice_lookup();
   TVector3 sum_field_at(int r,int phi, int z);
   TVector3 sum_full3d_field_at(int r,int phi, int z);
   TVector3 sum_local_field_at(int r,int phi, int z);
   TVector3 sum_nonlocal_field_at(int r,int phi, int z);
   TVector3 sum_phislice_field_at(int r, int phi, int z);
+  TVector3 sum_phizslice_field_at(int r, int phi, int z);
+  //the swims.  none of them print or assert on a particle that goes wrong:  they stop, report why in the SwimResult, and
+  //add it to swimCount.  the TVector3 versions are the same swims, returning only the position.
+  SwimResult swimInSteps(float zdest, const TVector3 &start, int steps, bool useAnalytic=false); //interpolated (or analytic) field, in equal steps.
+  SwimResult swimAdaptive(float zdest, const TVector3 &start, float tolerance, int *nSteps=0, int *nEvals=0); //step length chosen to keep the transverse error near tolerance (cm).
+  SwimResult swimOneStep(float zdest, const TVector3 &start, bool interpolate=true, bool useAnalytic=false); //one step, with omegatau from the local field.
   TVector3 swimToInAnalyticSteps(float zdest,TVector3 start,int steps, int *goodToStep);
   TVector3 swimToInSteps(float zdest,TVector3 start, int steps, bool interpolate, int *goodToStep);
+  TVector3 swimToAdaptive(float zdest,TVector3 start, float tolerance, int *nSteps=0, int *nEvals=0);
   TVector3 OldSwimToInSteps(float zdest,TVector3 start, int steps, bool interpolate, int *goodToStep);
   TVector3 swimTo(float zdest,TVector3 start, bool interpolate=true, bool useAnalytic=false);
-  TVector3 GetStepDistortion(float zdest,TVector3 start, bool interpolate=true, bool useAnalytic=false);
+  void swimBatch(int n, const TVector3 *start, const float *zdest, const int *steps, TVector3 *end, int *goodToStep=0, SwimStatus *status=0); //swimInSteps on n particles, spread across the thread pool.
+  void swimBatch(int n, const double *x0, const double *y0, const double *z0, const float *zdest, const int *steps,
+		 double *x, double *y, double *z, int *goodToStep=0, SwimStatus *status=0); //the same, with positions as separate x, y and z arrays.
+  TVector3 GetStepDistortion(float zdest,TVector3 start, bool interpolate=true, bool useAnalytic=false, SwimStatus *status=0); //zero, with the reason in status, if the step can't be taken.
+  void reset_swim_counts();
+  void print_swim_counts(); //one line, with how many swims ended each way.
+  void build_distortion_map(int stepsPerSlice=10); //fills distortionMap from the current fields.  see DistortionMap.h.
+  void build_inverse_distortion_map(); //fills inverseDistortionMap by inverting distortionMap (which it builds first if need be).
  
  private:
+  void parallel_for(int njobs, std::function<void(int)> job);
+  void build_kernel_spectrum(const SimpleFFT &fft);
+  bool fieldmap_is_incremental();
+  MultiArray<PackedVector3D> *zintegral_of(MultiArray<PackedVector3D> *field);
+  MultiArray<PackedVector3D> *zlinear_integral_of(MultiArray<PackedVector3D> *field);
+  SwimStatus step_distortion(float zdest, const TVector3 &start, bool interpolate, bool useAnalytic, TVector3 *distortion);
+  SwimResult swim_in_steps(float zdest, const TVector3 &start, int steps, bool useAnalytic); //swimInSteps, without the counting.
+  void swim_block(int n, const double *x0, const double *y0, const double *z0, const float *zdest, const int *steps,
+		  double *x, double *y, double *z, int *goodSteps, SwimStatus *status); //swim_in_steps on up to SWIM_BLOCK particles at once.
+  //the pieces of a step that swim_in_steps (through interpolatedFieldIntegral and step_distortion) and swim_block share:
+  struct ZSpan{ //one straight step along z, as the field integrals see it.
+    int zi, zf; //the cells holding the low and high ends.
+    double startz, endz, dir; //the low and high ends, and +1 if the step goes to larger z, -1 if to smaller.
+    double ua, ub; //the low and high ends in units of step.Z(), from the center of the first roi cell.
+    bool lowEdge, highPart; //whether the low end is just below the roi, and whether the high end reaches far enough into its cell to count.
+  };
+  SwimStatus step_start(double r, double phi, double *z, float zend); //SwimLeftRoi if a step can't go from (r,phi,*z) to zend.  nudges z up onto the low edge.
+  void interpolation_columns(double r, double phi, int col[4], float w[4]); //the (r,phi) columns around a point and their weights.
+  bool z_span(float zdest, double zfrom, ZSpan *span); //false if either end is out of the roi in z.
+  void column_zintegral(const PackedVector3D *f, const PackedVector3D *F, const PackedVector3D *L, const ZSpan &span, double out[3]);
+  SwimStatus langevin_step(double zdist, const double Eint[3], const double Bint[3], double delta[3]);
+  bool step_is_sane(double deltaX);
+  void count_swim(SwimStatus status); //adds one to swimCount[status].
+  PackedVector3D lookup_element(MultiArray<LookupVector3> *table, size_t flat);
+  PackedVector3D sum_field_from_cells(int r, int phi, int z, const std::vector<int> &cells, const std::vector<double> &dq);
+  unsigned long long lookup_cache_key(const char *tablename);
+  std::string lookup_cache_filename(const char *tablename);
+  bool load_lookup_cache(const char *tablename, MultiArray<LookupVector3> **table);
+  void save_lookup_cache(const char *tablename, MultiArray<LookupVector3> *table);
   BoundsCase GetRindexAndCheckBounds(float pos, int *r);
   BoundsCase GetPhiIndexAndCheckBounds(float pos, int *phi);
   BoundsCase GetZindexAndCheckBounds(float pos, int *z);
@@ -180,8 +320,35 @@ class MultiArray : public TObject{
    int n[6];
    int length;
    T *field;
+   void *mapping; //! if not 0, field points into this read-only file mapping (see AnnularFieldSim::load_lookup_cache) instead of its own malloc.
+   size_t mappingBytes; //! size of that mapping.
 
    MultiArray(int a=0, int b=0, int c=0, int d=0, int e=0, int f=0){
+     SetShape(a,b,c,d,e,f);
+     field=static_cast<T*>( malloc(length*sizeof(T) ));
+     //field=(T)( malloc(length*sizeof(T) ));
+     //for (int i=0;i<length;i++) field[i].SetXYZ(0,0,0);
+     mapping=0;
+     mappingBytes=0;
+   }
+   MultiArray(const int *dims, T *mapped, void *map, size_t mapBytes){
+     //a read-only view of an array that lives in a file mapping.  the array must not be written, and Release() unmaps it.
+     SetShape(dims[0],dims[1],dims[2],dims[3],dims[4],dims[5]);
+     field=mapped;
+     mapping=map;
+     mappingBytes=mapBytes;
+   }
+
+   void Release(){
+     //give back the storage, whichever kind it is.  the array is unusable afterwards, so delete it next.
+     if (mapping!=0) munmap(mapping,mappingBytes);
+     else free(field);
+     field=0;
+     mapping=0;
+     return;
+   }
+
+   void SetShape(int a, int b, int c, int d, int e, int f){
      int n_[6];
      for (int i=0;i<MAX_DIM;i++)
        n[i]=0;
@@ -196,9 +363,7 @@ class MultiArray : public TObject{
        n[i]=n_[i];
        length*=n[i];
      }
-     field=static_cast<T*>( malloc(length*sizeof(T) ));
-     //field=(T)( malloc(length*sizeof(T) ));
-     //for (int i=0;i<length;i++) field[i].SetXYZ(0,0,0);
+     return;
    }
 
    void Add(int a, int b, int c, T in){
@@ -0,0 +1,43 @@
+#ifndef __CACHEFILE_H__
+#define __CACHEFILE_H__
+
+//
+//  The two pieces every binary file we write shares:  the checksum in its header, and writing it so that no reader
+//  ever sees a partial file.  Used by the lookup-table cache, Rossegger's zero cache and green's function tables, and
+//  DistortionMap, so they all stay byte-compatible with each other's idea of a checksum.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <functional>
+
+inline uint64_t cache_file_hash(const void *data, size_t nbytes, uint64_t h=14695981039346656037ULL){
+  //64-bit FNV-1a.  pass the previous result as h to hash several blocks as if they were one.
+  const unsigned char *c=static_cast<const unsigned char*>(data);
+  for (size_t i=0;i<nbytes;i++){
+    h^=c[i];
+    h*=1099511628211ULL;
+  }
+  return h;
+}
+
+inline bool write_cache_file(const std::string &filename, std::function<bool(FILE*)> write){
+  //write(out) fills a private temporary file, which is renamed into place only if every write and the close succeeded,
+  //so a crashed or concurrent job never leaves a partial file under the real name.  on failure nothing is left behind.
+  char suffix[32];
+  snprintf(suffix,sizeof(suffix),".tmp%d",(int)getpid());
+  std::string tmpname=filename+suffix;
+  FILE *out=fopen(tmpname.c_str(),"wb");
+  if (out==0) return false;
+  bool ok=write(out);
+  ok=(fclose(out)==0) && ok;
+  if (!ok || rename(tmpname.c_str(),filename.c_str())!=0){
+    unlink(tmpname.c_str());
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,261 @@
+#include "DistortionMap.h"
+#include "CacheFile.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define DISTORTION_MAP_VERSION 2 //bump this whenever the layout of the file changes.
+
+//fixed-size header at the front of the file, followed by the 3*nr*nphi*nz floats of the map, in memory order.
+struct DistortionMapHeader{
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  int32_t nr, nphi, nz;
+  int32_t phiWraps;
+  float r0, dr, phi0, dphi, z0, dz;
+  uint64_t checksum; //hash of the rest of the header and the data block, to catch truncated or corrupted files.
+};
+static const char distortionMapMagic[8]={'A','F','S','D','M','A','P','\0'};
+
+static uint64_t distortion_map_checksum(DistortionMapHeader header, const float *data, size_t n){
+  //the grid is in the header, so it is covered too:  the header as it is written, with the checksum itself zeroed, then the nodes.
+  header.checksum=0;
+  uint64_t h=cache_file_hash(&header,sizeof(header));
+  return cache_file_hash(data,n*sizeof(float),h);
+}
+
+static inline int ClampedCell(float u, int n, float *frac){
+  //the cell [i,i+1] holding u, in units of the node spacing, with u held to the first and last nodes.
+  //a single node is a cell of its own, i=0 with frac=0, and the caller steps 0 to its 'next' node.
+  u=std::min(std::max(u,0.0f),(float)(n-1));
+  int i=std::min((int)u,std::max(n-2,0));
+  *frac=u-i;
+  return i;
+}
+
+DistortionMap::DistortionMap():nr(0),nphi(0),nz(0),r0(0),dr(0),phi0(0),dphi(0),z0(0),dz(0),phiWraps(false){
+  SetDerived();
+}
+
+DistortionMap::DistortionMap(int in_nr, float in_r0, float in_dr, int in_nphi, float in_phi0, float in_dphi, bool in_phiWraps,
+			     int in_nz, float in_z0, float in_dz)
+  :nr(in_nr),nphi(in_nphi),nz(in_nz),r0(in_r0),dr(in_dr),phi0(in_phi0),dphi(in_dphi),z0(in_z0),dz(in_dz),phiWraps(in_phiWraps){
+  if (nr<1 || nphi<1 || nz<1 || !(dr>0) || !(dphi>0) || !(dz>0)){
+    printf("DistortionMap: asked for %dx%dx%d nodes with spacing (%f,%f,%f).  Need at least 1 node and a positive spacing on each axis.\n",
+	   nr,nphi,nz,dr,dphi,dz);
+    assert(1==2);
+  }
+  d.assign(3*(size_t)nr*nphi*nz,0);
+  SetDerived();
+}
+
+void DistortionMap::Query(float r, float phi, float z, float *dist) const{
+  if (Empty()){
+    printf("DistortionMap::Query: the map is empty.  Build or Load one first.\n");
+    assert(1==2);
+  }
+  //no branches on the position, so the cost is the same everywhere:  three cell lookups and a weighted sum of 8 nodes.
+  //(on a single-node axis the 'next' node is the node itself, so that axis just holds its value.)
+  float fr,fphi,fz;
+  int ir=ClampedCell((r-r0)*invDr,nr,&fr);
+  int iz=ClampedCell((z-z0)*invDz,nz,&fz);
+
+  //phi in units of the node spacing, taken to within half a turn of the middle of the nodes, so it doesn't matter
+  //whether the caller's phi runs from -pi to pi or from 0 to 2pi.  (the +8 turns keep the truncation a floor for
+  //any phi within a few turns of ours.)
+  float u=(phi-phi0)*invDphi;
+  int turns=(int)((u-phiMiddle)*invTurn+8.5f)-8;
+  u-=turns*phiTurn;
+  int iphi,iphi1;
+  if (phiWraps){
+    //u is now in [-0.5,nphi-0.5), so the lower node is at worst one below the first.
+    iphi=(int)(u+1)-1;
+    fphi=u-iphi;
+    iphi=(iphi<0)?iphi+nphi:iphi;
+    iphi1=(iphi+1==nphi)?0:iphi+1;
+  } else {
+    iphi=ClampedCell(u,nphi,&fphi);
+    iphi1=iphi+(nphi>1);
+  }
+
+  //the next node in r is nextR floats on, the next slice in z is nextZ floats on.
+  const float *a=&d[Node(ir,iphi,iz)];
+  const float *b=&d[Node(ir,iphi1,iz)];
+  const std::size_t dr1=nextR, dz1=nextZ;
+  for (int c=0;c<3;c++){
+    float lo0=a[c]+(a[dr1+c]-a[c])*fr;
+    float lo1=b[c]+(b[dr1+c]-b[c])*fr;
+    float hi0=a[dz1+c]+(a[dz1+dr1+c]-a[dz1+c])*fr;
+    float hi1=b[dz1+c]+(b[dz1+dr1+c]-b[dz1+c])*fr;
+    float lo=lo0+(lo1-lo0)*fphi;
+    float hi=hi0+(hi1-hi0)*fphi;
+    dist[c]=lo+(hi-lo)*fz;
+  }
+  return;
+}
+
+void DistortionMap::SetDerived(){
+  invDr=1/dr;
+  invDphi=1/dphi;
+  invDz=1/dz;
+  phiTurn=2*M_PI/dphi;
+  invTurn=1/phiTurn;
+  phiMiddle=0.5f*(nphi-1);
+  nextR=(nr>1)?3:0;
+  nextZ=(nz>1)?3*(std::size_t)nr*nphi:0;
+  return;
+}
+
+static inline void Displace(float r, float phi, const float *dist, double *x, double *y){
+  //(x,y) of the point (dr, r*dphi) away from (r,phi), in the frame at (r,phi).
+  double c=cos(phi), s=sin(phi);
+  *x=(r+dist[0])*c-dist[1]*s;
+  *y=(r+dist[0])*s+dist[1]*c;
+  return;
+}
+
+DistortionMap *DistortionMap::Inverse(int maxIterations, float tolerance, float *maxResidual) const{
+  if (Empty()){
+    printf("DistortionMap::Inverse: the map is empty.  Build or Load one first.\n");
+    assert(1==2);
+  }
+  DistortionMap *inv=new DistortionMap(nr,r0,dr,nphi,phi0,dphi,phiWraps,nz,z0,dz);
+  int nUnconverged=0;
+  double worst=0, sum2=0;
+  for (int iz=0;iz<nz;iz++){
+    for (int iphi=0;iphi<nphi;iphi++){
+      for (int ir=0;ir<nr;ir++){
+	float pr=r0+ir*dr, pphi=phi0+iphi*dphi, pz=z0+iz*dz;
+	double px=pr*cos(pphi), py=pr*sin(pphi);
+	//start from the node itself, and move the guess until the forward map takes it back onto the node.
+	double x=px, y=py, z=pz;
+	float fwd[3];
+	bool converged=false;
+	for (int it=0;it<maxIterations && !converged;it++){
+	  float xr=sqrt(x*x+y*y), xphi=atan2(y,x);
+	  Query(xr,xphi,z,fwd);
+	  double ex,ey;
+	  Displace(xr,xphi,fwd,&ex,&ey); //where the guess ends up
+	  double nx=x+px-ex, ny=y+py-ey, nzz=pz-fwd[2];
+	  converged=(fabs(nx-x)<tolerance && fabs(ny-y)<tolerance && fabs(nzz-z)<tolerance);
+	  x=nx;
+	  y=ny;
+	  z=nzz;
+	}
+	if (!converged) nUnconverged++;
+
+	//the round trip, from the node back to its origin and forward again:
+	float xr=sqrt(x*x+y*y), xphi=atan2(y,x);
+	Query(xr,xphi,z,fwd);
+	double ex,ey;
+	Displace(xr,xphi,fwd,&ex,&ey);
+	double res2=(ex-px)*(ex-px)+(ey-py)*(ey-py)+(z+fwd[2]-pz)*(z+fwd[2]-pz);
+	sum2+=res2;
+	worst=std::max(worst,sqrt(res2));
+
+	//and the correction, in the node's (r,phi) frame:
+	double cx=x-px, cy=y-py;
+	float corr[3]={(float)(cx*cos(pphi)+cy*sin(pphi)),(float)(-cx*sin(pphi)+cy*cos(pphi)),(float)(z-pz)};
+	inv->Set(ir,iphi,iz,corr);
+      }
+    }
+  }
+  int n=nr*nphi*nz;
+  printf("DistortionMap::Inverse: %d nodes, round-trip residual max %E cm, rms %E cm.",n,worst,sqrt(sum2/n));
+  if (nUnconverged>0) printf("  %d nodes did not converge in %d iterations.",nUnconverged,maxIterations);
+  printf("\n");
+  if (maxResidual) *maxResidual=worst;
+  return inv;
+}
+
+bool DistortionMap::Save(const char *filename) const{
+  DistortionMapHeader header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,distortionMapMagic,sizeof(distortionMapMagic));
+  header.version=DISTORTION_MAP_VERSION;
+  header.headerSize=sizeof(DistortionMapHeader);
+  header.nr=nr;
+  header.nphi=nphi;
+  header.nz=nz;
+  header.phiWraps=phiWraps;
+  header.r0=r0;
+  header.dr=dr;
+  header.phi0=phi0;
+  header.dphi=dphi;
+  header.z0=z0;
+  header.dz=dz;
+  header.checksum=distortion_map_checksum(header,d.data(),d.size());
+
+  bool ok=write_cache_file(filename,[&](FILE *out){
+      return fwrite(&header,sizeof(header),1,out)==1
+	&& fwrite(d.data(),sizeof(float),d.size(),out)==d.size();
+    });
+  if (!ok){
+    printf("DistortionMap::Save: failed writing %s.\n",filename);
+    return false;
+  }
+  printf("DistortionMap::Save: saved %dx%dx%d nodes to %s\n",nr,nphi,nz,filename);
+  return true;
+}
+
+bool DistortionMap::Load(const char *filename){
+  FILE *in=fopen(filename,"rb");
+  if (in==0){
+    printf("DistortionMap::Load: could not open %s.\n",filename);
+    return false;
+  }
+  DistortionMapHeader header;
+  bool ok=(fread(&header,sizeof(header),1,in)==1)
+    && memcmp(header.magic,distortionMapMagic,sizeof(distortionMapMagic))==0
+    && header.version==DISTORTION_MAP_VERSION
+    && header.headerSize==sizeof(DistortionMapHeader)
+    && header.nr>=1 && header.nphi>=1 && header.nz>=1
+    && std::isfinite(header.r0) && std::isfinite(header.phi0) && std::isfinite(header.z0)
+    && std::isfinite(header.dr) && header.dr>0
+    && std::isfinite(header.dphi) && header.dphi>0
+    && std::isfinite(header.dz) && header.dz>0;
+  std::vector<float> data;
+  if (ok){
+    //don't trust the header's dimensions until the file agrees with them:  the data that follows it must be exactly
+    //nr*nphi*nz nodes of three floats, nothing more.  (divided down rather than multiplied up, so a corrupt header can't overflow.)
+    long fileSize=-1;
+    if (fseek(in,0,SEEK_END)==0) fileSize=ftell(in);
+    ok=fileSize>=(long)sizeof(header) && fseek(in,sizeof(header),SEEK_SET)==0;
+    size_t nodeBytes=3*sizeof(float);
+    size_t dataBytes=ok?(size_t)fileSize-sizeof(header):0;
+    ok=ok && dataBytes%nodeBytes==0
+      && (dataBytes/nodeBytes)%header.nr==0
+      && (dataBytes/nodeBytes/header.nr)%header.nphi==0
+      && dataBytes/nodeBytes/header.nr/header.nphi==(size_t)header.nz;
+    if (ok){
+      data.resize(dataBytes/sizeof(float));
+      ok=(fread(data.data(),sizeof(float),data.size(),in)==data.size())
+	&& distortion_map_checksum(header,data.data(),data.size())==header.checksum;
+    }
+  }
+  fclose(in);
+  if (!ok){
+    printf("DistortionMap::Load: %s is not a version %d distortion map, or is truncated or corrupt.\n",filename,DISTORTION_MAP_VERSION);
+    return false;
+  }
+  nr=header.nr;
+  nphi=header.nphi;
+  nz=header.nz;
+  phiWraps=(header.phiWraps!=0);
+  r0=header.r0;
+  dr=header.dr;
+  phi0=header.phi0;
+  dphi=header.dphi;
+  z0=header.z0;
+  dz=header.dz;
+  d.swap(data);
+  SetDerived();
+  printf("DistortionMap::Load: loaded %dx%dx%d nodes from %s\n",nr,nphi,nz,filename);
+  return true;
+}
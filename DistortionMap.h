@@ -0,0 +1,51 @@
+#ifndef __DISTORTIONMAP_H__
+#define __DISTORTIONMAP_H__
+
+//
+//  A cumulative distortion map:  for every node of an (r,phi,z) grid, the (dr, r*dphi, dz) between where a charge
+//  that starts at that node reaches the readout plane and where it would have reached it drifting straight.
+//  AnnularFieldSim::build_distortion_map fills one from the simulation, and Save/Load put it in a small binary file,
+//  so reconstruction can correct clusters from the map alone, without the simulation or ROOT histograms.
+//
+//  The nodes are stored as one flat float array, z-slice by z-slice, so a query reads two small patches of memory.
+//  Query is trilinear between the 8 surrounding nodes.  Outside the grid in r and z it holds the edge values, and in
+//  phi it either wraps around (a full ring of nodes) or holds the edge values too (a wedge).
+//
+
+#include <vector>
+#include <cstddef>
+
+class DistortionMap{
+ public:
+  DistortionMap(); //an empty map, to Load into.
+  DistortionMap(int nr, float r0, float dr, int nphi, float phi0, float dphi, bool phiWraps, int nz, float z0, float dz);
+
+  bool Empty() const {return d.empty();};
+  void Set(int ir, int iphi, int iz, const float *dist) {float *p=&d[Node(ir,iphi,iz)]; p[0]=dist[0]; p[1]=dist[1]; p[2]=dist[2]; return;};
+  const float *Get(int ir, int iphi, int iz) const {return &d[Node(ir,iphi,iz)];}; //(dr, r*dphi, dz) at a node.
+  void Query(float r, float phi, float z, float *dist) const; //(dr, r*dphi, dz) at any point, interpolated.
+
+  //the correction map:  the same grid, read as where charges appear, holding the (dr, r*dphi, dz) from there back to where
+  //they started.  each node solves x + D(x) = p for the origin x by fixed-point iteration, x <- p - D(x), to within
+  //tolerance (cm), which converges wherever D changes by much less than the distance it changes over.  the largest
+  //round-trip residual |x + D(x) - p| over the nodes is printed, and put in maxResidual if it is given.
+  DistortionMap *Inverse(int maxIterations=50, float tolerance=1e-5, float *maxResidual=0) const;
+
+  //binary save and load.  Load prints what is wrong and returns false (leaving the map as it was) if the file can't be used.
+  bool Save(const char *filename) const;
+  bool Load(const char *filename);
+
+  //the grid is fixed by the constructor or Load.  d can be filled in directly or with Set.
+  int nr, nphi, nz; //number of nodes on each axis, at least 1 each.  a single-node axis holds its one value.
+  float r0, dr, phi0, dphi, z0, dz; //first node and spacing on each axis.
+  bool phiWraps; //true if the phi nodes go all the way around, so the last one neighbors the first.
+  std::vector<float> d; //(dr, r*dphi, dz) of node (ir,iphi,iz) at d[Node(ir,iphi,iz)].
+
+ private:
+  void SetDerived(); //the reciprocals below, from the spacings.
+  float invDr, invDphi, invDz, phiTurn, invTurn, phiMiddle; //1/spacing, and a turn and the middle of the phi nodes in units of dphi.
+  std::size_t nextR, nextZ; //floats from a node to the next one in r and in z, or 0 on an axis with a single node.
+  std::size_t Node(int ir, int iphi, int iz) const {return 3*(((std::size_t)iz*nphi+iphi)*nr+ir);};
+};
+
+#endif /* __DISTORTIONMAP_H__ */
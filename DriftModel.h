@@ -0,0 +1,75 @@
+#ifndef __DRIFTMODEL_H__
+#define __DRIFTMODEL_H__
+
+//
+//  The Langevin displacement of a drifting charge over one step, from the second order expansion in
+//  http://skipper.physics.sunysb.edu/~prakhar/tpc/Papers/ALICE-INT-2010-016.pdf
+//  The gas constants and the coefficients at the nominal fields are worked out once, when the model is made, instead of
+//  on every step, and Step is inline arithmetic on plain doubles, so the swims can call it in their inner loops.
+//
+
+struct DriftModel{
+  //the gas, at the nominal fields:
+  double vdrift; //drift speed in cm/s
+  double Enominal; //magnitude of the nominal electric field, in V/cm
+  double Bnominal; //magnitude of the nominal magnetic field, in T
+  double T1, T2; //Langevin tensor terms
+  double vprime; //dv/dE, in (cm/s)/(V/cm)
+  double vdoubleprime; //d2v/dE2, in (cm/s)/(V/cm)^2.  neglected (0) by default:  v is pretty linear at our operating point.
+  //and what follows from them.  call Update() after changing any of the above.
+  double omegatau, c0, c1, c2;
+
+  DriftModel(double vdr=0, double E=400, double B=1.4, double t1=1, double t2=1, double vp=5000/100, double vpp=0)
+    :vdrift(vdr),Enominal(E),Bnominal(B),T1(t1),T2(t2),vprime(vp),vdoubleprime(vpp){Update();};
+
+  void Update(){
+    omegatau=OmegaTau(Enominal,Bnominal);
+    Coefficients(omegatau,&c0,&c1,&c2);
+    return;
+  };
+
+  double OmegaTau(double E, double B) const{
+    double mu=vdrift/E;//vdrift in [cm/s], field in [V/cm] hence mu in [cm^2/(V*s)];
+    //mu*Q_e*B, with B in [T]=[Vs/m^2], and *1m/100cm * 1m/100cm to make it unitless.  'q' is really about the direction of
+    //time:  we 'see' the charge by noting that we're asking to drift against the overall field.
+    return mu*B*1e-4;
+  };
+
+  void Coefficients(double ot, double *a0, double *a1, double *a2) const{
+    double T1om=T1*ot;
+    double T2om2=T2*ot*T2*ot;
+    *a0=1/(1+ot*ot);
+    *a1=T1om/(1+T1om*T1om);
+    *a2=T2om2/(1+T2om2);
+    return;
+  };
+
+  //(dx,dy,dz) over a step of length zdist in z, along which E and B integrate to Eint and Bint, at the nominal coefficients.
+  void Step(double zdist, const double *Eint, const double *Bint, double *delta) const{
+    Step(c0,c1,c2,zdist,Eint,Bint,delta);
+    return;
+  };
+
+  //the same, with coefficients a0,a1,a2 from Coefficients(), for a model that works out omegatau from the local field.
+  void Step(double a0, double a1, double a2, double zdist, const double *Eint, const double *Bint, double *delta) const{
+    //the integral of E/E_z, taken as the integral of E over the average E_z.  really this should be the integral of the ratio.
+    double invEz=1/(Eint[2]/zdist);
+    double invBz=1/(Bint[2]/zdist);
+    double ex=invEz*Eint[0], ey=invEz*Eint[1];
+    double bx=invBz*Bint[0], by=invBz*Bint[1];
+    delta[0]=a0*ex+a1*ey-a1*by+a2*bx;
+    delta[1]=a0*ey-a1*ex+a1*bx+a2*by;
+    //strictly, for dz we want to integrate v'(E)*(E-E0)dz and v''(E)*(E-E0)^2 dz, but over a short step the field is
+    //constant, so the integral of a function of E is that function of the average, times the length.
+    double dE=Eint[2]-zdist*Enominal;
+    delta[2]=vprime/vdrift*dE
+      +vdoubleprime/vdrift*dE*dE/(2*zdist)
+      -0.5/zdist*(ex*ex+ey*ey)
+      +a1/zdist*(ex*by-ey*bx)
+      +a2/zdist*(ex*bx+ey*by)
+      +a2/zdist*(bx*bx+by*by);
+    return;
+  };
+};
+
+#endif /* __DRIFTMODEL_H__ */
@@ -0,0 +1,229 @@
+#include "ImaginaryBessel.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <complex>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <assert.h>
+
+using namespace std;
+
+typedef std::complex<double> cdouble;
+
+static cdouble lgamma_complex(cdouble z){
+  //log of the gamma function for Re(z)>=1/2, by the Lanczos approximation (g=7, 9 terms), good to ~1e-15.
+  static const double p[9]={0.99999999999980993, 676.5203681218851, -1259.1392167224028,
+			    771.32342877765313, -176.61502916214059, 12.507343278686905,
+			    -0.13857109526572012, 9.9843695780195716e-6, 1.5056327351493116e-7};
+  z-=1.0;
+  cdouble a=p[0];
+  for (int i=1;i<9;i++)
+    a+=p[i]/(z+(double)i);
+  cdouble t=z+7.5;
+  return 0.5*log(2*M_PI)+(z+0.5)*std::log(t)-t+std::log(a);
+}
+
+static cdouble bessel_i_imaginary(double mu, double x, double *maxterm){
+  //I_{i mu}(x) = sum_k (x/2)^(2k+i mu) / (k! Gamma(k+1+i mu)).
+  //Limu is its real part, and K_{i mu}(x) = -pi*Im(I_{i mu}(x))/sinh(pi mu).  The largest term tells us how much cancellation there was.
+  cdouble term=std::exp(cdouble(0,mu*log(x/2))-lgamma_complex(cdouble(1,mu)));
+  cdouble sum=term;
+  double q=x*x/4;
+  *maxterm=abs(term);
+  for (int k=1;k<10000;k++){
+    term*=q/((double)k*cdouble(k,mu));
+    sum+=term;
+    double size=abs(term);
+    if (size>*maxterm) *maxterm=size;
+    if (k>x/2 && size<1e-18*abs(sum)) break; //past the peak of the terms, and they no longer matter.
+  }
+  return sum;
+}
+
+static double bessel_k_imaginary_integral(double mu, double x){
+  //K_{i mu}(x) = int_0^inf exp(-x cosh t) cos(mu t) dt.  The trapezoid rule converges exponentially here, since the
+  //integrand is analytic and even;  the step is set so the aliasing error from the cos(mu t) oscillation stays below ~1e-16.
+  double h=M_PI*M_PI/(M_PI*mu+90.0);
+  if (h>0.1) h=0.1;
+  double sum=0.5*exp(-x);
+  for (int i=1;;i++){
+    double t=i*h;
+    double e=x*cosh(t);
+    if (e-x>45) break; //exp(-45) below the first term.
+    sum+=exp(-e)*cos(mu*t);
+  }
+  return sum*h;
+}
+
+double ImaginaryBesselTable::ExactLimu(double mu, double x){
+  double maxterm;
+  return real(bessel_i_imaginary(mu,x,&maxterm));
+}
+
+double ImaginaryBesselTable::ExactKimu(double mu, double x){
+  //the series is good until its terms grow much larger than K (large x), the integral until exp(-x) is much larger than K (large mu),
+  //so use whichever has the smaller rounding error.
+  double maxterm;
+  cdouble i=bessel_i_imaginary(mu,x,&maxterm);
+  double seriesError=M_PI*maxterm/sinh(M_PI*mu);
+  double integralError=exp(-x);
+  if (seriesError<integralError)
+    return -M_PI*imag(i)/sinh(M_PI*mu);
+  return bessel_k_imaginary_integral(mu,x);
+}
+
+ImaginaryBesselTable::ImaginaryBesselTable(Kind k, int nmu, double in_mumin, double in_mumax, int nx, double in_xmin, double in_xmax){
+  kind=k;
+  source="generated";
+  logx=true;
+  mumin=in_mumin; mumax=in_mumax; xmin=in_xmin; xmax=in_xmax;
+  nu=nmu;
+  nv=nx;
+  u0=mumin;
+  du=(mumax-mumin)/(nmu-1);
+  v0=log(xmin);
+  dv=(log(xmax)-log(xmin))/(nx-1);
+  printf("ImaginaryBesselTable: generating %s on %dx%d points, mu=%f to %f, x=%f to %f\n",
+	 (kind==L)?"Limu":"Kimu",nu,nv,mumin,mumax,xmin,xmax);
+  f.resize(nu*nv);
+  for (int i=0;i<nu;i++){
+    double mu=u0+i*du;
+    for (int j=0;j<nv;j++){
+      double x=exp(v0+j*dv);
+      f[i*nv+j]=(kind==L)?ExactLimu(mu,x):ExactKimu(mu,x);
+    }
+  }
+  return;
+}
+
+ImaginaryBesselTable::ImaginaryBesselTable(Kind k, const char *sourcefile){
+  //the csv layout is two header lines, "name,first,last,npoints" for mu and then x, followed by one "mu,x,value" line per grid point.
+  kind=k;
+  source=sourcefile;
+  logx=false;
+  nu=nv=0;
+  mumin=mumax=xmin=xmax=0;
+  cout << "trying to load " << sourcefile << endl;
+  std::ifstream inf(sourcefile);
+  if (!inf.is_open()){
+    printf("ImaginaryBesselTable: could not open %s\n",sourcefile);
+    return;
+  }
+  string line;
+  string token;
+
+  int nsteps[2];
+  double first[2];
+  double step[2];
+  for (int i=0;i<2;i++){
+    if (!(inf>>line)) return;
+    stringstream lineparser(line);
+    getline(lineparser,token,','); //axis name
+    getline(lineparser,token,',');
+    first[i]=std::stod(token);
+    getline(lineparser,token,',');
+    double last=std::stod(token);
+    getline(lineparser,token,',');
+    nsteps[i]=std::stoi(token);
+    step[i]=(last-first[i])/(nsteps[i]-1);
+    printf("loaded axis=%d,limits=%f,%f,steps=%d from file\n",i,first[i],last,nsteps[i]);
+  }
+  nu=nsteps[0];
+  nv=nsteps[1];
+  u0=first[0];
+  du=step[0];
+  v0=first[1];
+  dv=step[1];
+  mumin=u0; mumax=u0+(nu-1)*du;
+  xmin=v0; xmax=v0+(nv-1)*dv;
+  f.assign(nu*nv,0);
+  std::vector<char> seen(nu*nv,0);
+
+  int nlines=0;
+  double val[3];
+  while (inf>>line){
+    stringstream lineparser(line);
+    for (int i=0;i<3;i++){
+      getline(lineparser,token,',');
+      val[i]=std::stod(token);
+    }
+    int i=(int)floor((val[0]-u0)/du+0.5);
+    int j=(int)floor((val[1]-v0)/dv+0.5);
+    if (i<0 || i>=nu || j<0 || j>=nv){
+      printf("ImaginaryBesselTable: %s has a point (%f,%f) off its own grid.  Skipping it.\n",sourcefile,val[0],val[1]);
+      continue;
+    }
+    if (seen[i*nv+j]){
+      printf("ImaginaryBesselTable: %s has point (%f,%f) twice.  Not using this file.\n",sourcefile,val[0],val[1]);
+      f.clear();
+      return;
+    }
+    seen[i*nv+j]=1;
+    f[i*nv+j]=val[2];
+    nlines++;
+  }
+  printf("ImaginaryBesselTable: read %d points into a %dx%d table\n",nlines,nu,nv);
+  if (nlines!=nu*nv){
+    //a truncated file would otherwise leave zeroes in the missing cells and still look Loaded().
+    printf("ImaginaryBesselTable: %s is missing %d of its points.  Not using this file.\n",sourcefile,nu*nv-nlines);
+    f.clear();
+  }
+  return;
+}
+
+//Catmull-Rom weights for the four grid points around a fractional position t in [0,1).
+static inline void cubic_weights(double t, double w[4]){
+  w[0]=((-t+2)*t-1)*t*0.5;
+  w[1]=((3*t-5)*t*t+2)*0.5;
+  w[2]=((-3*t+4)*t+1)*t*0.5;
+  w[3]=(t-1)*t*t*0.5;
+  return;
+}
+
+void ImaginaryBesselTable::Eval(int n, const double *mu, const double *x, double *out) const{
+  //bicubic interpolation.  Points off the table are clamped to its edge rather than checked for, so the loop has no branches
+  //besides the log;  callers that care should make sure the table covers what they ask for.
+  const double *data=&f[0];
+  for (int p=0;p<n;p++){
+    double fu=(mu[p]-u0)/du;
+    double fv=((logx?log(x[p]):x[p])-v0)/dv;
+    fu=std::min(std::max(fu,0.0),nu-1.0);
+    fv=std::min(std::max(fv,0.0),nv-1.0);
+    int i=std::min((int)fu,nu-2);
+    int j=std::min((int)fv,nv-2);
+    double wu[4],wv[4];
+    cubic_weights(fu-i,wu);
+    cubic_weights(fv-j,wv);
+    double sum=0;
+    for (int a=0;a<4;a++){
+      const double *row=data+std::min(std::max(i-1+a,0),nu-1)*nv;
+      double rowsum=0;
+      for (int b=0;b<4;b++)
+	rowsum+=wv[b]*row[std::min(std::max(j-1+b,0),nv-1)];
+      sum+=wu[a]*rowsum;
+    }
+    out[p]=sum;
+  }
+  return;
+}
+
+bool ImaginaryBesselTable::Covers(double mulow, double muhigh, double xlow, double xhigh) const{
+  //with a little slack for the rounding in the grid spacing.
+  double mslack=1e-9*(mumax-mumin), xslack=1e-9*(xmax-xmin);
+  return Loaded() && mulow>=mumin-mslack && muhigh<=mumax+mslack && xlow>=xmin-xslack && xhigh<=xmax+xslack;
+}
+
+double ImaginaryBesselTable::Eval(double mu, double x) const{
+  if (!Covers(mu,mu,x,x)){
+    printf("ImaginaryBesselTable::Eval:  %s(mu=%f,x=%f) is off the %s table, which covers mu:(%f to %f) x:(%f to %f)\n",
+	   (kind==L)?"Limu":"Kimu",mu,x,source.c_str(),mumin,mumax,xmin,xmax);
+    assert(1==3);
+  }
+  double out;
+  Eval(1,&mu,&x,&out);
+  return out;
+}
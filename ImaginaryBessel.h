@@ -0,0 +1,44 @@
+#ifndef __IMAGINARYBESSEL_H__
+#define __IMAGINARYBESSEL_H__
+
+//
+//  Tables of the modified Bessel functions of purely imaginary order that the Ephi part of the Rossegger
+//  green's function needs (Rossegger eqn 5.44-5.46):
+//     Limu(mu,x) = 1/2*(I_{-i mu}(x) + I_{i mu}(x))    Kimu(mu,x) = K_{i mu}(x)
+//  These used to come only from csv files written by ImaginaryBessel.wls and were read back as the nearest bin
+//  of a TH2.  Here they are a flat grid with bicubic interpolation, which can be loaded from those same csv files
+//  or generated on the spot from the exact functions below, so no Mathematica run is needed.
+//
+//  The generated tables are uniform in log(x) rather than x:  for x<mu both functions oscillate like cos(mu*log(x)),
+//  so a grid uniform in x would need to be very fine at small x to follow them.
+//
+
+#include <vector>
+#include <string>
+
+class ImaginaryBesselTable{
+ public:
+  enum Kind {L,K};
+
+  ImaginaryBesselTable(Kind kind, const char *csvfile); //load a table written by ImaginaryBessel.wls.  Check Loaded() afterwards.
+  ImaginaryBesselTable(Kind kind, int nmu, double mumin, double mumax, int nx, double xmin, double xmax); //generate one.
+
+  bool Loaded() const {return (int)f.size()==nu*nv && nu>1 && nv>1;};
+  bool Covers(double mulow, double muhigh, double xlow, double xhigh) const; //whether the grid reaches over all of [mulow,muhigh]x[xlow,xhigh].
+  double Eval(double mu, double x) const; //prints and asserts if (mu,x) is off the table.
+  void Eval(int n, const double *mu, const double *x, double *out) const; //n points at once, clamped to the table.  check Covers first.
+
+  //exact values, from the power series of I_{i mu}(x) or (for K at large x) the integral representation of K_{i mu}(x).
+  static double ExactLimu(double mu, double x);
+  static double ExactKimu(double mu, double x);
+
+  Kind kind;
+  std::string source; //the csv file the table came from, or "generated".
+  bool logx; //whether the second axis is log(x) (generated tables) or x (csv tables).
+  double mumin, mumax, xmin, xmax; //the range the grid covers.
+  int nu, nv; //number of grid points in mu and in x (or log x).
+  double u0, du, v0, dv; //first grid point and spacing on each axis.
+  std::vector<double> f; //f[i*nv+j] is the value at (u0+i*du, v0+j*dv).
+};
+
+#endif /* __IMAGINARYBESSEL_H__ */
@@ -0,0 +1,58 @@
+#ifndef __PACKEDVECTOR3_H__
+#define __PACKEDVECTOR3_H__
+
+//
+//  A bare 3-vector for the big field and lookup arrays in AnnularFieldSim.
+//  TVector3 carries a vtable pointer and the TObject bookkeeping, so a MultiArray<TVector3> spends 40 bytes
+//  per element on 24 bytes of data, and can't be filled with memcpy or used straight out of a file.
+//  PackedVector3 is just the three components.  It converts to and from TVector3 only explicitly, with
+//  TVector3(field->Get(...)) or field->Set(...,PackedVector3D(v)), so the sums over these arrays stay in
+//  PackedVector3 and only build a TVector3 once, for the result they hand back.
+//
+//  Since neither conversion is implicit, a mixed expression like TVector3+PackedVector3 doesn't compile,
+//  rather than quietly building a TVector3 for every element of a loop.
+//
+
+#include "TVector3.h"
+#include <cmath>
+
+template <class T> struct PackedVector3{
+  T x,y,z;
+
+  PackedVector3()=default; //left uninitialized (and trivial), like the raw MultiArray storage it lives in.
+  PackedVector3(T a, T b, T c):x(a),y(b),z(c){};
+  explicit PackedVector3(const TVector3 &v):x(v.X()),y(v.Y()),z(v.Z()){};
+  explicit operator TVector3() const {return TVector3(x,y,z);};
+
+  T X() const {return x;};
+  T Y() const {return y;};
+  T Z() const {return z;};
+  void SetXYZ(T a, T b, T c){x=a;y=b;z=c;return;};
+  double Mag2() const {return (double)x*x+(double)y*y+(double)z*z;};
+  double Mag() const {return std::sqrt(Mag2());};
+
+  void RotateZ(double angle){
+    //same arithmetic as TVector3::RotateZ, so results don't depend on which one did the rotating.
+    double s=std::sin(angle);
+    double c=std::cos(angle);
+    double xx=x;
+    x=c*xx-s*y;
+    y=s*xx+c*y;
+    return;
+  };
+
+  PackedVector3 &operator+=(const PackedVector3 &v){x+=v.x;y+=v.y;z+=v.z;return *this;};
+  PackedVector3 &operator-=(const PackedVector3 &v){x-=v.x;y-=v.y;z-=v.z;return *this;};
+  PackedVector3 &operator*=(double a){x*=a;y*=a;z*=a;return *this;};
+};
+
+template <class T> PackedVector3<T> operator+(PackedVector3<T> a, const PackedVector3<T> &b){return a+=b;}
+template <class T> PackedVector3<T> operator-(PackedVector3<T> a, const PackedVector3<T> &b){return a-=b;}
+//scaling always gives a double vector, so a single precision element times a charge doesn't get rounded back to float.
+template <class T> PackedVector3<double> operator*(const PackedVector3<T> &a, double s){return PackedVector3<double>(a.x*s,a.y*s,a.z*s);}
+template <class T> PackedVector3<double> operator*(double s, const PackedVector3<T> &a){return a*s;}
+
+typedef PackedVector3<double> PackedVector3D;
+typedef PackedVector3<float> PackedVector3F;
+
+#endif /* __PACKEDVECTOR3_H__ */
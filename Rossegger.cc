@@ -7,12 +7,20 @@
 #include "TFile.h"
 #include <string>
 #include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <algorithm>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/stat.h>
 
 //#include "/usr/local/include/complex_bessel.h"
 #include <boost/math/special_functions.hpp> //covers all the special functions.
 
-#include "TH2D.h"
-#include "TH3.h"
+#include "ImaginaryBessel.h"
+#include "CacheFile.h"
 
 using namespace std;
 using namespace TMath;
@@ -33,8 +41,106 @@ using namespace TMath;
   This is a modified/renamed copy of Carlos and Tom's "Spacecharge" class, modified to use boost instead of fortran routines, and with phi terms added.
  */
 
+//bump this whenever the way the zero tables are found or stored changes, so old cache files are ignored.
+#define ZERO_CACHE_VERSION 1
+
+struct ZeroCacheHeader{
+  char magic[8];
+  int32_t version;
+  int32_t orders;
+  uint64_t key; //ZeroCacheKey() of the object that wrote the file.
+  uint64_t checksum; //hash of the four tables, to catch truncated or corrupted files.
+};
+static const char zeroCacheMagic[8]={'R','S','G','Z','E','R','O','\0'};
+
+
+//bump this whenever the layout of the tabulated green's function files changes.
+#define GREENS_TABLE_VERSION 1
+
+struct GreensTableHeader{
+  char magic[8];
+  int32_t version;
+  int32_t orders; //of the series the table was summed from.
+  double a,b,L;
+  int32_t nr,nz,nphi;
+  int32_t spare;
+  double r0,dr,z0,dz,dphi; //the grid:  r=r0+i*dr, z=z0+j*dz, |phi-phi1|=k*dphi.
+  uint64_t checksum; //hash of the three tables, in the order Er, Ephi, Ez.
+};
+static const char greensTableMagic[8]={'R','S','G','T','A','B','L','\0'};
+
+Rossegger::Rossegger(std::string filename)
+{
+  //everything comes from the file.  none of the series machinery (zeros, Bessel tables, grids) is set up.
+  fByFile=true;
+  verbosity=0;
+  pi = 2.0 * asin(1.0);
+  gridNr=gridNz=gridNphi=0;
+  tolerance=0;
+  ResetTermStats();
+  limuTable=kimuTable=0;
+
+  FILE *in=fopen(filename.c_str(),"rb");
+  if (in==0){
+    printf("Rossegger: could not open green's function table %s\n",filename.c_str());
+    assert(1==2);
+  }
+  GreensTableHeader header;
+  bool ok=(fread(&header,sizeof(header),1,in)==1)
+    && memcmp(header.magic,greensTableMagic,sizeof(greensTableMagic))==0
+    && header.version==GREENS_TABLE_VERSION
+    && header.nr>=2 && header.nz>=2 && header.nphi>=2;
+  if (ok){
+    size_t n=(size_t)header.nr*header.nz*header.nr*header.nz*header.nphi;
+    tableEr.resize(n);
+    tableEphi.resize(n);
+    tableEz.resize(n);
+    ok=(fread(&tableEr[0],sizeof(float),n,in)==n)
+      && (fread(&tableEphi[0],sizeof(float),n,in)==n)
+      && (fread(&tableEz[0],sizeof(float),n,in)==n);
+    char extra;
+    ok=ok && (fread(&extra,1,1,in)==0); //nothing should follow the tables.
+    if (ok){
+      uint64_t h=cache_file_hash(&tableEr[0],n*sizeof(float));
+      h=cache_file_hash(&tableEphi[0],n*sizeof(float),h);
+      h=cache_file_hash(&tableEz[0],n*sizeof(float),h);
+      ok=(h==header.checksum);
+    }
+  }
+  fclose(in);
+  if (!ok){
+    printf("Rossegger: %s is not a version %d green's function table, or is truncated or corrupt.\n",filename.c_str(),GREENS_TABLE_VERSION);
+    assert(1==2);
+  }
+  a=header.a;
+  b=header.b;
+  L=header.L;
+  tableNr=header.nr;
+  tableNz=header.nz;
+  tableNphi=header.nphi;
+  tableR0=header.r0;
+  tableDr=header.dr;
+  tableZ0=header.z0;
+  tableDz=header.dz;
+  tableDphi=header.dphi;
+  tableChecksum=header.checksum;
+
+  cout << "Rossegger object loaded from " << filename << " as follows:" << endl;
+  cout << "  Inner Radius = " << a << " cm." << endl;
+  cout << "  Outer Radius = " << b << " cm." << endl;
+  cout << "  Half  Length = " << L << " cm." << endl;
+  cout << "  Table = " << tableNr << "x" << tableNz << " (r,z) points from (" << tableR0 << "," << tableZ0 << ") in steps of (" << tableDr << "," << tableDz << "),"
+       << endl << "          " << tableNphi << " phi separations in steps of " << tableDphi << ", from " << header.orders << " orders." << endl;
+  return;
+}
+
+Rossegger::~Rossegger(){
+  //the file mode never makes the Bessel tables, and leaves these 0.
+  delete limuTable;
+  delete kimuTable;
+}
 
-Rossegger::Rossegger(double InnerRadius, double OuterRadius, double Rdo_Z)
+Rossegger::Rossegger(double InnerRadius, double OuterRadius, double Rdo_Z, std::string cacheDir)
 {
   a = InnerRadius;
   b = OuterRadius;
@@ -42,57 +148,46 @@ Rossegger::Rossegger(double InnerRadius, double OuterRadius, double Rdo_Z)
 
   verbosity =0;
   pi = 2.0 * asin(1.0);
+  fByFile=false;
+  tableNr=tableNz=tableNphi=0;
+  tableR0=tableDr=tableZ0=tableDz=tableDphi=0;
+  tableChecksum=0;
+  gridNr=gridNz=gridNphi=0; //no precomputed grid until someone asks for one.
+  tolerance=0; //sum every order unless asked otherwise.
+  ResetTermStats();
   cout << pi << endl;
 
  
-  char limufile[]="limu_table.csv";
-  char kimufile[]="kimu_table.csv";
-  LoadCsvToHist(&hLimu,limufile);
-  LoadCsvToHist(&hKimu,kimufile);
-  cout << "hKimu is real, see:" <<  hKimu->GetXaxis()->GetNbins() << endl;
-  FindMunk(0.01);
-  FindBetamn(0.0001);
+  LoadImaginaryBesselTables();
+  if (!LoadZeroCache(cacheDir)){
+    //the zeros are ~2 (Munk) and ~4 (Betamn*b) apart, so these scan steps can't jump over one.
+    FindMunk(0.01,1e-10);
+    FindBetamn(0.01,1e-12);
+    SaveZeroCache(cacheDir);
+  }
  
 
   cout << "Rossegger object initialized as follows:" << endl;
   cout << "  Inner Radius = " << a << " cm." << endl;
   cout << "  Outer Radius = " << b << " cm." << endl;
   cout << "  Half  Length = " << L << " cm." << endl;
-  cout << "  Limu Dataset = " << limufile << endl;
+  cout << "  Limu Dataset = " << limuTable->source << endl;
 
   return ;
 }
 
-double Rossegger::FindNextZero(double xstart,double epsilon,int order, double (Rossegger::*func)(int, double)){
-    
-  double previous=(this->*func)(order,xstart);
-  double x=xstart+epsilon;
-  double value=previous;
-	 
-  while (! (  (value == 0) || (value<0 && previous>0) || (value>0 && previous<0)) ){
-    	  //  Rossegger equation 5.12
-    value = (this->*func)(order, x);
-    if (value == 0) cout << "hit it exactly!  Go buy a lottery ticket!" << endl;
-    if ( (value == 0) || (value<0 && previous>0) || (value>0 && previous<0))
-      {
-	//when we go from one sign to the other, we have bracketed the zero
-	//the following is mathematically equivalent to finding the delta
-	//between the x of our previous value and the point where we cross the axis
-	//then returning x0=x_old+delta
-	double slope = (value-previous)/epsilon;
-	double intercept =  value - slope*x;
-	double x0  = -intercept/slope;
-	if (verbosity>1) cout << " " << x0 << "," << endl;
-	double n0=  (this->*func)(order, x-epsilon);
-	double n1= (this->*func)(order, x+epsilon);
-	if ((n0<0 && n1<0)||(n0>0 && n1>0)){
-	  printf("neighbors on both sides have the same sign.  Check your function resolution!\n");
-	}
- 
-	return x0;
-      }
-    previous = value;
-    x+=epsilon;
+double Rossegger::FindNextZero(double xstart, double step, double epsilon, int order, double (Rossegger::*func)(int, double) const){
+  //walk up from xstart in 'step' until func changes sign, then pin down the zero inside that bracket.
+  //the walk only has to bracket the zero, so 'step' just needs to be smaller than the spacing between zeroes, not the resolution we want.
+  double x=xstart;
+  double value=(this->*func)(order,x);
+  for (long i=0;i<100000000;i++){
+    if (value == 0) return x;
+    double next=(this->*func)(order,x+step);
+    if ((value<0 && next>0) || (value>0 && next<0))
+      return BrentZero(x,x+step,value,next,epsilon,order,func);
+    x+=step;
+    value=next;
   }
   cout <<"logic break!\n";
   assert(1==2);
@@ -100,20 +195,77 @@ double Rossegger::FindNextZero(double xstart,double epsilon,int order, double (R
 
 }
 
+double Rossegger::BrentZero(double x0, double x1, double f0, double f1, double epsilon, int order, double (Rossegger::*func)(int, double) const){
+  //Brent's method:  inverse quadratic interpolation where it behaves, bisection where it doesn't, so it converges
+  //quickly but can never leave the bracket.  Returns once the bracket is narrower than epsilon.
+  double xa=x0, fa=f0, xb=x1, fb=f1;
+  double xc=xa, fc=fa;
+  double d=xb-xa, e=d;
+  for (int iter=0;iter<200;iter++){
+    if ((fb>0 && fc>0) || (fb<0 && fc<0)){
+      //keep xb and xc on opposite sides of the zero.
+      xc=xa; fc=fa;
+      d=e=xb-xa;
+    }
+    if (fabs(fc)<fabs(fb)){
+      //make xb the best guess so far.
+      xa=xb; xb=xc; xc=xa;
+      fa=fb; fb=fc; fc=fa;
+    }
+    double tol=2*DBL_EPSILON*fabs(xb)+0.5*epsilon;
+    double xm=0.5*(xc-xb);
+    if (fabs(xm)<=tol || fb==0) return xb;
+    if (fabs(e)>=tol && fabs(fa)>fabs(fb)){
+      //try interpolating:  secant if we only have two points, inverse quadratic if we have three.
+      double s=fb/fa;
+      double p,q;
+      if (xa==xc){
+	p=2*xm*s;
+	q=1-s;
+      } else {
+	double qa=fa/fc;
+	double r=fb/fc;
+	p=s*(2*xm*qa*(qa-r)-(xb-xa)*(r-1));
+	q=(qa-1)*(r-1)*(s-1);
+      }
+      if (p>0) q=-q;
+      p=fabs(p);
+      double min1=3*xm*q-fabs(tol*q);
+      double min2=fabs(e*q);
+      if (2*p<((min1<min2)?min1:min2)){
+	e=d; //interpolation is behaving.
+	d=p/q;
+      } else {
+	d=xm; //it isn't, so bisect.
+	e=d;
+      }
+    } else {
+      d=xm;
+      e=d;
+    }
+    xa=xb;
+    fa=fb;
+    xb+=(fabs(d)>tol)?d:((xm>0)?tol:-tol);
+    fb=(this->*func)(order,xb);
+  }
+  printf("Rossegger::BrentZero did not converge in [%E,%E].  Returning best guess %E\n",x0,x1,xb);
+  return xb;
+}
+
 
   
-void Rossegger::FindBetamn(double epsilon)
+void Rossegger::FindBetamn(double step, double epsilon)
 {
   cout << "Now filling the Beta[m][n] Array..."<<endl;
   for (int m=0; m<NumberOfOrders; m++)
     {
       if (verbosity) cout << "Filling Beta["<<m<<"][n]..." << endl;
 
-      double x=epsilon;
+      double x=step;
       for (int n=0;n<NumberOfOrders;n++){//  !!!  Off by one from Rossegger convention  !!!
-	x=FindNextZero(x,epsilon,m,&Rossegger::Rmn_for_zeroes);
+	x=FindNextZero(x,step,epsilon,m,&Rossegger::Rmn_for_zeroes);
 	Betamn[m][n]=x/b;
-	x+=epsilon;
+	x+=step;
       }
      }
 
@@ -148,7 +300,7 @@ void Rossegger::FindBetamn(double epsilon)
 }
 
 
-void Rossegger::FindMunk(double epsilon)
+void Rossegger::FindMunk(double step, double epsilon)
 {
   cout << "Now filling the Mu[n][k] Array..."<<endl;
   // We're looking for the zeroes of Rossegger eqn. 5.46:
@@ -159,18 +311,18 @@ void Rossegger::FindMunk(double epsilon)
   for (int n=0; n<NumberOfOrders; n++)//  !!!  Off by one from Rossegger convention  !!!
     {
       if (verbosity) cout << "Filling Mu["<<n<<"][k]..." << endl;
-      double x=epsilon;
+      double x=step;
       for (int k=0;k<NumberOfOrders;k++){
-	x=FindNextZero(x,epsilon,n,&Rossegger::Rnk_for_zeroes);
+	x=FindNextZero(x,step,epsilon,n,&Rossegger::Rnk_for_zeroes);
 	Munk[n][k]=x;
-	x+=epsilon;
 	if (verbosity>0) {
 	  printf("Mu[%d][%d]=%E\n",n,k,Munk[n][k]);	  
-	  printf("adjacent values are Rnk[mu-epsilon]=%E\tRnk[mu+epsilon]=%E\n",
-		 Rnk_for_zeroes(n,x-epsilon),Rnk_for_zeroes(n,x+epsilon));
+	  printf("adjacent values are Rnk[mu-step]=%E\tRnk[mu+step]=%E\n",
+		 Rnk_for_zeroes(n,x-step),Rnk_for_zeroes(n,x+step));
 	  printf("values of argument to limu and kimu are %f and %f\n",
 		 (n+1)*pi/L*a,(n+1)*pi/L*b);
 	}
+	x+=step;
       }
     }
 
@@ -182,12 +334,27 @@ void Rossegger::FindMunk(double epsilon)
 	  //  Rossegger Equation 5.48
 	  //  Integral of R_nk(r)*R_ns(r) dr/r= delta_ks*N2nk
 	  //  note that unlike N2mn, there is no convenient shortcut here.
+	  //this is Rnk(n,k,r) at every r, with the table lookups done in two batches.
 	  double integral=0.0;
 	  double step = 0.01;
-
-	      for (double r=a; r<b; r+=step){
-		integral += Rnk(n,k,r)*Rnk(n,k,r)/r*step;
-	      }
+	  double BetaN=(n+1)*pi/L;
+	  std::vector<double> r,x,mu,lr,kr;
+	  for (double ri=a; ri<b; ri+=step){
+	    r.push_back(ri);
+	    x.push_back(BetaN*ri);
+	  }
+	  int nr=r.size();
+	  mu.assign(nr,Munk[n][k]);
+	  lr.resize(nr);
+	  kr.resize(nr);
+	  Limu(nr,&mu[0],&x[0],&lr[0]);
+	  Kimu(nr,&mu[0],&x[0],&kr[0]);
+	  double la=limu(Munk[n][k],BetaN*a);
+	  double ka=kimu(Munk[n][k],BetaN*a);
+	  for (int i=0;i<nr;i++){
+	    double R=la*kr[i]-ka*lr[i];
+	    integral += R*R/r[i]*step;
+	  }
 	  if (verbosity>1)
 	    {	      cout << " Int: " << integral << endl;
 	    }
@@ -203,68 +370,171 @@ void Rossegger::FindMunk(double epsilon)
   return;
 }
 
- double Rossegger::Limu(double mu, double x){
-   //defined in Rossegger eqn 5.44, also a canonical 'satisfactory companion' to Kimu.
-   //could use Griddit?
-   if (verbosity>1) {
-     printf("Limu::mu=%f,x=%f\n",mu,x);
-     printf("limu axis bounds= mu:(%f to %f) x:(%f to %f)\n",
-	    hLimu->GetXaxis()->GetXmin(),hLimu->GetXaxis()->GetXmax(),
-	    hLimu->GetYaxis()->GetXmin(),hLimu->GetYaxis()->GetXmax());
-   }
-   int xbin=hLimu->GetXaxis()->FindBin(mu);
-
-   if (xbin<1 || xbin>hLimu->GetXaxis()->GetNbins()) {
-     printf("Limu::mu=%f,x=%f is out of bounds\n",mu,x);
-     printf("Limu axis bounds= mu:(%f to %f) x:(%f to %f)\n",
-	    hLimu->GetXaxis()->GetXmin(),hLimu->GetXaxis()->GetXmax(),
-	    hLimu->GetYaxis()->GetXmin(),hLimu->GetYaxis()->GetXmax());
-     assert(1==3);
-   }
-   int ybin=hLimu->GetYaxis()->FindBin(x);
-   if (ybin<1 || ybin>hLimu->GetYaxis()->GetNbins()) {
-     printf("Limu::mu=%f,x=%f is out of bounds\n",mu,x);
-     printf("Limu axis bounds= mu:(%f to %f) x:(%f to %f)\n",
-	    hLimu->GetXaxis()->GetXmin(),hLimu->GetXaxis()->GetXmax(),
-	    hLimu->GetYaxis()->GetXmin(),hLimu->GetYaxis()->GetXmax());
-     assert(1==3);
-   }
-
-   return hLimu->GetBinContent(xbin,ybin); //this should really be interpolating, but we'll deal with that later.
- }
- double Rossegger::Kimu(double mu, double x){
-   //could use Griddit?
-   if (verbosity>1) {
-     printf("Kimu::mu=%f,x=%f\n",mu,x);
-   }
-   int xbin=hKimu->GetXaxis()->FindBin(mu);
-   if (verbosity>1) {
-	printf("Kimu:: ybin=%d\n",xbin);
-   }
-   if (xbin<1 || xbin>hKimu->GetXaxis()->GetNbins()) {
-     printf("Kimu::mu=%f,x=%f is out of bounds\n",mu,x);
-     printf("Kimu axis bounds= mu:(%f to %f) x:(%f to %f)\n",
-	    hKimu->GetXaxis()->GetXmin(),hKimu->GetXaxis()->GetXmax(),
-	    hKimu->GetYaxis()->GetXmin(),hKimu->GetYaxis()->GetXmax());
-     assert(1==3);
-   }
-   int ybin=hKimu->GetYaxis()->FindBin(x);
-   if (ybin<1 || ybin>hKimu->GetYaxis()->GetNbins()) {
-     printf("Kimu::mu=%f,x=%f is out of bounds\n",mu,x);
-     printf("Kimu axis bounds= mu:(%f to %f) x:(%f to %f)\n",
-	    hKimu->GetXaxis()->GetXmin(),hKimu->GetXaxis()->GetXmax(),
-	    hKimu->GetYaxis()->GetXmin(),hKimu->GetYaxis()->GetXmax());
-     assert(1==3);
-   }
-   return hKimu->GetBinContent(xbin,ybin); //this should really be interpolating, but we'll deal with that later.
- }
+unsigned long long Rossegger::ZeroCacheKey() const{
+  //everything the four tables depend on:  the geometry, the number of orders, and (for Munk and N2nk) the Limu/Kimu tables themselves.
+  uint64_t h=cache_file_hash(zeroCacheMagic,sizeof(zeroCacheMagic));
+  int ints[]={ZERO_CACHE_VERSION,NumberOfOrders};
+  h=cache_file_hash(ints,sizeof(ints),h);
+  double geom[]={a,b,L};
+  h=cache_file_hash(geom,sizeof(geom),h);
+  const ImaginaryBesselTable *tables[]={limuTable,kimuTable};
+  for (int t=0;t<2;t++){
+    int grid[]={tables[t]->logx?1:0,tables[t]->nu,tables[t]->nv};
+    h=cache_file_hash(grid,sizeof(grid),h);
+    double bounds[]={tables[t]->u0,tables[t]->du,tables[t]->v0,tables[t]->dv};
+    h=cache_file_hash(bounds,sizeof(bounds),h);
+    h=cache_file_hash(&(tables[t]->f[0]),tables[t]->f.size()*sizeof(double),h);
+  }
+  return h;
+}
+
+std::string Rossegger::ZeroCacheFilename(std::string cacheDir) const{
+  char keystring[32];
+  snprintf(keystring,sizeof(keystring),"%016llx",ZeroCacheKey());
+  return cacheDir+"/rossegger_zeros."+keystring+".bin";
+}
 
- double Rossegger::Rmn_for_zeroes(int m, double x){
+bool Rossegger::LoadZeroCache(std::string cacheDir){
+  //returns true if Betamn, N2mn, Munk and N2nk were all filled from a valid cache file.
+  if (cacheDir.empty()) return false;
+  std::string filename=ZeroCacheFilename(cacheDir);
+  FILE *in=fopen(filename.c_str(),"rb");
+  if (in==0){
+    printf("Rossegger::LoadZeroCache: no cached zeros at %s.  Will find them.\n",filename.c_str());
+    return false;
+  }
+  const int N=NumberOfOrders;
+  ZeroCacheHeader header;
+  double tables[4][NumberOfOrders][NumberOfOrders];
+  bool ok=(fread(&header,sizeof(header),1,in)==1);
+  ok=ok && (fread(tables,sizeof(tables),1,in)==1);
+  char extra;
+  ok=ok && (fread(&extra,1,1,in)==0); //nothing should follow the tables.
+  fclose(in);
+  ok=ok && memcmp(header.magic,zeroCacheMagic,sizeof(zeroCacheMagic))==0
+    && header.version==ZERO_CACHE_VERSION
+    && header.orders==N
+    && header.key==ZeroCacheKey()
+    && header.checksum==cache_file_hash(tables,sizeof(tables));
+  if (!ok){
+    printf("Rossegger::LoadZeroCache: %s is stale or corrupt.  Will find the zeros again.\n",filename.c_str());
+    return false;
+  }
+  memcpy(Betamn,tables[0],sizeof(Betamn));
+  memcpy(N2mn,tables[1],sizeof(N2mn));
+  memcpy(Munk,tables[2],sizeof(Munk));
+  memcpy(N2nk,tables[3],sizeof(N2nk));
+  printf("Rossegger::LoadZeroCache: loaded Betamn, N2mn, Munk and N2nk from %s\n",filename.c_str());
+  return true;
+}
+
+void Rossegger::SaveZeroCache(std::string cacheDir){
+  if (cacheDir.empty()) return;
+  mkdir(cacheDir.c_str(),0755); //harmless if it already exists.
+  std::string filename=ZeroCacheFilename(cacheDir);
+
+  double tables[4][NumberOfOrders][NumberOfOrders];
+  memcpy(tables[0],Betamn,sizeof(Betamn));
+  memcpy(tables[1],N2mn,sizeof(N2mn));
+  memcpy(tables[2],Munk,sizeof(Munk));
+  memcpy(tables[3],N2nk,sizeof(N2nk));
+  ZeroCacheHeader header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,zeroCacheMagic,sizeof(zeroCacheMagic));
+  header.version=ZERO_CACHE_VERSION;
+  header.orders=NumberOfOrders;
+  header.key=ZeroCacheKey();
+  header.checksum=cache_file_hash(tables,sizeof(tables));
+
+  bool ok=write_cache_file(filename,[&](FILE *out){
+      return fwrite(&header,sizeof(header),1,out)==1
+	&& fwrite(tables,sizeof(tables),1,out)==1;
+    });
+  if (!ok){
+    printf("Rossegger::SaveZeroCache: failed writing %s.  Not caching the zeros.\n",filename.c_str());
+    return;
+  }
+  printf("Rossegger::SaveZeroCache: saved the zero tables to %s\n",filename.c_str());
+  return;
+}
+
+void Rossegger::LoadImaginaryBesselTables(){
+  //the tables have to cover every mu up to the last Munk we look for, and x=BetaN*r for every order n and a<=r<=b.
+  double mumax=MunkUpperBound();
+  double xlow=pi/L*a;
+  double xhigh=NumberOfOrders*pi/L*b;
+
+  char limufile[]="limu_table.csv";
+  char kimufile[]="kimu_table.csv";
+  limuTable=new ImaginaryBesselTable(ImaginaryBesselTable::L,limufile);
+  kimuTable=new ImaginaryBesselTable(ImaginaryBesselTable::K,kimufile);
+  bool limuOkay=limuTable->Covers(0,mumax,xlow,xhigh);
+  bool kimuOkay=kimuTable->Covers(0,mumax,xlow,xhigh);
+  if (limuOkay && kimuOkay) return;
+  if (limuTable->Loaded() || kimuTable->Loaded()){
+    printf("Rossegger::LoadImaginaryBesselTables: the csv tables don't cover mu:(0 to %f) x:(%f to %f).  limu covers mu:(%f to %f) x:(%f to %f), kimu covers mu:(%f to %f) x:(%f to %f).  Generating new ones instead.\n",
+	   mumax,xlow,xhigh,
+	   limuTable->mumin,limuTable->mumax,limuTable->xmin,limuTable->xmax,
+	   kimuTable->mumin,kimuTable->mumax,kimuTable->xmin,kimuTable->xmax);
+  }
+  delete limuTable;
+  delete kimuTable;
+
+  //no usable csv tables, so make our own, covering the x=BetaN*r and mu we will ask for with a little room to spare.
+  //both functions go like cos(mu*log(x)) below x~mu, so the log(x) spacing has to shrink as mu grows.
+  double xmin=0.9*xlow;
+  double xmax=1.1*xhigh;
+  int nmu=(int)(mumax/0.05)+1;
+  int nx=(int)(log(xmax/xmin)/(0.25/mumax))+1;
+  limuTable=new ImaginaryBesselTable(ImaginaryBesselTable::L,nmu,0,mumax,nx,xmin,xmax);
+  kimuTable=new ImaginaryBesselTable(ImaginaryBesselTable::K,nmu,0,mumax,nx,xmin,xmax);
+  return;
+}
+
+double Rossegger::MunkUpperBound() const{
+  //Rnk(mu) changes sign roughly once per pi of the WKB phase  int_{BetaN a}^{BetaN b} sqrt(mu^2-x^2)/x dx,
+  //which grows with BetaN, so the largest n needs the largest mu.  Find where that phase passes NumberOfOrders+1 zeros, plus a margin.
+  double BetaN=NumberOfOrders*pi/L;
+  double mu=0;
+  double phase=0;
+  while (phase<(NumberOfOrders+1)*pi){
+    mu+=0.1;
+    phase=0;
+    const int nsteps=1000;
+    double dx=(b-a)*BetaN/nsteps;
+    for (int i=0;i<nsteps;i++){
+      double x=BetaN*a+(i+0.5)*dx;
+      if (x<mu) phase+=sqrt(mu*mu-x*x)/x*dx;
+    }
+  }
+  return mu+2;
+}
+
+double Rossegger::Limu(double mu, double x) const{
+  //defined in Rossegger eqn 5.44, also a canonical 'satisfactory companion' to Kimu.
+  return limuTable->Eval(mu,x);
+}
+
+double Rossegger::Kimu(double mu, double x) const{
+  return kimuTable->Eval(mu,x);
+}
+
+void Rossegger::Limu(int n, const double *mu, const double *x, double *out) const{
+  limuTable->Eval(n,mu,x,out);
+  return;
+}
+
+void Rossegger::Kimu(int n, const double *mu, const double *x, double *out) const{
+  kimuTable->Eval(n,mu,x,out);
+  return;
+}
+
+double Rossegger::Rmn_for_zeroes(int m, double x) const{
    double lx = a*x/b;
    return jn(m,x)*yn(m,lx) - jn(m,lx)*yn(m,x);
  }
 
-double Rossegger::Rmn(int m, int n, double r){
+double Rossegger::Rmn(int m, int n, double r) const{
   if (verbosity>1) cout << "Determine Rmn("<<m<<","<<n<<","<<r<<") = ";
 
   //  Check input arguments for sanity...
@@ -288,7 +558,7 @@ double Rossegger::Rmn(int m, int n, double r){
   return R;
 }
 
-double Rossegger::Rmn1(int m, int n, double r)
+double Rossegger::Rmn1(int m, int n, double r) const
 {
  //  Check input arguments for sanity...
   int error=0;
@@ -311,7 +581,7 @@ double Rossegger::Rmn1(int m, int n, double r)
   return R;
 }
 
-double Rossegger::Rmn2(int m, int n, double r)
+double Rossegger::Rmn2(int m, int n, double r) const
 {
  //  Check input arguments for sanity...
   int error=0;
@@ -334,7 +604,7 @@ double Rossegger::Rmn2(int m, int n, double r)
   return R;
 }
 
-double Rossegger::RPrime(int m, int n, double ref, double r)
+double Rossegger::RPrime(int m, int n, double ref, double r) const
 {
  //  Check input arguments for sanity...
   int error=0;
@@ -366,7 +636,7 @@ double Rossegger::RPrime(int m, int n, double ref, double r)
   return R;
 }
 
-double Rossegger::Rnk_for_zeroes(int n, double mu){
+double Rossegger::Rnk_for_zeroes(int n, double mu) const{
   //unlike Rossegger, we count 'k' and 'n' from zero.
   if (verbosity>1) printf("Rnk_for_zeroes called with n=%d,mu=%f\n",n,mu);
   double BetaN=(n+1)*pi/L;
@@ -375,7 +645,7 @@ double Rossegger::Rnk_for_zeroes(int n, double mu){
   
   return limu(mu,BetaN*a)*kimu(mu,BetaN*b)- kimu(mu,BetaN*a)*limu(mu,BetaN*b);
 }
-double Rossegger::Rnk(int n, int k, double r)
+double Rossegger::Rnk(int n, int k, double r) const
 {
  //  Check input arguments for sanity...
   int error=0;
@@ -396,9 +666,481 @@ double Rossegger::Rnk(int n, int k, double r)
 }
 
 
-double Rossegger::Ez(double r, double phi, double z, double r1, double phi1, double z1)
+void Rossegger::SaveGreensTable(std::string filename, int nr, int nz, int nphi, bool cellCenters){
+  if (fByFile){
+    printf("Rossegger::SaveGreensTable: this object was itself loaded from a table.  Make one from the geometry to generate a new table.\n");
+    return;
+  }
+  if (nr<2 || nz<2 || nphi<2){
+    printf("Rossegger::SaveGreensTable: need at least two points (or cells) on each axis, got nr=%d nz=%d nphi=%d\n",nr,nz,nphi);
+    return;
+  }
+  double r0, dr, z0, dz, dphi;
+  if (cellCenters){
+    dr=(b-a)/nr;
+    r0=a+0.5*dr;
+    dz=L/nz;
+    z0=0.5*dz;
+    dphi=2*pi/nphi;
+    nphi=nphi/2+1; //separations of up to half way round are all we need.
+  } else {
+    r0=a;
+    dr=(b-a)/(nr-1);
+    z0=0;
+    dz=L/(nz-1);
+    dphi=pi/(nphi-1);
+  }
+  //the batch evaluation does the work, so tabulate the series on exactly our grid.  this replaces any grid precomputed before.
+  PrecomputeGrid(nr,r0,dr,nz,z0,dz,nphi,dphi);
+
+  //every field point sees the same sources.  the field point sits at phi=pi, and the sources at phi=pi-dphi, so phi-phi1>=0.
+  //the min()s keep the last point exactly on the walls rather than a rounding error past them.
+  int nsrc=nr*nz*nphi;
+  std::vector<double> r1(nsrc), phi1(nsrc), z1(nsrc), er(nsrc), ephi(nsrc), ez(nsrc);
+  for (int ir1=0;ir1<nr;ir1++){
+    for (int iz1=0;iz1<nz;iz1++){
+      for (int iphi=0;iphi<nphi;iphi++){
+	int i=(ir1*nz+iz1)*nphi+iphi;
+	r1[i]=std::min(r0+ir1*dr,b);
+	z1[i]=std::min(z0+iz1*dz,L);
+	phi1[i]=std::max(pi-iphi*dphi,0.0);
+      }
+    }
+  }
+  size_t n=(size_t)nr*nz*nsrc;
+  std::vector<float> tEr(n), tEphi(n), tEz(n);
+  for (int ir=0;ir<nr;ir++){
+    printf("Rossegger::SaveGreensTable: r=%d of %d\n",ir,nr);
+    for (int iz=0;iz<nz;iz++){
+      double r=std::min(r0+ir*dr,b);
+      double z=std::min(z0+iz*dz,L);
+      Efield(r,pi,z,nsrc,&r1[0],&phi1[0],&z1[0],&er[0],&ephi[0],&ez[0]);
+      size_t offset=(size_t)(ir*nz+iz)*nsrc;
+      for (int i=0;i<nsrc;i++){
+	tEr[offset+i]=er[i];
+	tEphi[offset+i]=ephi[i];
+	tEz[offset+i]=ez[i];
+      }
+    }
+  }
+
+  GreensTableHeader header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,greensTableMagic,sizeof(greensTableMagic));
+  header.version=GREENS_TABLE_VERSION;
+  header.orders=NumberOfOrders;
+  header.a=a;
+  header.b=b;
+  header.L=L;
+  header.nr=nr;
+  header.nz=nz;
+  header.nphi=nphi;
+  header.r0=r0;
+  header.dr=dr;
+  header.z0=z0;
+  header.dz=dz;
+  header.dphi=dphi;
+  uint64_t h=cache_file_hash(&tEr[0],n*sizeof(float));
+  h=cache_file_hash(&tEphi[0],n*sizeof(float),h);
+  h=cache_file_hash(&tEz[0],n*sizeof(float),h);
+  header.checksum=h;
+
+  bool ok=write_cache_file(filename,[&](FILE *out){
+      return fwrite(&header,sizeof(header),1,out)==1
+	&& fwrite(&tEr[0],sizeof(float),n,out)==n
+	&& fwrite(&tEphi[0],sizeof(float),n,out)==n
+	&& fwrite(&tEz[0],sizeof(float),n,out)==n;
+    });
+  if (!ok){
+    printf("Rossegger::SaveGreensTable: failed writing %s\n",filename.c_str());
+    return;
+  }
+  printf("Rossegger::SaveGreensTable: saved a %dx%dx%dx%dx%d table to %s (%.1f MB)\n",nr,nz,nr,nz,nphi,filename.c_str(),
+	 (sizeof(header)+3*n*sizeof(float))/1048576.0);
+  return;
+}
+
+double Rossegger::FoldPhi(double phi, double phi1, double *sign) const{
+  //Er and Ez are even in phi-phi1 and Ephi is odd, and all three repeat every 2pi, so [0,pi] is all we need to store.
+  double d=fmod(phi-phi1,2*pi);
+  if (d<0) d+=2*pi;
+  *sign=1;
+  if (d>pi){
+    d=2*pi-d;
+    *sign=-1;
+  }
+  return d;
+}
+
+double Rossegger::Interpolate(const std::vector<float> &table, double r, double z, double r1, double z1, double dphi) const{
+  //multilinear in all five coordinates.  positions are clamped to the table, so a cell-centered table holds its edge values
+  //out to the walls.
+  const double pos[5]={(r-tableR0)/tableDr, (z-tableZ0)/tableDz, (r1-tableR0)/tableDr, (z1-tableZ0)/tableDz, dphi/tableDphi};
+  const int n[5]={tableNr, tableNz, tableNr, tableNz, tableNphi};
+  const size_t stride[5]={(size_t)tableNz*tableNr*tableNz*tableNphi, (size_t)tableNr*tableNz*tableNphi,
+			  (size_t)tableNz*tableNphi, (size_t)tableNphi, 1};
+  size_t base=0;
+  double w[5];
+  for (int d=0;d<5;d++){
+    double f=std::min(std::max(pos[d],0.0),n[d]-1.0);
+    int i=std::min((int)f,n[d]-2);
+    w[d]=f-i;
+    base+=i*stride[d];
+  }
+  double sum=0;
+  for (int corner=0;corner<32;corner++){
+    double weight=1;
+    size_t offset=base;
+    for (int d=0;d<5;d++){
+      if (corner&(1<<d)){
+	weight*=w[d];
+	offset+=stride[d];
+      } else {
+	weight*=1-w[d];
+      }
+    }
+    if (weight!=0) sum+=weight*table[offset];
+  }
+  return sum;
+}
+
+void Rossegger::PrecomputeGrid(int nr, double r0, double dr, int nz, double z0, double dz, int nphi, double dphi){
+  //tabulate every position-dependent factor of the Ez, Er and Ephi series on the grid r=r0+i*dr (i<nr), z=z0+j*dz (j<nz).
+  //this costs (orders^2)*(nr+nz) special function calls, once, instead of ~orders^2 of them for every (at,from) pair.
+  if (fByFile){
+    cout << "Rossegger::PrecomputeGrid: this object interpolates a table, so there is no series to precompute." << endl;
+    return;
+  }
+  cout << "Precomputing Rossegger basis functions on a " << nr << "x" << nz << " (r,z) grid..." << endl;
+  gridNr=nr;
+  gridR0=r0;
+  gridDr=dr;
+  gridNz=nz;
+  gridZ0=z0;
+  gridDz=dz;
+
+  const int N=NumberOfOrders;
+  gridRmn.resize(N*N*nr);
+  gridRmn1.resize(N*N*nr);
+  gridRmn2.resize(N*N*nr);
+  gridRPrimeA.resize(N*N*nr);
+  gridRPrimeB.resize(N*N*nr);
+  gridRnk.resize(N*N*nr);
+  gridCoshZ.resize(N*N*nz);
+  gridCoshLZ.resize(N*N*nz);
+  gridSinhZ.resize(N*N*nz);
+  gridSinhLZ.resize(N*N*nz);
+  gridSinBz.resize(N*nz);
+  gridNphi=nphi;
+  gridDphi=dphi;
+  gridSinhPhi.resize(N*N*(nphi>0?nphi:0));
+
+  //the normalizations are folded into the tables that only the source point indexes (r1 or z1), so each term of
+  //the sums is a product of table entries, with no division.
+  for (int m=0;m<N;m++){
+    for (int n=0;n<N;n++){
+      int mn=m*N+n;
+      double BetaN = (n+1)*pi/L;
+      double erDenom=BesselI(m,BetaN*a)*BesselK(m,BetaN*b)-BesselI(m,BetaN*b)*BesselK(m,BetaN*a);
+      for (int i=0;i<nr;i++){
+	double r=r0+i*dr;
+	gridRmn[mn*nr+i]=Rmn(m,n,r);
+	gridRmn1[mn*nr+i]=Rmn1(m,n,r)/erDenom;
+	gridRmn2[mn*nr+i]=Rmn2(m,n,r)/erDenom;
+	gridRPrimeA[mn*nr+i]=RPrime(m,n,a,r);
+	gridRPrimeB[mn*nr+i]=RPrime(m,n,b,r);
+	gridRnk[mn*nr+i]=Rnk(m,n,r); //here m plays the part of Rossegger's n, and n his k.
+      }
+      double sinhBL=sinh(Betamn[m][n]*L);
+      for (int j=0;j<nz;j++){
+	double z=z0+j*dz;
+	gridCoshZ[mn*nz+j]=cosh(Betamn[m][n]*z);
+	gridCoshLZ[mn*nz+j]=cosh(Betamn[m][n]*(L-z));
+	gridSinhZ[mn*nz+j]=sinh(Betamn[m][n]*z)/sinhBL/N2mn[m][n];
+	gridSinhLZ[mn*nz+j]=sinh(Betamn[m][n]*(L-z))/sinhBL/N2mn[m][n];
+      }
+      double sinhMuPi=sinh(pi*Munk[m][n]);
+      for (int i=0;i<nphi;i++)
+	gridSinhPhi[mn*nphi+i]=sinh(Munk[m][n]*(pi-i*dphi))/sinhMuPi/N2nk[m][n]; //m plays the part of Rossegger's n again.
+    }
+  }
+  for (int n=0;n<N;n++){
+    double BetaN = (n+1)*pi/L;
+    for (int j=0;j<nz;j++)
+      gridSinBz[n*nz+j]=sin(BetaN*(z0+j*dz));
+  }
+  cout << "Done." << endl;
+  return;
+}
+
+int Rossegger::GridIndex(double x, double x0, double dx, int n) const{
+  //positions come in as doubles that have been through a few coordinate transformations, so allow a little slop.
+  if (n<=0) return -1;
+  double f=(x-x0)/dx;
+  int i=(int)floor(f+0.5);
+  if (i<0 || i>=n || fabs(f-i)>1e-6) return -1;
+  return i;
+}
+
+bool Rossegger::SameCoordinate(double x, double x1) const{
+  //10nm is the same place as far as a TPC is concerned, and is well clear of the rounding in how callers compute positions.
+  return fabs(x-x1)<1e-6;
+}
+
+bool Rossegger::Converged(double change, double sum, int *nSmall) const{
+  //one small term can be an accident (a node of the cos, say), so we ask for two in a row before calling a sum done.
+  if (tolerance<=0) return false;
+  if (fabs(change)<=tolerance*fabs(sum)) (*nSmall)++;
+  else *nSmall=0;
+  return (*nSmall>=2);
+}
+
+void Rossegger::CountTerms(int nTerms, bool converged, int *nTermsOut) const{
+  if (nTermsOut) *nTermsOut=nTerms;
+  statCalls.fetch_add(1,std::memory_order_relaxed);
+  statTerms.fetch_add(nTerms,std::memory_order_relaxed);
+  if (!converged) statUnconverged.fetch_add(1,std::memory_order_relaxed);
+  return;
+}
+
+void Rossegger::PrintTermStats() const{
+  unsigned long long calls=statCalls.load(), terms=statTerms.load();
+  printf("Rossegger: %llu field calls used %.1f of %d terms on average (tolerance=%g).\n",
+	 calls,calls?(double)terms/calls:0.0,NumberOfOrders*NumberOfOrders,tolerance);
+  if (tolerance>0)
+    printf("Rossegger: %llu of those calls ran out of orders before converging.\n",statUnconverged.load());
+  return;
+}
+
+double Rossegger::EzOnGrid(int ir, double phi, int iz, double z, int ir1, double phi1, int iz1, double z1, int *nTerms, bool *converged) const{
+  //same series as Ez, with the phi sum pulled out of the n sum since it only depends on m.
+  //which z factors we need depends only on which side of the charge we are, so pick the tables before looping.
+  //where z==z1 we take the z>z1 form and add back half the jump, for the midpoint (see SameCoordinate).
+  const int N=NumberOfOrders;
+  const bool same=(iz==iz1);
+  const bool below=(!same && z<z1);
+  const double *zAt=below?&gridCoshZ[iz]:&gridCoshLZ[iz];
+  const double *zFrom=below?&gridSinhLZ[iz1]:&gridSinhZ[iz1];
+  const double zSign=below?1:-1;
+  const double *coshZ=&gridCoshZ[iz], *coshLZ=&gridCoshLZ[iz], *sinhZ=&gridSinhZ[iz1], *sinhLZ=&gridSinhLZ[iz1];
+  double G=0;
+  int nSmallM=0;
+  *nTerms=0;
+  *converged=false;
+  for (int m=0; m<N && !*converged; m++)
+    {
+      double sum=0;
+      int nSmallN=0;
+      for (int n=0; n<N; n++)
+	{
+	  int mn=m*N+n;
+	  double zterm = zSign*zAt[mn*gridNz]*zFrom[mn*gridNz];
+	  if (same) zterm += 0.5*(coshZ[mn*gridNz]*sinhLZ[mn*gridNz] + coshLZ[mn*gridNz]*sinhZ[mn*gridNz]);
+	  double term = gridRmn[mn*gridNr+ir]*gridRmn[mn*gridNr+ir1]*zterm;
+	  sum += term;
+	  (*nTerms)++;
+	  if (Converged(term,sum,&nSmallN)) break;
+	}
+      double mterm = (2 - ((m==0)?1:0))*cos(m*(phi-phi1))*sum;
+      G += mterm;
+      *converged=Converged(mterm,G,&nSmallM);
+    }
+  return G/(2.0*pi);
+}
+
+double Rossegger::ErOnGrid(int ir, double r, double phi, int iz, int ir1, double r1, double phi1, int iz1, int *nTerms, bool *converged) const{
+  //same series as Er, from the tables.
+  const int N=NumberOfOrders;
+  //as in EzOnGrid, where r==r1 we take the r>r1 form and add back half the jump.
+  const bool same=(ir==ir1);
+  const bool inside=(!same && r<r1);
+  const double *rAt=inside?&gridRPrimeA[ir]:&gridRPrimeB[ir];
+  const double *rFrom=inside?&gridRmn2[ir1]:&gridRmn1[ir1];
+  const double *primeA=&gridRPrimeA[ir], *primeB=&gridRPrimeB[ir], *rmn1=&gridRmn1[ir1], *rmn2=&gridRmn2[ir1];
+  double G=0;
+  int nSmallM=0;
+  *nTerms=0;
+  *converged=false;
+  for (int m=0; m<N && !*converged; m++)
+    {
+      double sum=0;
+      int nSmallN=0;
+      for (int n=0; n<N; n++)
+	{
+	  int mn=m*N+n;
+	  double rterm = rAt[mn*gridNr]*rFrom[mn*gridNr];
+	  if (same) rterm += 0.5*(primeA[mn*gridNr]*rmn2[mn*gridNr] - rmn1[mn*gridNr]*primeB[mn*gridNr]);
+	  double term = gridSinBz[n*gridNz+iz]*gridSinBz[n*gridNz+iz1]*rterm;
+	  sum += term;
+	  (*nTerms)++;
+	  if (Converged(term,sum,&nSmallN)) break;
+	}
+      double mterm = (2 - ((m==0)?1:0))*cos(m*(phi-phi1))*sum;
+      G += mterm;
+      *converged=Converged(mterm,G,&nSmallM);
+    }
+  return G/(L*pi);
+}
+
+double Rossegger::EphiOnGrid(int ir, double r, double phi, int iz, int ir1, double phi1, int iz1, int *nTerms, bool *converged) const{
+  //same series as Ephi, from the tables.  If the phi separation is on the grid too, so is the sinh ratio.
+  const int N=NumberOfOrders;
+  double G=0;
+  int nSmallK=0;
+  *nTerms=0;
+  *converged=false;
+  double dphi=phi-phi1;
+  double sign=(dphi<0)?1:-1;
+  int iphi=GridIndex(fabs(dphi),0,gridDphi,gridNphi);
+  if (iphi==0){
+    //same phi plane, give or take rounding, where the sign of each term is a coin flip.  by symmetry the answer is zero.
+    *converged=true;
+    return 0;
+  }
+  for (int k=0; k<N && !*converged; k++)
+    {
+      double Gk=G; //G before this k, so we can tell how much the whole k contributed.
+      int nSmallN=0;
+      for (int n=0; n<N; n++)
+	{
+	  int nk=n*N+k;
+	  double term = gridSinBz[n*gridNz+iz]*gridSinBz[n*gridNz+iz1]*gridRnk[nk*gridNr+ir]*gridRnk[nk*gridNr+ir1];
+	  if (iphi>=0)
+	    {
+	      term *= gridSinhPhi[nk*gridNphi+iphi];
+	    }
+	  else
+	    {
+	      term *= sinh(Munk[n][k]*(pi-fabs(dphi)))/sinh(pi*Munk[n][k])/N2nk[n][k];
+	    }
+	  G += term;
+	  (*nTerms)++;
+	  if (Converged(term,G-Gk,&nSmallN)) break;
+	}
+      *converged=Converged(G-Gk,G,&nSmallK);
+    }
+  return sign*G/(L*r);
+}
+
+
+void Rossegger::Efield(double r, double phi, double z, int n, const double *r1, const double *phi1, const double *z1,
+		       double *er, double *ephi, double *ez) const{
+  const int N=NumberOfOrders;
+  int ir=GridIndex(r,gridR0,gridDr,gridNr);
+  int iz=GridIndex(z,gridZ0,gridDz,gridNz);
+  bool batchable=(tolerance<=0 && !verbosity && gridNphi>0 && ir>=0 && iz>=0 && phi>=0 && phi<=2*pi);
+
+  //sort the sources into ones the tables cover, which we gather into flat index arrays, and ones they don't.
+  std::vector<int> src, jr, jz, jphi, sameZ, sameR;
+  std::vector<char> below, inside;
+  std::vector<double> c1, phiSign;
+  src.reserve(n);
+  for (int i=0;i<n;i++){
+    int ir1=GridIndex(r1[i],gridR0,gridDr,gridNr);
+    int iz1=GridIndex(z1[i],gridZ0,gridDz,gridNz);
+    int iphi=GridIndex(fabs(phi-phi1[i]),0,gridDphi,gridNphi);
+    if (!batchable || ir1<0 || iz1<0 || iphi<0 || phi1[i]<0 || phi1[i]>2*pi){
+      er[i]=Er(r,phi,z,r1[i],phi1[i],z1[i]);
+      ephi[i]=Ephi(r,phi,z,r1[i],phi1[i],z1[i]);
+      ez[i]=Ez(r,phi,z,r1[i],phi1[i],z1[i]);
+      continue;
+    }
+    src.push_back(i);
+    jr.push_back(ir1);
+    jz.push_back(iz1);
+    jphi.push_back(iphi);
+    c1.push_back(cos(phi-phi1[i]));
+    //as in EzOnGrid and ErOnGrid, sources at our z (r) take the other form, then get half the jump added back.
+    if (iz==iz1) sameZ.push_back(src.size()-1);
+    if (ir==ir1) sameR.push_back(src.size()-1);
+    below.push_back(iz!=iz1 && z<z1[i]);
+    inside.push_back(ir!=ir1 && r<r1[i]);
+    phiSign.push_back((iphi==0)?0:((phi<phi1[i])?1:-1)); //same as EphiOnGrid, zero in the source's own phi plane.
+  }
+  int nb=src.size();
+  if (nb==0) return;
+
+  //cos(m*dphi) by the Chebyshev recurrence, one m at a time, instead of a cos per source per m.
+  std::vector<double> cm(nb,1.0), cmPrev(nb,0), sumZ(nb), sumR(nb), gZ(nb,0), gR(nb,0), gPhi(nb,0);
+  const int *pr=&jr[0], *pz=&jz[0], *pphi=&jphi[0];
+  const char *pbelow=&below[0], *pinside=&inside[0];
+  for (int m=0; m<N; m++)
+    {
+      if (m==1){
+	for (int j=0;j<nb;j++){
+	  cmPrev[j]=cm[j];
+	  cm[j]=c1[j];
+	}
+      } else if (m>1){
+	for (int j=0;j<nb;j++){
+	  double next=2*c1[j]*cm[j]-cmPrev[j];
+	  cmPrev[j]=cm[j];
+	  cm[j]=next;
+	}
+      }
+      std::fill(sumZ.begin(),sumZ.end(),0.0);
+      std::fill(sumR.begin(),sumR.end(),0.0);
+      for (int n=0; n<N; n++)
+	{
+	  int mn=m*N+n;
+	  //factors that belong to the field point are scalars here, the source ones are gathered from the tables.
+	  double rmnAt=gridRmn[mn*gridNr+ir];
+	  double coshZ=gridCoshZ[mn*gridNz+iz], coshLZ=gridCoshLZ[mn*gridNz+iz];
+	  double primeA=gridRPrimeA[mn*gridNr+ir], primeB=gridRPrimeB[mn*gridNr+ir];
+	  double sinBzAt=gridSinBz[n*gridNz+iz];
+	  const double *rmn=&gridRmn[mn*gridNr], *rmn1=&gridRmn1[mn*gridNr], *rmn2=&gridRmn2[mn*gridNr];
+	  const double *sinhZ=&gridSinhZ[mn*gridNz], *sinhLZ=&gridSinhLZ[mn*gridNz];
+	  const double *sinBz=&gridSinBz[n*gridNz];
+	  for (int j=0;j<nb;j++){
+	    double zterm=pbelow[j]?coshZ*sinhLZ[pz[j]]:-coshLZ*sinhZ[pz[j]];
+	    sumZ[j]+=rmnAt*rmn[pr[j]]*zterm;
+	    double rterm=pinside[j]?primeA*rmn2[pr[j]]:rmn1[pr[j]]*primeB;
+	    sumR[j]+=sinBzAt*sinBz[pz[j]]*rterm;
+	  }
+	  //those sources sit at iz1==iz (ir1==ir), so half the jump is a scalar for this order.
+	  double halfJumpZ=0.5*rmnAt*(coshZ*sinhLZ[iz]+coshLZ*sinhZ[iz]);
+	  for (size_t s=0;s<sameZ.size();s++){
+	    int j=sameZ[s];
+	    sumZ[j]+=halfJumpZ*rmn[pr[j]];
+	  }
+	  double halfJumpR=0.5*sinBzAt*(primeA*rmn2[ir]-rmn1[ir]*primeB);
+	  for (size_t s=0;s<sameR.size();s++){
+	    int j=sameR[s];
+	    sumR[j]+=halfJumpR*sinBz[pz[j]];
+	  }
+	}
+      double weight=(m==0)?1:2;
+      for (int j=0;j<nb;j++){
+	gZ[j]+=weight*cm[j]*sumZ[j];
+	gR[j]+=weight*cm[j]*sumR[j];
+      }
+    }
+  for (int k=0; k<N; k++)
+    {
+      for (int n=0; n<N; n++)
+	{
+	  int nk=n*N+k;
+	  double at=gridSinBz[n*gridNz+iz]*gridRnk[nk*gridNr+ir];
+	  const double *sinBz=&gridSinBz[n*gridNz], *rnk=&gridRnk[nk*gridNr], *sinhPhi=&gridSinhPhi[nk*gridNphi];
+	  for (int j=0;j<nb;j++)
+	    gPhi[j]+=at*sinBz[pz[j]]*rnk[pr[j]]*sinhPhi[pphi[j]];
+	}
+    }
+  for (int j=0;j<nb;j++){
+    int i=src[j];
+    ez[i]=gZ[j]/(2.0*pi);
+    er[i]=gR[j]/(L*pi);
+    ephi[i]=phiSign[j]*gPhi[j]/(L*r);
+  }
+  //the batch sums every term for each of the three components.
+  statCalls.fetch_add(3ULL*nb,std::memory_order_relaxed);
+  statTerms.fetch_add(3ULL*nb*N*N,std::memory_order_relaxed);
+  return;
+}
+
+
+double Rossegger::Ez(double r, double phi, double z, double r1, double phi1, double z1, int *nTerms) const
 {
-  //if(fByFile && fabs(r-r1)>MinimumDR && fabs(z-z1)>MinimumDZ) return ByFileEZ(r,phi,z,r1,phi1,z1);
   //  Check input arguments for sanity...
   int error=0;
   if (r<a    || r>b)         error=1;
@@ -420,10 +1162,30 @@ double Rossegger::Ez(double r, double phi, double z, double r1, double phi1, dou
       return 0;
     }
 
+  if (fByFile){
+    double sign;
+    double dphi=FoldPhi(phi,phi1,&sign);
+    CountTerms(0,true,nTerms);
+    return Interpolate(tableEz,r,z,r1,z1,dphi);
+  }
+
+  int ir=GridIndex(r,gridR0,gridDr,gridNr), ir1=GridIndex(r1,gridR0,gridDr,gridNr);
+  int iz=GridIndex(z,gridZ0,gridDz,gridNz), iz1=GridIndex(z1,gridZ0,gridDz,gridNz);
+  int nUsed=0;
+  bool converged=false;
+  if (!verbosity && ir>=0 && ir1>=0 && iz>=0 && iz1>=0){
+    double G=EzOnGrid(ir,phi,iz,z,ir1,phi1,iz1,z1,&nUsed,&converged);
+    CountTerms(nUsed,converged,nTerms);
+    return G;
+  }
+
   double G=0;
-  for (int m=0; m<NumberOfOrders; m++)
+  int nSmallM=0;
+  for (int m=0; m<NumberOfOrders && !converged; m++)
     {
       if (verbosity) cout << endl << m;
+      double Gm=G; //G before this m, so we can tell how much the whole m contributed.
+      int nSmallN=0;
       for (int n=0; n<NumberOfOrders; n++)
 	{
 	  if (verbosity) cout << " " << n;
@@ -433,7 +1195,11 @@ double Rossegger::Ez(double r, double phi, double z, double r1, double phi1, dou
 	  if (verbosity) cout << " " << term; 
 	  term *= Rmn(m,n,r)*Rmn(m,n,r1)/N2mn[m][n];
 	  if (verbosity) cout << " " << term; 
-	  if (z<z1)
+	  if (SameCoordinate(z,z1))
+	    {
+	      term *= 0.5*(cosh(Betamn[m][n]*z)*sinh(Betamn[m][n]*(L-z1))-cosh(Betamn[m][n]*(L-z))*sinh(Betamn[m][n]*z1))/sinh(Betamn[m][n]*L);
+	    }
+	  else if (z<z1)
 	    {
 	      term *=  cosh(Betamn[m][n]*z)*sinh(Betamn[m][n]*(L-z1))/sinh(Betamn[m][n]*L);
 	    }
@@ -443,19 +1209,22 @@ double Rossegger::Ez(double r, double phi, double z, double r1, double phi1, dou
 	    }
 	  if (verbosity) cout << " " << term; 
 	  G += term;
+	  nUsed++;
 	  if (verbosity) cout << " " << term << " " << G << endl;
+	  if (Converged(term,G-Gm,&nSmallN)) break;
 	}
+      converged=Converged(G-Gm,G,&nSmallM);
     }
   if (verbosity) cout << "Ez = " << G << endl;
+  CountTerms(nUsed,converged,nTerms);
 
   return G;
 }
 
 
-double Rossegger::Er(double r, double phi, double z, double r1, double phi1, double z1)
+double Rossegger::Er(double r, double phi, double z, double r1, double phi1, double z1, int *nTerms) const
 {
   //field at r, phi, z due to unit charge at r1, phi1, z1;
-  //if(fByFile && fabs(r-r1)>MinimumDR && fabs(z-z1)>MinimumDZ) return ByFileER(r,phi,z,r1,phi1,z1);
   //  Check input arguments for sanity...
   int error=0;
   if (r<a    || r>b)         error=1;
@@ -477,9 +1246,29 @@ double Rossegger::Er(double r, double phi, double z, double r1, double phi1, dou
       return 0;
     }
 
+  if (fByFile){
+    double sign;
+    double dphi=FoldPhi(phi,phi1,&sign);
+    CountTerms(0,true,nTerms);
+    return Interpolate(tableEr,r,z,r1,z1,dphi);
+  }
+
+  int ir=GridIndex(r,gridR0,gridDr,gridNr), ir1=GridIndex(r1,gridR0,gridDr,gridNr);
+  int iz=GridIndex(z,gridZ0,gridDz,gridNz), iz1=GridIndex(z1,gridZ0,gridDz,gridNz);
+  int nUsed=0;
+  bool converged=false;
+  if (!verbosity && ir>=0 && ir1>=0 && iz>=0 && iz1>=0){
+    double G=ErOnGrid(ir,r,phi,iz,ir1,r1,phi1,iz1,&nUsed,&converged);
+    CountTerms(nUsed,converged,nTerms);
+    return G;
+  }
+
   double G=0;
-  for (int m=0; m<NumberOfOrders; m++)
+  int nSmallM=0;
+  for (int m=0; m<NumberOfOrders && !converged; m++)
     {
+      double Gm=G; //G before this m, so we can tell how much the whole m contributed.
+      int nSmallN=0;
       for (int n=0; n<NumberOfOrders; n++)
 	{
 	  double term = 1/(L*pi);
@@ -489,7 +1278,11 @@ double Rossegger::Er(double r, double phi, double z, double r1, double phi1, dou
 	  double BetaN = (n+1)*pi/L;
 	  term *= sin(BetaN*z)*sin(BetaN*z1);
 
-	  if (r<r1)
+	  if (SameCoordinate(r,r1))
+	    {
+	      term *= 0.5*(RPrime(m,n,a,r)*Rmn2(m,n,r1)+Rmn1(m,n,r1)*RPrime(m,n,b,r));
+	    }
+	  else if (r<r1)
 	    {
 	      term *= RPrime(m,n,a,r)*Rmn2(m,n,r1);
 	    }
@@ -501,15 +1294,19 @@ double Rossegger::Er(double r, double phi, double z, double r1, double phi1, dou
 	  term /= BesselI(m,BetaN*a)*BesselK(m,BetaN*b)-BesselI(m,BetaN*b)*BesselK(m,BetaN*a);
 
 	  G += term;
+	  nUsed++;
+	  if (Converged(term,G-Gm,&nSmallN)) break;
 	}
+      converged=Converged(G-Gm,G,&nSmallM);
     }
 
   if (verbosity) cout << "Er = " << G << endl;
+  CountTerms(nUsed,converged,nTerms);
 
   return G;
 }
 
-double Rossegger::Ephi(double r, double phi, double z, double r1, double phi1, double z1)
+double Rossegger::Ephi(double r, double phi, double z, double r1, double phi1, double z1, int *nTerms) const
 {
   //compute field at rphiz from charge at r1phi1z1
   //  Check input arguments for sanity...
@@ -533,116 +1330,67 @@ double Rossegger::Ephi(double r, double phi, double z, double r1, double phi1, d
       return 0;
     }
 
+  if (fByFile){
+    double sign;
+    double dphi=FoldPhi(phi,phi1,&sign);
+    CountTerms(0,true,nTerms);
+    return sign*Interpolate(tableEphi,r,z,r1,z1,dphi);
+  }
+
+  int ir=GridIndex(r,gridR0,gridDr,gridNr), ir1=GridIndex(r1,gridR0,gridDr,gridNr);
+  int iz=GridIndex(z,gridZ0,gridDz,gridNz), iz1=GridIndex(z1,gridZ0,gridDz,gridNz);
+  int nUsed=0;
+  bool converged=false;
+  if (phi==phi1){
+    //the charge is in the r-z plane of the field point, so by symmetry it can't push in phi.
+    CountTerms(0,true,nTerms);
+    return 0;
+  }
+  if (!verbosity && ir>=0 && ir1>=0 && iz>=0 && iz1>=0){
+    double G=EphiOnGrid(ir,r,phi,iz,ir1,phi1,iz1,&nUsed,&converged);
+    CountTerms(nUsed,converged,nTerms);
+    return G;
+  }
+
   double G=0;
-  //Rossegger Eqn. 5.66:
-  for (int k=0; k<NumberOfOrders; k++) //off by one from Rossegger convention!
+  int nSmallK=0;
+  //Rossegger Eqn. 5.66:  the potential goes as cosh(Munk*(pi-|phi-phi1|))/(Munk*sinh(Munk*pi)), and Ephi=-1/r dV/dphi.
+  //this used to have sinh(Munk*pi*(phi-phi1)) in the numerator, which grows with the separation and overflows past ~1.5 rad.
+  for (int k=0; k<NumberOfOrders && !converged; k++) //off by one from Rossegger convention!
     {
       if (verbosity) cout << "\nk=" << k;
+      double Gk=G; //G before this k, so we can tell how much the whole k contributed.
+      int nSmallN=0;
       for (int n=0; n<NumberOfOrders; n++) //off by one from Rossegger convention!
 	{
 	  if (verbosity) cout << " n=" << n;
 	  double BetaN = (n+1)*pi/L;	  
-	  double term = 1/L;
-	  if (verbosity) cout << " 1/L=" << term; 
+	  double term = 1/(L*r);
+	  if (verbosity) cout << " 1/(Lr)=" << term; 
 	  term *= sin(BetaN*z)*sin(BetaN*z1);
 	  if (verbosity) cout << " *sinsin=" << term; 
 	  term *= Rnk(n,k,r)*Rnk(n,k,r1)/N2nk[n][k];
 	  if (verbosity) cout << " *rnkrnk/nnknnk=" << term; 
 	  if (phi<phi1)
 	    {
-	      term *=  sinh(Munk[n][k]*pi*(phi1-phi));
-	      //term *=  Munk[n][k]*sinh(Munk[n][k]*pi*(phi1-phi));
-	      //this originally has a factor of Munk in front, but that cancels with one in the denominator
+	      term *=  sinh(Munk[n][k]*(pi-(phi1-phi)));
+	      //this originally has a factor of Munk in front, from the derivative, but that cancels with one in the denominator
 	    }
 	  else
 	    {
-	      term *=  -sinh(Munk[n][k]*pi*(phi-phi1));
-	      //term *=  -Munk[n][k]*sinh(Munk[n][k]*pi*(phi-phi1));
-	      //this originally has a factor of Munk in front, but that cancels with one in the denominator
+	      term *= -sinh(Munk[n][k]*(pi-(phi-phi1)));
 	    }
 	  if (verbosity) cout << " *sinh=" << term;
 	  term *= 1/(sinh(pi*Munk[n][k]));
-	  //term *= 1/(Munk[n][k]*sinh(pi*Munk[n][k]));
-	      //this originally has a factor of Munk in front, but that cancels with one in the numerator
 	  G += term;
+	  nUsed++;
 	  if (verbosity) cout << "  /sinh=" << term << " G=" << G << endl;
+	  if (Converged(term,G-Gk,&nSmallN)) break;
 	}
+      converged=Converged(G-Gk,G,&nSmallK);
     }
   if (verbosity) cout << "Ephi = " << G << endl;
+  CountTerms(nUsed,converged,nTerms);
  
   return G;
 }
-
-
-void Rossegger::LoadCsvToHist(TH2** hist, char* sourcefile){
-  cout << "trying to load " << sourcefile << endl;
-  std::ifstream inf(sourcefile);
-  string line;
-  string token;
-  printf("opened.\n");
-  printf("status? %d\n",inf.is_open()?1:0);
-  //    inf>>line;
-  //  printf("%s\n",line.c_str());
-
-  double val[3];//={-12345,-12345,-12345};
-  double mu, x, f;
-  
-  //delete hist; // get rid of it if we already had it around.
-
-  //read the histogram bounds from the file:
-  string axisname[2];
-  double firstelement[2];
-  double lastelement[2];
-  int nsteps[2];
-  double stepsize[2];
-  double lbound[2];
-  double ubound[2];
-  for (int i=0;(i<2 && !inf.eof());i++){
-    inf>>line;
-    cout << line << endl;
-    //printf("%s\n",line.c_str());
-    stringstream lineparser(line);
-    getline(lineparser,token,',');
-    axisname[i]=token;
-    getline(lineparser,token,',');
-    firstelement[i]=std::stod(token);
-    getline(lineparser,token,',');
-    lastelement[i]=std::stod(token);
-    getline(lineparser,token,',');
-    nsteps[i]=std::stoi(token);
-    stepsize[i]=(lastelement[i]-firstelement[i])/(nsteps[i]-1);
-    lbound[i]=firstelement[i]-stepsize[i]/2;
-    ubound[i]=lastelement[i]+stepsize[i]/2;
-    printf("loaded axis=%s,limits=%f,%f,steps=%d from file\n",axisname[i].c_str(),firstelement[i],lastelement[i],nsteps[i]);
-
-  }
-
-  
-
-  
-  *hist=new TH2D(sourcefile,Form("%s;%s;%s",sourcefile,axisname[0].c_str(),axisname[1].c_str()),
-		nsteps[0],lbound[0],ubound[0],
-		nsteps[1],lbound[1],ubound[1]);
-  printf("hist has name %s, xaxis bins=%d\n",(*hist)->GetName(),(*hist)->GetXaxis()->GetNbins());
-  int nlines=0;
-  while (!inf.eof()){
-    inf>>line;//mu>>x>>val;
-    //printf("%s\n",line.c_str());
-    stringstream lineparser(line);
-    for (int i=0;i<3;i++){
-      getline(lineparser,token,',');
-      //printf("token=%s\n",token.c_str());
-      val[i]=std::stod(token);
-      //printf("double=%f\n",val[i]);
-    }
-    mu=val[0];
-    x=val[1];
-    f=val[2];
-    //printf("loaded %f,%f,%f from file\n",mu,x,f);
-    (*hist)->Fill(mu,x,f);
-    nlines++;
-    //if(nlines>100) assert(1==2);
-  }
-    
-  return;
-}
@@ -19,35 +19,74 @@
 
 #define NumberOfOrders 15  // Convergence problems after 15; Rossegger used 30
 #include <string>
-#include <map>
+#include <vector>
+#include <atomic>
 
-class TH2;
-class TH2D;
-class TH3;
+class ImaginaryBesselTable;
 
 class Rossegger
 {
  public:
-  Rossegger(std::string filename);
-  Rossegger(double a=30, double b=80, double L=80);
-  virtual ~Rossegger() {}
-
+  Rossegger(std::string filename); //load a table written by SaveGreensTable, and interpolate it instead of summing the series.
+  Rossegger(double a=30, double b=80, double L=80, std::string cacheDir=""); //if cacheDir is set, the zero tables are saved to and reloaded from there.
+  virtual ~Rossegger(); //frees the Limu/Kimu tables.
+
+  //  Threading:  everything below that is const only reads tables that are fixed once the constructor (and
+  //  PrecomputeGrid and SetTolerance, if used) are done, so one object can be shared by any number of threads.
+  //  The exceptions are the term statistics, which are kept atomically, and verbose output, which goes to cout
+  //  unsynchronized and is only meant for looking at single calls by hand.
   void Verbosity(int v) {verbosity=v;}
-  double Rmn (int m, int n, double r);  //Rmn function from Rossegger
-  double Rmn_for_zeroes (int m, double x);  //Rmn function from Rossegger, as used to find Betamn zeroes.
-  double Rmn1(int m, int n, double r);  //Rmn1 function from Rossegger
-  double Rmn2(int m, int n, double r);  //Rmn2 function from Rossegger
-  double RPrime(int m, int n, double a, double r);  // RPrime function from Rossegger
+  double GetInnerRadius() const {return a;}
+  double GetOuterRadius() const {return b;}
+  double GetHalfLength() const {return L;}
+  double Rmn (int m, int n, double r) const;  //Rmn function from Rossegger
+  double Rmn_for_zeroes (int m, double x) const;  //Rmn function from Rossegger, as used to find Betamn zeroes.
+  double Rmn1(int m, int n, double r) const;  //Rmn1 function from Rossegger
+  double Rmn2(int m, int n, double r) const;  //Rmn2 function from Rossegger
+  double RPrime(int m, int n, double a, double r) const;  // RPrime function from Rossegger
   
-  double Rnk(int n, int k, double r);  //Rnk function from Rossegger
-  double Rnk_for_zeroes(int n, double mu);  //Rnk function from Rossegger, as used to find munk zeroes.
-
-  double Limu(double mu, double x); //Bessel functions of purely imaginary order
-  double Kimu(double mu, double x); //Bessel functions of purely imaginary order
-
-  double Ez  (double r, double phi, double z, double r1, double phi1, double z1);
-  double Er  (double r, double phi, double z, double r1, double phi1, double z1);
-  double Ephi(double r, double phi, double z, double r1, double phi1, double z1);
+  double Rnk(int n, int k, double r) const;  //Rnk function from Rossegger
+  double Rnk_for_zeroes(int n, double mu) const;  //Rnk function from Rossegger, as used to find munk zeroes.
+
+  double Limu(double mu, double x) const; //Bessel functions of purely imaginary order
+  double Kimu(double mu, double x) const; //Bessel functions of purely imaginary order
+  void Limu(int n, const double *mu, const double *x, double *out) const; //the same, for n points at once
+  void Kimu(int n, const double *mu, const double *x, double *out) const;
+
+  //  nTerms, if given, gets the number of series terms that went into the result.
+  double Ez  (double r, double phi, double z, double r1, double phi1, double z1, int *nTerms=0) const;
+  double Er  (double r, double phi, double z, double r1, double phi1, double z1, int *nTerms=0) const;
+  double Ephi(double r, double phi, double z, double r1, double phi1, double z1, int *nTerms=0) const;
+  //  All three components at one field point from n sources, into er[i], ephi[i], ez[i].  When the points are on the
+  //  precomputed grid and every order is summed (tolerance 0), this loops over orders outside and sources inside, so
+  //  the work vectorizes across sources.  Otherwise each source gets the one-at-a-time calculation.
+  void Efield(double r, double phi, double z, int n, const double *r1, const double *phi1, const double *z1,
+	      double *er, double *ephi, double *ez) const;
+
+  //  Series truncation:  with a tolerance>0, each sum (over the inner order, and over the outer order) stops once two
+  //  successive terms change it by less than tolerance*|sum so far|.  The default of 0 sums all the orders, as before.
+  void SetTolerance(double tol) {tolerance=tol;}
+  double GetTolerance() const {return tolerance;}
+  //  Running totals of how much of the series the field calls have needed, so we can see whether NumberOfOrders is
+  //  what limits the accuracy.  'Unconverged' calls are ones that ran out of orders before meeting the tolerance.
+  void ResetTermStats() {statCalls=statTerms=statUnconverged=0;}
+  void PrintTermStats() const;
+
+  //  The radial parts of each series term depend only on (m,n,r) and the z parts only on (m,n,z), so if the
+  //  field and source points always sit on a fixed grid, we can tabulate those once and have Ez/Er/Ephi reduce
+  //  to a dot product over orders.  Points that are not on the grid still get the full calculation.
+  //  With nphi>0, the phi factor of Ephi is tabulated too, for phi separations that are multiples of dphi (i<nphi).
+  void PrecomputeGrid(int nr, double r0, double dr, int nz, double z0, double dz, int nphi=0, double dphi=0);
+
+  //  Tabulated mode:  SaveGreensTable sums the series for all three components on an nr x nz x nr x nz x nphi grid of
+  //  (r, z, r1, z1, |phi-phi1|), by default running from a to b, 0 to L and 0 to pi, and writes them to a binary file.
+  //  An object made from that file answers Er/Ez/Ephi by multilinear interpolation, with no Bessel functions at all, so
+  //  each detector geometry only pays for the series once.  With cellCenters, the grid is instead the centers of nr x nz
+  //  cells and the separations of nphi phi bins, as AnnularFieldSim uses, and lookups on that binning are exact.
+  //  (See generate_greens_table.C.)
+  void SaveGreensTable(std::string filename, int nr, int nz, int nphi, bool cellCenters=false);
+  bool ByFile() const {return fByFile;}
+  unsigned long long TableChecksum() const {return tableChecksum;} // identifies the loaded table, 0 if there is none.
 
  protected:
   bool fByFile;
@@ -59,21 +98,65 @@ class Rossegger
 
   double MinimumDR, MinimumDPHI, MinimumDZ;
 
-  double FindNextZero(double xstart, double epsilon, int order, double (Rossegger::*func)(int, double));  // Routine to find zeroes of func.
-  void FindBetamn(double epsilon);  // Routine used to fill the Betamn array with resolution epsilon...
-  void FindMunk(double epsilon);    // Routine used to fill the Munk array with resolution epsilon...
+  double FindNextZero(double xstart, double step, double epsilon, int order, double (Rossegger::*func)(int, double) const);  // Routine to find zeroes of func.
+  double BrentZero(double x0, double x1, double f0, double f1, double epsilon, int order, double (Rossegger::*func)(int, double) const); // zero of func inside [x0,x1], which must bracket one.
+  void FindBetamn(double step, double epsilon);  // Routine used to fill the Betamn array, scanning in 'step' and resolving to epsilon...
+  void FindMunk(double step, double epsilon);    // Routine used to fill the Munk array, scanning in 'step' and resolving to epsilon...
+
+  //  The zero and normalization tables only depend on the geometry, the number of orders and the Limu/Kimu tables,
+  //  so they can be cached on disk instead of being re-found by every job.
+  unsigned long long ZeroCacheKey() const;
+  std::string ZeroCacheFilename(std::string cacheDir) const;
+  bool LoadZeroCache(std::string cacheDir);
+  void SaveZeroCache(std::string cacheDir);
+
+  void LoadImaginaryBesselTables(); //from limu_table.csv and kimu_table.csv if they are there, otherwise generated.
+  double MunkUpperBound() const; //a mu past the last Munk zero we look for, so the tables can be made to reach it.
+
+  int GridIndex(double x, double x0, double dx, int n) const; // index of x on the precomputed grid, or -1 if it isn't on it.
+  double EzOnGrid  (int ir, double phi, int iz, double z, int ir1, double phi1, int iz1, double z1, int *nTerms, bool *converged) const;
+  double ErOnGrid  (int ir, double r, double phi, int iz, int ir1, double r1, double phi1, int iz1, int *nTerms, bool *converged) const;
+  double EphiOnGrid(int ir, double r, double phi, int iz, int ir1, double phi1, int iz1, int *nTerms, bool *converged) const;
+
+  //  Where the field point shares the charge's r (or z), the truncated Er (Ez) series jumps between its r<r1 and r>r1
+  //  forms, by a smeared-out copy of the charge's delta function, and which form we got used to depend on the last bit of
+  //  the positions.  The full series converges to the midpoint of a jump, so that is what we return there.
+  bool SameCoordinate(double x, double x1) const;
+  double FoldPhi(double phi, double phi1, double *sign) const; // |phi-phi1| folded into [0,pi], and the sign Ephi picks up doing so.
+  double Interpolate(const std::vector<float> &table, double r, double z, double r1, double z1, double dphi) const;
+
+  bool Converged(double change, double sum, int *nSmall) const; // true once 'change' has been within tolerance of 'sum' twice running.
+  void CountTerms(int nTerms, bool converged, int *nTermsOut) const; // adds a call to the running totals.
 
-  void LoadCsvToHist(TH2** hist, char* filename);
+  double tolerance;
+  mutable std::atomic<unsigned long long> statCalls, statTerms, statUnconverged; // atomic, since the lookups call us from many threads.
 
   double Betamn[NumberOfOrders][NumberOfOrders];  //  Betamn array from Rossegger
   double N2mn[NumberOfOrders][NumberOfOrders];    //  N2mn array from Rossegger
   double Munk[NumberOfOrders][NumberOfOrders];    //  Munk array from Rossegger
   double N2nk[NumberOfOrders][NumberOfOrders];    //  N2nk array from Rossegger
 
-  TH2 *Tags;
-  TH2 *hLimu;
-  TH2 *hKimu;
-  std::map<std::string, TH3*> Grid;
+  //  Basis tables for PrecomputeGrid.  (m,n) tables are indexed [(m*NumberOfOrders+n)*nr+ir] or [...*nz+iz],
+  //  the ones that only depend on n are [n*nz+iz].  The tables only ever looked up at the source point have the
+  //  series normalization (N2mn, N2nk, or the Er denominator) divided in already.
+  int gridNr, gridNz;
+  double gridR0, gridDr, gridZ0, gridDz;
+  std::vector<double> gridRmn, gridRmn1, gridRmn2, gridRPrimeA, gridRPrimeB, gridRnk; // radial functions at each r, Rmn1 and Rmn2 over the Er denominator
+  std::vector<double> gridCoshZ, gridCoshLZ, gridSinhZ, gridSinhLZ; // Betamn z terms at each z, the sinh ones already divided by sinh(Betamn L)*N2mn
+  std::vector<double> gridSinBz; // sin(BetaN z) at each z
+  int gridNphi;
+  double gridDphi;
+  std::vector<double> gridSinhPhi; // sinh(Munk*(pi-|dphi|))/(sinh(Munk*pi)*N2nk) at each phi separation, indexed [(n*NumberOfOrders+k)*nphi+iphi]
+
+  //  Tables for the tabulated mode, indexed [(((ir*nz+iz)*nr+ir1)*nz+iz1)*nphi+iphi], on r=tableR0+ir*tableDr,
+  //  z=tableZ0+iz*tableDz, |dphi|=iphi*tableDphi.
+  int tableNr, tableNz, tableNphi;
+  double tableR0, tableDr, tableZ0, tableDz, tableDphi;
+  std::vector<float> tableEr, tableEphi, tableEz;
+  unsigned long long tableChecksum;
+
+  const ImaginaryBesselTable *limuTable;
+  const ImaginaryBesselTable *kimuTable;
 
 };
 
@@ -0,0 +1,91 @@
+#include "SimpleFFT.h"
+#include <math.h>
+
+SimpleFFT::SimpleFFT(int in_n){
+  n=in_n;
+  m=1;
+  while (m<n) m*=2;
+  bluestein=(m!=n);
+  if (bluestein){
+    //the chirp-z trick needs a linear convolution of length 2n-1 to fit without wrapping.
+    m=1;
+    while (m<2*n-1) m*=2;
+  }
+
+  twiddle.resize(m/2);
+  for (int k=0;k<m/2;k++)
+    twiddle[k]=std::polar(1.0,-2*M_PI*k/m);
+
+  if (bluestein){
+    chirp.resize(n);
+    for (long k=0;k<n;k++){
+      //reduce k^2 mod 2n before scaling, so the angle stays accurate for large k.
+      long k2=(k*k)%(2*n);
+      chirp[k]=std::polar(1.0,-M_PI*k2/n);
+    }
+    chirpFilter.assign(m,std::complex<double>(0,0));
+    chirpFilter[0]=std::conj(chirp[0]);
+    for (int k=1;k<n;k++){
+      chirpFilter[k]=std::conj(chirp[k]);
+      chirpFilter[m-k]=std::conj(chirp[k]);
+    }
+    Radix2(&chirpFilter[0],false);
+  }
+  return;
+}
+
+void SimpleFFT::Forward(std::complex<double> *data) const{
+  Transform(data,false);
+  return;
+}
+
+void SimpleFFT::Inverse(std::complex<double> *data) const{
+  Transform(data,true);
+  for (int i=0;i<n;i++)
+    data[i]/=n;
+  return;
+}
+
+void SimpleFFT::Transform(std::complex<double> *data, bool inverse) const{
+  if (!bluestein){
+    Radix2(data,inverse);
+    return;
+  }
+  //an inverse transform is a forward transform of the conjugate, conjugated.
+  std::vector<std::complex<double> > work(m,std::complex<double>(0,0));
+  for (int k=0;k<n;k++)
+    work[k]=(inverse?std::conj(data[k]):data[k])*chirp[k];
+  Radix2(&work[0],false);
+  for (int k=0;k<m;k++)
+    work[k]*=chirpFilter[k];
+  Radix2(&work[0],true);
+  for (int k=0;k<n;k++){
+    std::complex<double> x=work[k]*(1.0/m)*chirp[k];
+    data[k]=inverse?std::conj(x):x;
+  }
+  return;
+}
+
+void SimpleFFT::Radix2(std::complex<double> *data, bool inverse) const{
+  //in-place iterative cooley-tukey on m points.  unnormalized in both directions.
+  for (int i=1,j=0;i<m;i++){
+    int bit=m>>1;
+    for (;j&bit;bit>>=1)
+      j^=bit;
+    j^=bit;
+    if (i<j) std::swap(data[i],data[j]);
+  }
+  for (int len=2;len<=m;len*=2){
+    int stride=m/len;
+    for (int i=0;i<m;i+=len){
+      for (int k=0;k<len/2;k++){
+	std::complex<double> w=inverse?std::conj(twiddle[k*stride]):twiddle[k*stride];
+	std::complex<double> u=data[i+k];
+	std::complex<double> v=data[i+k+len/2]*w;
+	data[i+k]=u+v;
+	data[i+k+len/2]=u-v;
+      }
+    }
+  }
+  return;
+}
@@ -0,0 +1,36 @@
+#ifndef __SIMPLEFFT_H__
+#define __SIMPLEFFT_H__
+
+//
+//  A small, self-contained complex FFT of arbitrary length, so that AnnularFieldSim can do
+//  circular convolutions in phi without depending on an external FFT library.
+//  Power-of-two lengths use an iterative radix-2 transform.  Any other length is mapped onto
+//  a power-of-two transform with Bluestein's chirp-z algorithm, so phi binnings like 360 or 17 work.
+//
+//  Transforms are unnormalized in the forward direction and carry the 1/n in the inverse,
+//  so Inverse(Forward(x))==x.  Forward and Inverse are const and may be called from several threads at once.
+//
+
+#include <complex>
+#include <vector>
+
+class SimpleFFT{
+ public:
+  SimpleFFT(int n);
+  int Length() const {return n;}
+  void Forward(std::complex<double> *data) const;
+  void Inverse(std::complex<double> *data) const;
+
+ private:
+  int n; //length of the transform we were asked for
+  int m; //power-of-two length of the transform we actually run (==n if n is already a power of two)
+  bool bluestein;
+  std::vector<std::complex<double> > twiddle; //exp(-2 pi i k/m) for k<m/2
+  std::vector<std::complex<double> > chirp; //exp(-pi i k^2/n) for k<n, bluestein only
+  std::vector<std::complex<double> > chirpFilter; //forward transform of the conjugate chirp, zero-padded to m.  bluestein only
+
+  void Radix2(std::complex<double> *data, bool inverse) const;
+  void Transform(std::complex<double> *data, bool inverse) const;
+};
+
+#endif /* __SIMPLEFFT_H__ */